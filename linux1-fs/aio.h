@@ -0,0 +1,314 @@
+#pragma once
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint-gcc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+/*
+ * Asynchronous block I/O engine. A batch of vectored reads/writes on one
+ * descriptor is submitted at once and aio_run returns when all of them have
+ * completed, so up to AIO_DEPTH requests are in flight instead of one.
+ * io_uring is used when the kernel allows it (raw syscalls, no liburing),
+ * otherwise a small pool of threads issues preadv/pwritev in parallel.
+ */
+
+#define AIO_DEPTH 64
+#define AIO_THREADS 4
+#define AIO_PENDING INT64_MIN  // result of a request still on the ring
+
+enum AioMode {
+    AIO_URING, AIO_THREADS_POOL
+};
+
+typedef struct AioRequest {
+    int write;
+    const struct iovec *iov;
+    int iovcnt;
+    uint64_t offset;
+    int64_t result;  // bytes transferred or -errno
+} aio_request_t;
+
+// Requests of one aio_run call, completed by the pool workers
+typedef struct AioBatch {
+    aio_request_t *reqs;
+    uint32_t count;
+    uint32_t next;       // first request not taken by a worker
+    uint32_t remaining;  // requests not completed
+    struct AioBatch *queue_next;
+} aio_batch_t;
+
+typedef struct Aio {
+    enum AioMode mode;
+    int fd;
+    pthread_mutex_t lock;  // the ring, or the pool queue
+
+    // io_uring
+    int ring_fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    uint32_t *sq_head, *sq_tail, *sq_mask, *sq_array;
+    uint32_t *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    uint32_t entries;
+
+    // thread pool
+    pthread_t threads[AIO_THREADS];
+    uint32_t started;  // threads created, aio_destroy joins these
+    pthread_cond_t work;
+    pthread_cond_t done;
+    aio_batch_t *queue;
+    int stopping;
+} aio_t;
+
+int64_t aio_do_sync(int fd, aio_request_t * req) {
+    ssize_t res = req->write ? pwritev(fd, req->iov, req->iovcnt, req->offset)
+                             : preadv(fd, req->iov, req->iovcnt, req->offset);
+    return res < 0 ? -errno : res;
+}
+
+#ifdef __NR_io_uring_setup
+int aio_uring_init(aio_t * aio) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    aio->ring_fd = syscall(__NR_io_uring_setup, AIO_DEPTH, &params);
+    if (aio->ring_fd < 0) {
+        return -1;
+    }
+
+    aio->sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    aio->cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+        aio->sq_size = aio->cq_size = aio->sq_size > aio->cq_size ? aio->sq_size : aio->cq_size;
+    }
+    aio->sq_ptr = mmap(NULL, aio->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       aio->ring_fd, IORING_OFF_SQ_RING);
+    aio->cq_ptr = single ? aio->sq_ptr : mmap(NULL, aio->cq_size, PROT_READ | PROT_WRITE,
+                                              MAP_SHARED | MAP_POPULATE, aio->ring_fd, IORING_OFF_CQ_RING);
+    aio->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    aio->sqes = mmap(NULL, aio->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     aio->ring_fd, IORING_OFF_SQES);
+    if (aio->sq_ptr == MAP_FAILED || aio->cq_ptr == MAP_FAILED || aio->sqes == MAP_FAILED) {
+        close(aio->ring_fd);
+        return -1;
+    }
+
+    uint8_t * sq = aio->sq_ptr;
+    uint8_t * cq = aio->cq_ptr;
+    aio->sq_head = (uint32_t *) (sq + params.sq_off.head);
+    aio->sq_tail = (uint32_t *) (sq + params.sq_off.tail);
+    aio->sq_mask = (uint32_t *) (sq + params.sq_off.ring_mask);
+    aio->sq_array = (uint32_t *) (sq + params.sq_off.array);
+    aio->cq_head = (uint32_t *) (cq + params.cq_off.head);
+    aio->cq_tail = (uint32_t *) (cq + params.cq_off.tail);
+    aio->cq_mask = (uint32_t *) (cq + params.cq_off.ring_mask);
+    aio->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    aio->entries = params.sq_entries;
+    return 0;
+}
+
+void aio_uring_destroy(aio_t * aio) {
+    munmap(aio->sqes, aio->sqes_size);
+    if (aio->cq_ptr != aio->sq_ptr) {
+        munmap(aio->cq_ptr, aio->cq_size);
+    }
+    munmap(aio->sq_ptr, aio->sq_size);
+    close(aio->ring_fd);
+}
+
+// Takes the completions posted so far
+void aio_uring_reap(aio_t * aio, aio_request_t * reqs, uint32_t * completed, uint32_t * in_flight) {
+    uint32_t head = *aio->cq_head;
+    uint32_t cq_tail = __atomic_load_n(aio->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != cq_tail; ++head) {
+        const struct io_uring_cqe * cqe = aio->cqes + (head & *aio->cq_mask);
+        reqs[cqe->user_data].result = cqe->res;
+        ++*completed;
+        --*in_flight;
+    }
+    __atomic_store_n(aio->cq_head, head, __ATOMIC_RELEASE);
+}
+
+void aio_uring_run(aio_t * aio, aio_request_t * reqs, uint32_t count) {
+    uint32_t submitted = 0, completed = 0, in_flight = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        reqs[i].result = AIO_PENDING;
+    }
+    while (completed < count) {
+        uint32_t tail = *aio->sq_tail;
+        uint32_t to_submit = 0;
+        while (submitted < count && in_flight < aio->entries) {
+            uint32_t slot = tail & *aio->sq_mask;
+            struct io_uring_sqe * sqe = aio->sqes + slot;
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = reqs[submitted].write ? IORING_OP_WRITEV : IORING_OP_READV;
+            sqe->fd = aio->fd;
+            sqe->addr = (uint64_t) (uintptr_t) reqs[submitted].iov;
+            sqe->len = reqs[submitted].iovcnt;
+            sqe->off = reqs[submitted].offset;
+            sqe->user_data = submitted;
+            aio->sq_array[slot] = slot;
+            ++tail;
+            ++submitted;
+            ++in_flight;
+            ++to_submit;
+        }
+        __atomic_store_n(aio->sq_tail, tail, __ATOMIC_RELEASE);
+
+        int res;
+        do {
+            res = syscall(__NR_io_uring_enter, aio->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        } while (res < 0 && errno == EINTR);
+        if (res < 0) {
+            perror("aio: io_uring_enter");
+            /*
+             * Withdraw the entries the kernel has not consumed, then let the ones it has
+             * finish: running them again could repeat a write. Completions are posted
+             * even when waiting fails, yielding lets the kernel get to them.
+             */
+            uint32_t sq_head = __atomic_load_n(aio->sq_head, __ATOMIC_ACQUIRE);
+            in_flight -= tail - sq_head;
+            __atomic_store_n(aio->sq_tail, sq_head, __ATOMIC_RELEASE);
+            aio_uring_reap(aio, reqs, &completed, &in_flight);
+            while (in_flight > 0) {
+                if (syscall(__NR_io_uring_enter, aio->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+                    sched_yield();
+                }
+                aio_uring_reap(aio, reqs, &completed, &in_flight);
+            }
+            for (uint32_t i = 0; i < count; ++i) {
+                if (reqs[i].result == AIO_PENDING) {
+                    reqs[i].result = aio_do_sync(aio->fd, reqs + i);
+                }
+            }
+            return;
+        }
+        aio_uring_reap(aio, reqs, &completed, &in_flight);
+    }
+}
+#else
+int aio_uring_init(aio_t * aio) {
+    return -1;
+}
+void aio_uring_destroy(aio_t * aio) {
+}
+void aio_uring_run(aio_t * aio, aio_request_t * reqs, uint32_t count) {
+}
+#endif
+
+void * aio_worker(void * arg) {
+    aio_t * aio = arg;
+    pthread_mutex_lock(&aio->lock);
+    while (1) {
+        while (aio->queue == NULL && !aio->stopping) {
+            pthread_cond_wait(&aio->work, &aio->lock);
+        }
+        if (aio->queue == NULL) {
+            break;
+        }
+
+        aio_batch_t * batch = aio->queue;
+        aio_request_t * req = batch->reqs + batch->next++;
+        if (batch->next == batch->count) {
+            aio->queue = batch->queue_next;
+        }
+        pthread_mutex_unlock(&aio->lock);
+        req->result = aio_do_sync(aio->fd, req);
+        pthread_mutex_lock(&aio->lock);
+        if (--batch->remaining == 0) {
+            pthread_cond_broadcast(&aio->done);
+        }
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return NULL;
+}
+
+void aio_pool_run(aio_t * aio, aio_request_t * reqs, uint32_t count) {
+    aio_batch_t batch = {.reqs = reqs, .count = count, .next = 0, .remaining = count, .queue_next = NULL};
+    pthread_mutex_lock(&aio->lock);
+    aio_batch_t ** link = &aio->queue;
+    while (*link != NULL) {
+        link = &(*link)->queue_next;
+    }
+    *link = &batch;
+    pthread_cond_broadcast(&aio->work);
+    while (batch.remaining != 0) {
+        pthread_cond_wait(&aio->done, &aio->lock);
+    }
+    pthread_mutex_unlock(&aio->lock);
+}
+
+// Tries io_uring first unless force_threads is set, returns 0 on success. aio_destroy cleans up either way
+int aio_init(aio_t * aio, int fd, int force_threads) {
+    memset(aio, 0, sizeof(aio_t));
+    aio->fd = fd;
+    pthread_mutex_init(&aio->lock, NULL);
+    if (!force_threads && aio_uring_init(aio) == 0) {
+        aio->mode = AIO_URING;
+        return 0;
+    }
+
+    aio->mode = AIO_THREADS_POOL;
+    pthread_cond_init(&aio->work, NULL);
+    pthread_cond_init(&aio->done, NULL);
+    for (; aio->started < AIO_THREADS; ++aio->started) {
+        errno = pthread_create(aio->threads + aio->started, NULL, aio_worker, aio);
+        if (errno != 0) {
+            perror("aio: pthread_create");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void aio_destroy(aio_t * aio) {
+    if (aio->mode == AIO_URING) {
+        aio_uring_destroy(aio);
+    } else {
+        pthread_mutex_lock(&aio->lock);
+        aio->stopping = 1;
+        pthread_cond_broadcast(&aio->work);
+        pthread_mutex_unlock(&aio->lock);
+        for (uint32_t i = 0; i < aio->started; ++i) {
+            pthread_join(aio->threads[i], NULL);
+        }
+        pthread_cond_destroy(&aio->work);
+        pthread_cond_destroy(&aio->done);
+    }
+    pthread_mutex_destroy(&aio->lock);
+}
+
+const char * aio_mode_name(const aio_t * aio) {
+    return aio->mode == AIO_URING ? "io_uring" : "threads";
+}
+
+/*
+ * Runs all requests and waits for them. The ring serves one batch at a time;
+ * a thread that finds it busy does its batch synchronously instead of waiting.
+ */
+void aio_run(aio_t * aio, aio_request_t * reqs, uint32_t count) {
+    if (aio->mode == AIO_THREADS_POOL) {
+        aio_pool_run(aio, reqs, count);
+    } else if (pthread_mutex_trylock(&aio->lock) == 0) {
+        aio_uring_run(aio, reqs, count);
+        pthread_mutex_unlock(&aio->lock);
+    } else {
+        for (uint32_t i = 0; i < count; ++i) {
+            reqs[i].result = aio_do_sync(aio->fd, reqs + i);
+        }
+    }
+}
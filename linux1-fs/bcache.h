@@ -0,0 +1,176 @@
+#pragma once
+
+#include <errno.h>
+#include <stdint-gcc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "stats.h"
+
+/*
+ * Buffer cache: fixed number of block-sized frames indexed by block number.
+ * Replacement is CLOCK (second chance): a hit sets the reference bit, the hand
+ * clears bits until it finds a frame that was not used since its last pass.
+ * Dirty frames are written back when evicted or on bcache_flush.
+ */
+
+typedef struct BufferCacheFrame {
+    uint32_t block;     // 0 - free frame, block 0 is reserved
+    uint8_t ref;
+    uint8_t dirty;
+    int32_t hash_next;
+} bcache_frame_t;
+
+typedef struct BufferCache {
+    int fd;
+    uint64_t base;  // image offset of block 0
+    uint32_t block_size;
+    uint32_t nframes;
+    uint32_t nbuckets;  // power of two
+    bcache_frame_t *frames;
+    uint8_t *data;
+    int32_t *buckets;  // -1 - empty
+    uint32_t hand;
+
+    // Sequential read detection for readahead
+    uint32_t ra_inode;
+    uint32_t ra_next;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead;
+    uint64_t writebacks;
+
+    stats_t *stats;  // NULL - write-backs are not counted
+} bcache_t;
+
+bcache_t * bcache_create(uint32_t nframes, uint32_t block_size, int fd, uint64_t base) {
+    bcache_t * cache = calloc(1, sizeof(bcache_t));
+    cache->fd = fd;
+    cache->base = base;
+    cache->block_size = block_size;
+    cache->nframes = nframes;
+    cache->nbuckets = 1;
+    while (cache->nbuckets < nframes * 2) {
+        cache->nbuckets *= 2;
+    }
+    cache->frames = calloc(nframes, sizeof(bcache_frame_t));
+    cache->data = malloc((size_t) nframes * cache->block_size);
+    cache->buckets = malloc(cache->nbuckets * sizeof(int32_t));
+    memset(cache->buckets, -1, cache->nbuckets * sizeof(int32_t));
+    return cache;
+}
+
+void bcache_destroy(bcache_t * cache) {
+    free(cache->frames);
+    free(cache->data);
+    free(cache->buckets);
+    free(cache);
+}
+
+uint8_t * bcache_frame_data(bcache_t * cache, int32_t i) {
+    return cache->data + (size_t) i * cache->block_size;
+}
+
+int32_t * bcache_bucket(bcache_t * cache, uint32_t block) {
+    return cache->buckets + ((block * 2654435761u) & (cache->nbuckets - 1));
+}
+
+int32_t bcache_find(bcache_t * cache, uint32_t block) {
+    int32_t i = *bcache_bucket(cache, block);
+    while (i >= 0 && cache->frames[i].block != block) {
+        i = cache->frames[i].hash_next;
+    }
+    return i;
+}
+
+void bcache_write_back(bcache_t * cache, int32_t i) {
+    bcache_frame_t * frame = cache->frames + i;
+    uint64_t offset = cache->base + (uint64_t) frame->block * cache->block_size;
+    uint64_t start = cache->stats ? stats_clock(cache->stats) : 0;
+    if (pwrite(cache->fd, bcache_frame_data(cache, i), cache->block_size, offset) != cache->block_size) {
+        perror("bcache: pwrite");
+    }
+    if (cache->stats) {
+        stats_io(cache->stats, 1, offset, cache->block_size, start);
+    }
+    frame->dirty = 0;
+    ++cache->writebacks;
+}
+
+// Picks a frame for a new block, writing back and unhashing its old contents
+int32_t bcache_evict(bcache_t * cache) {
+    while (1) {
+        int32_t i = cache->hand;
+        bcache_frame_t * frame = cache->frames + i;
+        cache->hand = (cache->hand + 1) % cache->nframes;
+        if (frame->block != 0 && frame->ref) {
+            frame->ref = 0;
+            continue;
+        }
+
+        if (frame->block != 0) {
+            if (frame->dirty) {
+                bcache_write_back(cache, i);
+            }
+            int32_t * link = bcache_bucket(cache, frame->block);
+            while (*link != i) {
+                link = &cache->frames[*link].hash_next;
+            }
+            *link = frame->hash_next;
+            frame->block = 0;
+        }
+        return i;
+    }
+}
+
+// Copies a cached block into buf, returns 1 on a hit
+int bcache_lookup(bcache_t * cache, uint32_t block, void * buf) {
+    int32_t i = bcache_find(cache, block);
+    if (i < 0) {
+        ++cache->misses;
+        return 0;
+    }
+    ++cache->hits;
+    cache->frames[i].ref = 1;
+    memcpy(buf, bcache_frame_data(cache, i), cache->block_size);
+    return 1;
+}
+
+int bcache_contains(bcache_t * cache, uint32_t block) {
+    return bcache_find(cache, block) >= 0;
+}
+
+// Stores the current contents of a block, dirty ones are written back later
+void bcache_insert(bcache_t * cache, uint32_t block, const void * data, int dirty) {
+    int32_t i = bcache_find(cache, block);
+    if (i < 0) {
+        i = bcache_evict(cache);
+        bcache_frame_t * frame = cache->frames + i;
+        frame->block = block;
+        frame->dirty = 0;
+        int32_t * bucket = bcache_bucket(cache, block);
+        frame->hash_next = *bucket;
+        *bucket = i;
+    }
+    cache->frames[i].ref = 1;
+    cache->frames[i].dirty |= dirty;
+    memcpy(bcache_frame_data(cache, i), data, cache->block_size);
+}
+
+// Refreshes a cached copy after the block was written to the image directly
+void bcache_update(bcache_t * cache, uint32_t block, const void * data) {
+    int32_t i = bcache_find(cache, block);
+    if (i >= 0) {
+        memcpy(bcache_frame_data(cache, i), data, cache->block_size);
+    }
+}
+
+void bcache_flush(bcache_t * cache) {
+    for (uint32_t i = 0; i < cache->nframes; ++i) {
+        if (cache->frames[i].block != 0 && cache->frames[i].dirty) {
+            bcache_write_back(cache, i);
+        }
+    }
+}
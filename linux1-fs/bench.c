@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "fs.h"
+
+/*
+ * Benchmark: every workload gets a fresh image, an untimed setup and then
+ * runs its operation ops times through the fs_* API. Each operation is timed
+ * on its own, the final fs_sync counts towards ops/sec only. Syscall and byte
+ * counts come from /proc/self/io, so io_uring transfers are not included.
+ */
+
+#define BENCH_DEFAULT_OPS 2000
+#define BENCH_DEFAULT_SEED 1
+#define BENCH_DIR_DEPTH 32        // lookup: directories on the path
+#define BENCH_DIR_SIBLINGS 8      // lookup: other entries at every level
+#define BENCH_LS_ENTRIES 4096     // ls: hard links in the listed directory
+#define BENCH_CHURN_FILES 1024    // unlink: files kept in the directory
+#define BENCH_RW_FILES 16
+#define BENCH_RW_FILE_SIZE (256 * 1024)
+#define BENCH_RW_IO_SIZE 4096
+#define BENCH_RW_READ_PERCENT 70
+#define BENCH_PATH_LEN (BENCH_DIR_DEPTH * 8 + FILE_NAME_LEN)
+
+typedef struct BenchIo {
+    uint64_t rchar, wchar, syscr, syscw;
+} bench_io_t;
+
+typedef struct Bench {
+    filesystem_t base;  // options and geometry every image is created with
+    const char *image;
+    uint32_t ops;
+    uint64_t seed;
+    int keep;           // leave the last image on disk
+
+    uint64_t rng;
+    uint64_t *latency;  // ns, one per operation
+
+    // Workload state, filled by setup
+    uint32_t dir;
+    uint32_t created;  // files made by create
+    uint32_t target;
+    char path[BENCH_PATH_LEN];
+    uint32_t files[BENCH_CHURN_FILES > BENCH_RW_FILES ? BENCH_CHURN_FILES : BENCH_RW_FILES];
+    char io_buf[BENCH_RW_IO_SIZE];
+} bench_t;
+
+typedef struct BenchWorkload {
+    const char *name;
+    const char *about;
+    int (*setup)(bench_t * b, filesystem_t * fs);
+    int (*op)(bench_t * b, filesystem_t * fs);  // 0 on success
+} bench_workload_t;
+
+uint64_t bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// xorshift64*, the same seed gives the same workload
+uint64_t bench_random(bench_t * b) {
+    b->rng ^= b->rng >> 12;
+    b->rng ^= b->rng << 25;
+    b->rng ^= b->rng >> 27;
+    return b->rng * 0x2545f4914f6cdd1dull;
+}
+
+// Leaves zeros when the kernel has no task I/O accounting
+void bench_read_io(bench_io_t * io) {
+    memset(io, 0, sizeof(bench_io_t));
+    FILE * f = fopen("/proc/self/io", "r");
+    if (f == NULL) {
+        return;
+    }
+    char key[32];
+    unsigned long long value;
+    while (fscanf(f, "%31[^:]: %llu\n", key, &value) == 2) {
+        if (strcmp(key, "rchar") == 0) {
+            io->rchar = value;
+        } else if (strcmp(key, "wchar") == 0) {
+            io->wchar = value;
+        } else if (strcmp(key, "syscr") == 0) {
+            io->syscr = value;
+        } else if (strcmp(key, "syscw") == 0) {
+            io->syscw = value;
+        }
+    }
+    fclose(f);
+}
+
+// Creates a regular file with the given contents and links it, returns its inode or 0
+uint32_t bench_add_file(filesystem_t * fs, uint32_t dir, const char * name, const void * data, uint32_t size) {
+    uint32_t inode_idx = fs_create_regular_file(fs, size, data);
+    if (inode_idx == 0) {
+        return 0;
+    }
+    if (fs_link(fs, inode_idx, name, dir) != 0) {
+        fs_release_inode(fs, inode_idx);
+        fs_op_done(fs);
+        return 0;
+    }
+    return inode_idx;
+}
+
+int bench_setup_create(bench_t * b, filesystem_t * fs) {
+    b->dir = fs_create_directory(fs, 1, "create");
+    b->created = 0;
+    return b->dir == 0;
+}
+
+int bench_op_create(bench_t * b, filesystem_t * fs) {
+    char name[FILE_NAME_LEN];
+    snprintf(name, sizeof(name), "f%u", b->created++);
+    return bench_add_file(fs, b->dir, name, name, strlen(name)) == 0;
+}
+
+int bench_setup_lookup(bench_t * b, filesystem_t * fs) {
+    uint32_t dir = 1;
+    char *end = b->path;
+    for (uint32_t level = 0; level < BENCH_DIR_DEPTH; ++level) {
+        char name[FILE_NAME_LEN];
+        for (uint32_t s = 0; s < BENCH_DIR_SIBLINGS; ++s) {
+            snprintf(name, sizeof(name), "s%u", s);
+            if (bench_add_file(fs, dir, name, name, strlen(name)) == 0) {
+                return 1;
+            }
+        }
+        snprintf(name, sizeof(name), "d%u", level);
+        dir = fs_create_directory(fs, dir, name);
+        if (dir == 0) {
+            return 1;
+        }
+        end += sprintf(end, "/%s", name);
+    }
+    sprintf(end, "/leaf");
+    b->target = bench_add_file(fs, dir, "leaf", "leaf", 4);
+    return b->target == 0;
+}
+
+int bench_op_lookup(bench_t * b, filesystem_t * fs) {
+    char path[BENCH_PATH_LEN];  // fs_parse_path cuts the path it walks
+    memcpy(path, b->path, sizeof(path));
+    return fs_parse_path(fs, path) != b->target;
+}
+
+int bench_setup_ls(bench_t * b, filesystem_t * fs) {
+    b->dir = fs_create_directory(fs, 1, "ls");
+    if (b->dir == 0) {
+        return 1;
+    }
+    // Hard links to one file, the listing is as long as with separate files
+    uint32_t inode_idx = bench_add_file(fs, b->dir, "l0", "data", 4);
+    if (inode_idx == 0) {
+        return 1;
+    }
+    for (uint32_t i = 1; i < BENCH_LS_ENTRIES; ++i) {
+        char name[FILE_NAME_LEN];
+        snprintf(name, sizeof(name), "l%u", i);
+        if (fs_link(fs, inode_idx, name, b->dir) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int bench_op_ls(bench_t * b, filesystem_t * fs) {
+    dir_iter_t it;
+    if (fs_dir_open(fs, b->dir, &it) != 0) {
+        return 1;
+    }
+    uint32_t count = 0;
+    const dir_entry_t *entry;
+    const inode_t *inode;
+    while ((entry = fs_dir_next_with_inode(&it, &inode)) != NULL) {
+        count += inode->hard_links != 0;
+    }
+    fs_dir_close(&it);
+    return count != BENCH_LS_ENTRIES + 2;
+}
+
+int bench_setup_unlink(bench_t * b, filesystem_t * fs) {
+    b->dir = fs_create_directory(fs, 1, "churn");
+    if (b->dir == 0) {
+        return 1;
+    }
+    for (uint32_t i = 0; i < BENCH_CHURN_FILES; ++i) {
+        char name[FILE_NAME_LEN];
+        snprintf(name, sizeof(name), "c%u", i);
+        if (bench_add_file(fs, b->dir, name, b->io_buf, BENCH_RW_IO_SIZE) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Replaces a random file: unlink, then create it again with one block of data
+int bench_op_unlink(bench_t * b, filesystem_t * fs) {
+    char name[FILE_NAME_LEN];
+    snprintf(name, sizeof(name), "c%u", (uint32_t) (bench_random(b) % BENCH_CHURN_FILES));
+    if (fs_unlink(fs, name, b->dir) != 0) {
+        return 1;
+    }
+    return bench_add_file(fs, b->dir, name, b->io_buf, BENCH_RW_IO_SIZE) == 0;
+}
+
+int bench_setup_rw(bench_t * b, filesystem_t * fs) {
+    char *data = malloc(BENCH_RW_FILE_SIZE);
+    for (uint32_t i = 0; i < BENCH_RW_FILE_SIZE; ++i) {
+        data[i] = (char) bench_random(b);
+    }
+    int status = 0;
+    for (uint32_t f = 0; f < BENCH_RW_FILES && status == 0; ++f) {
+        char name[FILE_NAME_LEN];
+        snprintf(name, sizeof(name), "rw%u", f);
+        b->files[f] = bench_add_file(fs, 1, name, data, BENCH_RW_FILE_SIZE);
+        status = b->files[f] == 0;
+    }
+    free(data);
+    return status;
+}
+
+// BENCH_RW_READ_PERCENT reads, the rest are overwrites, at random aligned offsets
+int bench_op_rw(bench_t * b, filesystem_t * fs) {
+    uint64_t r = bench_random(b);
+    uint32_t inode_idx = b->files[r % BENCH_RW_FILES];
+    uint64_t offset = (r >> 8) % (BENCH_RW_FILE_SIZE / BENCH_RW_IO_SIZE) * BENCH_RW_IO_SIZE;
+    if ((r >> 32) % 100 < BENCH_RW_READ_PERCENT) {
+        return fs_pread(fs, inode_idx, offset, b->io_buf, BENCH_RW_IO_SIZE) != BENCH_RW_IO_SIZE;
+    }
+    return fs_pwrite(fs, inode_idx, offset, b->io_buf, BENCH_RW_IO_SIZE) != BENCH_RW_IO_SIZE;
+}
+
+const bench_workload_t workloads[] = {
+        {"create", "create and link small files in one directory",   bench_setup_create, bench_op_create},
+        {"lookup", "resolve a path " STRINGIZE(BENCH_DIR_DEPTH) " directories deep",
+                                                                     bench_setup_lookup, bench_op_lookup},
+        {"ls",     "list a directory of " STRINGIZE(BENCH_LS_ENTRIES) " entries",
+                                                                     bench_setup_ls,     bench_op_ls},
+        {"unlink", "unlink and recreate random files",               bench_setup_unlink, bench_op_unlink},
+        {"rw",     "random 4 KiB reads and overwrites",              bench_setup_rw,     bench_op_rw},
+};
+const uint32_t workloads_count = sizeof(workloads) / sizeof(workloads[0]);
+
+int bench_compare_ns(const void * a, const void * b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+double bench_percentile_us(const uint64_t * sorted, uint32_t count, uint32_t percent) {
+    return sorted[(uint64_t) (count - 1) * percent / 100] / 1000.0;
+}
+
+// Returns the number of failed operations, or -1 if the image could not be prepared
+int bench_run(bench_t * b, const bench_workload_t * w) {
+    filesystem_t fs = b->base;
+    if (fs_create(&fs, b->image) != 0) {
+        return -1;
+    }
+    b->rng = b->seed;
+    memset(b->io_buf, 'x', sizeof(b->io_buf));
+    if (w->setup(b, &fs) != 0) {
+        printf("%-8s setup failed\n", w->name);
+        fs_close(&fs);
+        return -1;
+    }
+    fs_sync(&fs);
+
+    uint64_t hits = 0, misses = 0;
+    if (fs.bcache != NULL) {
+        hits = fs.bcache->hits;
+        misses = fs.bcache->misses;
+    }
+    bench_io_t io_start, io_end;
+    bench_read_io(&io_start);
+    uint32_t failed = 0;
+    uint64_t start = bench_now_ns();
+    for (uint32_t i = 0; i < b->ops; ++i) {
+        uint64_t op_start = bench_now_ns();
+        failed += w->op(b, &fs) != 0;
+        b->latency[i] = bench_now_ns() - op_start;
+    }
+    fs_sync(&fs);
+    uint64_t elapsed = bench_now_ns() - start;
+    bench_read_io(&io_end);
+
+    qsort(b->latency, b->ops, sizeof(uint64_t), bench_compare_ns);
+    printf("%-8s %8u %12.0f %9.1f %9.1f %9.1f %9.1f %9lu %9lu %11lu %11lu",
+           w->name, b->ops, b->ops / (elapsed / 1e9),
+           bench_percentile_us(b->latency, b->ops, 50), bench_percentile_us(b->latency, b->ops, 90),
+           bench_percentile_us(b->latency, b->ops, 99), b->latency[b->ops - 1] / 1000.0,
+           io_end.syscr - io_start.syscr, io_end.syscw - io_start.syscw,
+           io_end.rchar - io_start.rchar, io_end.wchar - io_start.wchar);
+    if (fs.bcache != NULL) {
+        uint64_t lookups = fs.bcache->hits - hits + fs.bcache->misses - misses;
+        printf(" %6.1f%%", lookups ? 100.0 * (fs.bcache->hits - hits) / lookups : 0.0);
+    }
+    printf(failed ? " %u failed\n" : "\n", failed);
+    fs_close(&fs);
+    return failed;
+}
+
+void print_help() {
+    printf("Usage: [--mmap] [--no-journal] [--aio | --aio-threads] [--cache <blocks>] [--block-size <bytes>]\n"
+           "       [--compress] [--dedup] [--ops <n>] [--seed <n>] [--keep] <path_to_image> [<workload>...]\n"
+           "Every workload runs on a freshly created image at path_to_image, removed afterwards unless --keep.\n"
+           "  --ops   operations per workload (default " STRINGIZE(BENCH_DEFAULT_OPS) ")\n"
+           "  --seed  random seed, the same seed repeats the same operations (default "
+           STRINGIZE(BENCH_DEFAULT_SEED) ")\n"
+           "Workloads (default - all):\n");
+    for (uint32_t i = 0; i < workloads_count; ++i) {
+        printf("  %-8s %s\n", workloads[i].name, workloads[i].about);
+    }
+}
+
+int main(int argc, char** argv) {
+    bench_t b = {0};
+    b.ops = BENCH_DEFAULT_OPS;
+    b.seed = BENCH_DEFAULT_SEED;
+    b.base.quiet = 1;
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--mmap") == 0) {
+            b.base.use_mmap = 1;
+        } else if (strcmp(argv[1], "--no-journal") == 0) {
+            b.base.no_journal = 1;
+        } else if (strcmp(argv[1], "--aio") == 0) {
+            b.base.use_aio = 1;
+        } else if (strcmp(argv[1], "--aio-threads") == 0) {
+            b.base.use_aio = 2;
+        } else if (strcmp(argv[1], "--compress") == 0) {
+            b.base.compress = 1;
+        } else if (strcmp(argv[1], "--dedup") == 0) {
+            b.base.dedup = 1;
+        } else if (strcmp(argv[1], "--keep") == 0) {
+            b.keep = 1;
+        } else if (argc > 2 && strcmp(argv[1], "--cache") == 0) {
+            int32_t blocks = strtol(argv[2], NULL, 10);
+            b.base.cache_blocks = blocks > 0 ? blocks : -1;
+            ++argv;
+            --argc;
+        } else if (argc > 2 && strcmp(argv[1], "--block-size") == 0) {
+            b.base.sb.block_size = strtoul(argv[2], NULL, 10);
+            ++argv;
+            --argc;
+        } else if (argc > 2 && strcmp(argv[1], "--ops") == 0) {
+            b.ops = strtoul(argv[2], NULL, 10);
+            ++argv;
+            --argc;
+        } else if (argc > 2 && strcmp(argv[1], "--seed") == 0) {
+            b.seed = strtoull(argv[2], NULL, 10);
+            ++argv;
+            --argc;
+        } else {
+            print_help();
+            return 1;
+        }
+        ++argv;
+        --argc;
+    }
+    if (argc < 2 || b.ops == 0 || b.seed == 0) {
+        print_help();
+        return 1;
+    }
+    b.image = argv[1];
+
+    // Room for every file the create workload makes
+    uint64_t inodes = (uint64_t) b.ops + BENCH_CHURN_FILES + BENCH_DIR_DEPTH * (BENCH_DIR_SIBLINGS + 1) + 64;
+    b.base.sb.inodes_count = inodes < DEFAULT_INODES_COUNT ? DEFAULT_INODES_COUNT
+                             : inodes > MAX_INODES_COUNT ? MAX_INODES_COUNT : inodes;
+    b.latency = malloc(b.ops * sizeof(uint64_t));
+
+    printf("%-8s %8s %12s %9s %9s %9s %9s %9s %9s %11s %11s%s\n", "WORKLOAD", "OPS", "OPS/SEC", "P50_US",
+           "P90_US", "P99_US", "MAX_US", "SYSCR", "SYSCW", "READ_BYTES", "WRITE_BYTES",
+           b.base.use_mmap || b.base.cache_blocks < 0 ? "" : "  CACHE");
+    int status = 0;
+    for (uint32_t i = 0; i < workloads_count; ++i) {
+        int selected = argc == 2;
+        for (int arg = 2; arg < argc; ++arg) {
+            selected |= strcmp(argv[arg], workloads[i].name) == 0;
+        }
+        if (selected) {
+            status |= bench_run(&b, workloads + i) != 0;
+        }
+    }
+    for (int arg = 2; arg < argc; ++arg) {
+        uint32_t i = 0;
+        while (i < workloads_count && strcmp(argv[arg], workloads[i].name) != 0) {
+            ++i;
+        }
+        if (i == workloads_count) {
+            printf("unknown workload %s\n", argv[arg]);
+            status = 1;
+        }
+    }
+
+    if (!b.keep) {
+        unlink(b.image);
+    }
+    free(b.latency);
+    return status;
+}
@@ -0,0 +1,433 @@
+#pragma once
+
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "fs.h"
+
+/*
+ * Bulk builder: packs a host directory tree into a freshly created image in one pass.
+ * The tree is scanned breadth-first and every inode and block is assigned up front:
+ * inodes are numbered in scan order, so the children of a directory are adjacent in
+ * the inode table, and in the data region each directory table is followed by the
+ * contents of its regular files. Blocks are then written front to back in large
+ * sequential requests, the inode table and bitmaps with one write each.
+ * Names of one host file (same st_dev and st_ino) share its inode, written once.
+ * Only regular files and directories are copied, anything else is skipped.
+ * Geometry left unset in fs->sb is sized to twice what the tree needs.
+ */
+
+#define BUILD_CHUNK (4 << 20)  // bytes of blocks gathered per write
+
+typedef struct BuildNode {
+    char *host_path;
+    char name[FILE_NAME_LEN];
+    uint32_t parent;       // node index, the root is its own parent
+    uint32_t primary;      // node that owns the inode: the first name of the host file
+    uint32_t names;        // hard links of a primary node
+    uint32_t inode;
+    enum InodeType type;
+    uint32_t size;         // file size or directory table bytes
+    uint32_t first_child;  // node index
+    uint32_t children;
+    uint32_t start;        // first block, 0 - inline
+    uint32_t blocks;
+} build_node_t;
+
+// A regular file with more than one host name, see build_assign_inodes
+typedef struct BuildLink {
+    dev_t dev;
+    ino_t ino;
+    uint32_t node;
+} build_link_t;
+
+// Nodes in breadth-first order, primary nodes are numbered in that order from inode 1
+typedef struct BuildTree {
+    build_node_t *nodes;
+    uint32_t count;
+    uint32_t cap;
+    uint32_t inodes;
+    build_link_t *links;
+    uint32_t link_count;
+    uint32_t link_cap;
+} build_tree_t;
+
+typedef struct BuildWriter {
+    filesystem_t *fs;
+    uint8_t *buf;      // BUILD_CHUNK bytes, block-aligned contents
+    uint32_t len;
+    uint32_t first;    // block of buf[0]
+    uint32_t *phys;
+    char **mem;
+} build_writer_t;
+
+int build_compare_names(const void * a, const void * b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// By host file, then by node
+int build_compare_links(const void * a, const void * b) {
+    const build_link_t * x = a;
+    const build_link_t * y = b;
+    if (x->dev != y->dev) {
+        return x->dev < y->dev ? -1 : 1;
+    }
+    if (x->ino != y->ino) {
+        return x->ino < y->ino ? -1 : 1;
+    }
+    return x->node < y->node ? -1 : x->node > y->node;
+}
+
+uint32_t build_add_node(build_tree_t * tree, const char * host_path, const char * name, uint32_t parent) {
+    if (tree->count == tree->cap) {
+        tree->cap = tree->cap ? tree->cap * 2 : 64;
+        tree->nodes = realloc(tree->nodes, tree->cap * sizeof(build_node_t));
+    }
+    build_node_t * node = tree->nodes + tree->count;
+    memset(node, 0, sizeof(build_node_t));
+    node->host_path = strdup(host_path);
+    strncpy(node->name, name, FILE_NAME_LEN - 1);
+    node->parent = parent;
+    node->primary = tree->count;
+    node->names = 1;
+    return tree->count++;
+}
+
+// Adds the children of directory node idx, sorted by name
+int build_scan_dir(build_tree_t * tree, uint32_t idx) {
+    DIR * dir = opendir(tree->nodes[idx].host_path);
+    if (dir == NULL) {
+        check_error("build: opendir");
+        return -1;
+    }
+    char **names = NULL;
+    uint32_t count = 0, cap = 0;
+    struct dirent * de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (strlen(de->d_name) >= FILE_NAME_LEN) {
+            fprintf(stderr, "build: name too long, skipped %s/%s\n", tree->nodes[idx].host_path, de->d_name);
+            continue;
+        }
+        if (count == cap) {
+            cap = cap ? cap * 2 : 16;
+            names = realloc(names, cap * sizeof(char *));
+        }
+        names[count++] = strdup(de->d_name);
+    }
+    closedir(dir);
+    qsort(names, count, sizeof(char *), build_compare_names);
+
+    tree->nodes[idx].first_child = tree->count;
+    for (uint32_t i = 0; i < count; ++i) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", tree->nodes[idx].host_path, names[i]);
+        free(names[i]);
+        struct stat st;
+        if (lstat(path, &st) != 0) {
+            check_error("build: lstat");
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "build: not a regular file or directory, skipped %s\n", path);
+            continue;
+        }
+        if (S_ISREG(st.st_mode) && st.st_size > UINT32_MAX) {
+            fprintf(stderr, "build: file too large, skipped %s\n", path);
+            continue;
+        }
+        uint32_t child = build_add_node(tree, path, strrchr(path, '/') + 1, idx);
+        tree->nodes[child].type = S_ISDIR(st.st_mode) ? DIRECTORY : REGULAR;
+        tree->nodes[child].size = S_ISREG(st.st_mode) ? st.st_size : 0;
+        if (S_ISREG(st.st_mode) && st.st_nlink > 1) {
+            if (tree->link_count == tree->link_cap) {
+                tree->link_cap = tree->link_cap ? tree->link_cap * 2 : 16;
+                tree->links = realloc(tree->links, tree->link_cap * sizeof(build_link_t));
+            }
+            tree->links[tree->link_count++] = (build_link_t) {.dev = st.st_dev, .ino = st.st_ino, .node = child};
+        }
+    }
+    tree->nodes[idx].children = tree->count - tree->nodes[idx].first_child;
+    free(names);
+    return 0;
+}
+
+// Numbers the primary nodes, the later names of a host file get the inode of its first one
+void build_assign_inodes(build_tree_t * tree) {
+    qsort(tree->links, tree->link_count, sizeof(build_link_t), build_compare_links);
+    for (uint32_t i = 1; i < tree->link_count; ++i) {
+        const build_link_t * first = tree->links + i - 1;
+        if (tree->links[i].dev == first->dev && tree->links[i].ino == first->ino) {
+            uint32_t primary = tree->nodes[first->node].primary;
+            tree->nodes[tree->links[i].node].primary = primary;
+            ++tree->nodes[primary].names;
+        }
+    }
+    tree->inodes = 0;
+    for (uint32_t idx = 0; idx < tree->count; ++idx) {
+        build_node_t * node = tree->nodes + idx;
+        node->inode = node->primary == idx ? ++tree->inodes : tree->nodes[node->primary].inode;
+    }
+}
+
+// Scans host_dir breadth-first, returns 0 on success
+int build_scan(build_tree_t * tree, const char * host_dir) {
+    memset(tree, 0, sizeof(build_tree_t));
+    struct stat st;
+    if (stat(host_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "build: %s is not a directory\n", host_dir);
+        return -1;
+    }
+    uint32_t root = build_add_node(tree, host_dir, "", 0);
+    tree->nodes[root].type = DIRECTORY;
+    for (uint32_t idx = 0; idx < tree->count; ++idx) {
+        if (tree->nodes[idx].type == DIRECTORY && build_scan_dir(tree, idx) != 0) {
+            return -1;
+        }
+    }
+    build_assign_inodes(tree);
+    return 0;
+}
+
+void build_free(build_tree_t * tree) {
+    for (uint32_t i = 0; i < tree->count; ++i) {
+        free(tree->nodes[i].host_path);
+    }
+    free(tree->nodes);
+    free(tree->links);
+    memset(tree, 0, sizeof(build_tree_t));
+}
+
+// Directory entries of node idx, "." and ".." first
+dir_entry_t * build_dir_entries(const build_tree_t * tree, uint32_t idx) {
+    const build_node_t * node = tree->nodes + idx;
+    dir_entry_t * entries = calloc(node->children + 2, sizeof(dir_entry_t));
+    entries[0].inode = node->inode;
+    strcpy(entries[0].name, ".");
+    entries[1].inode = tree->nodes[node->parent].inode;
+    strcpy(entries[1].name, "..");
+    for (uint32_t i = 0; i < node->children; ++i) {
+        entries[i + 2].inode = tree->nodes[node->first_child + i].inode;
+        strcpy(entries[i + 2].name, tree->nodes[node->first_child + i].name);
+    }
+    return entries;
+}
+
+/*
+ * Assigns blocks: every directory with entries gets its table, then its regular
+ * children that do not fit inline, each host file once. Returns the first block left free.
+ */
+uint64_t build_layout(filesystem_t * fs, build_tree_t * tree) {
+    const uint32_t bs = fs_block_size(fs);
+    uint64_t next = 1;  // block 0 is reserved
+    for (uint32_t idx = 0; idx < tree->count; ++idx) {
+        build_node_t * dir = tree->nodes + idx;
+        if (dir->type != DIRECTORY || dir->children == 0) {
+            continue;
+        }
+        // Only the length of the table is needed here
+        dir_entry_t * entries = build_dir_entries(tree, idx);
+        uint32_t units;
+        free(dir_table(entries, dir->children + 2, dir_buckets_for(dir->children + 2), &units));
+        free(entries);
+        dir->size = units * DIR_BLOCK_SIZE;
+        dir->start = next;
+        dir->blocks = (dir->size + bs - 1) / bs;
+        next += dir->blocks;
+
+        for (uint32_t c = dir->first_child; c < dir->first_child + dir->children; ++c) {
+            build_node_t * child = tree->nodes + c;
+            if (child->type == REGULAR && child->primary == c && child->size > INODE_INLINE_SIZE) {
+                child->start = next;
+                child->blocks = (child->size + (uint64_t) bs - 1) / bs;
+                next += child->blocks;
+            }
+        }
+    }
+    return next;
+}
+
+void build_flush(build_writer_t * w) {
+    const uint32_t bs = fs_block_size(w->fs);
+    uint32_t count = w->len / bs;
+    for (uint32_t i = 0; i < count; ++i) {
+        w->phys[i] = w->first + i;
+        w->mem[i] = (char *) w->buf + (size_t) i * bs;
+    }
+    fs_transfer_blocks(w->fs, w->phys, w->mem, count, 1, 0);
+    w->first += count;
+    w->len = 0;
+}
+
+// Pads the gathered bytes to a block boundary, BUILD_CHUNK is a multiple of the block size
+void build_pad(build_writer_t * w) {
+    const uint32_t bs = fs_block_size(w->fs);
+    uint32_t tail = w->len % bs;
+    if (tail != 0) {
+        memset(w->buf + w->len, 0, bs - tail);
+        w->len += bs - tail;
+    }
+    if (w->len == BUILD_CHUNK) {
+        build_flush(w);
+    }
+}
+
+void build_emit(build_writer_t * w, const void * data, uint32_t len) {
+    while (len > 0) {
+        uint32_t part = BUILD_CHUNK - w->len < len ? BUILD_CHUNK - w->len : len;
+        memcpy(w->buf + w->len, data, part);
+        w->len += part;
+        data = (const uint8_t *) data + part;
+        len -= part;
+        if (w->len == BUILD_CHUNK) {
+            build_flush(w);
+        }
+    }
+    build_pad(w);
+}
+
+// Copies a host file, a file that shrank since the scan is padded with zeros
+void build_emit_file(build_writer_t * w, const build_node_t * node) {
+    FILE * file = fopen(node->host_path, "r");
+    if (file == NULL) {
+        check_error("build: fopen");
+    }
+    uint32_t left = node->size;
+    while (left > 0) {
+        uint32_t part = BUILD_CHUNK - w->len < left ? BUILD_CHUNK - w->len : left;
+        size_t got = file != NULL ? fread(w->buf + w->len, 1, part, file) : 0;
+        if (got < part) {
+            fprintf(stderr, "build: short read, zero-filled %s\n", node->host_path);
+            memset(w->buf + w->len + got, 0, part - got);
+        }
+        w->len += part;
+        left -= part;
+        if (w->len == BUILD_CHUNK) {
+            build_flush(w);
+        }
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+    build_pad(w);
+}
+
+void build_read_inline(const build_node_t * node, inode_t * inode) {
+    FILE * file = fopen(node->host_path, "r");
+    if (file == NULL || fread(inode->inline_data, 1, node->size, file) != node->size) {
+        fprintf(stderr, "build: short read, zero-filled %s\n", node->host_path);
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+}
+
+/*
+ * fs_create, then the image is filled with the contents of host_dir.
+ * Returns 0 on success.
+ */
+int fs_create_from(filesystem_t * fs, const char * path, const char * host_dir) {
+    build_tree_t tree;
+    if (build_scan(&tree, host_dir) != 0) {
+        build_free(&tree);
+        return -1;
+    }
+    if (fs->sb.block_size == 0) {
+        fs->sb.block_size = DEFAULT_BLOCK_SIZE;
+    }
+    uint64_t used_blocks = build_layout(fs, &tree);
+    // Unset geometry leaves as much room again for later files
+    uint64_t inodes = 2 * ((uint64_t) tree.inodes + 1), blocks = 2 * used_blocks;
+    if (fs->sb.inodes_count == 0) {
+        fs->sb.inodes_count = inodes < DEFAULT_INODES_COUNT ? DEFAULT_INODES_COUNT
+                              : inodes > MAX_INODES_COUNT ? MAX_INODES_COUNT : inodes;
+    }
+    if (fs->sb.blocks_count == 0) {
+        fs->sb.blocks_count = blocks < DEFAULT_BLOCKS_COUNT ? DEFAULT_BLOCKS_COUNT
+                              : blocks > MAX_BLOCKS_COUNT ? MAX_BLOCKS_COUNT : blocks;
+    }
+    if (tree.inodes > fs->sb.inodes_count - 1 || used_blocks > fs->sb.blocks_count) {
+        fprintf(stderr, "build: %u inodes and %lu blocks needed, the image has %u and %u\n", tree.inodes + 1,
+                used_blocks, fs->sb.inodes_count, fs->sb.blocks_count);
+        build_free(&tree);
+        return -1;
+    }
+    if (fs_create(fs, path) != 0) {
+        build_free(&tree);
+        return -1;
+    }
+
+    // Data region, in layout order
+    build_writer_t w = {
+            .fs = fs,
+            .buf = malloc(BUILD_CHUNK),
+            .first = 1,
+            .phys = malloc(BUILD_CHUNK / fs_block_size(fs) * sizeof(uint32_t)),
+            .mem = malloc(BUILD_CHUNK / fs_block_size(fs) * sizeof(char *))
+    };
+    for (uint32_t idx = 0; idx < tree.count; ++idx) {
+        const build_node_t * dir = tree.nodes + idx;
+        if (dir->type != DIRECTORY || dir->children == 0) {
+            continue;
+        }
+        dir_entry_t * entries = build_dir_entries(&tree, idx);
+        uint32_t units;
+        dir_bucket_t * table = dir_table(entries, dir->children + 2, dir_buckets_for(dir->children + 2), &units);
+        build_emit(&w, table, units * DIR_BLOCK_SIZE);
+        free(table);
+        free(entries);
+        for (uint32_t c = dir->first_child; c < dir->first_child + dir->children; ++c) {
+            if (tree.nodes[c].type == REGULAR && tree.nodes[c].start != 0) {
+                build_emit_file(&w, tree.nodes + c);
+            }
+        }
+    }
+    build_flush(&w);
+    free(w.buf);
+    free(w.phys);
+    free(w.mem);
+
+    // Inode table and bitmaps
+    for (uint32_t idx = 0; idx < tree.count; ++idx) {
+        const build_node_t * node = tree.nodes + idx;
+        if (node->primary != idx) {
+            continue;
+        }
+        inode_t * inode = fs_inode_ptr(fs, node->inode);
+        memset(inode, 0, sizeof(inode_t));
+        inode->type = node->type;
+        inode->hard_links = node->type == DIRECTORY ? 2 : node->names;
+        inode->size = node->size;
+        if (node->start != 0) {
+            inode->extent_count = 1;
+            inode->extents[0] = (extent_t) {.lblk = 0, .start = node->start, .len = node->blocks};
+        } else if (node->type == DIRECTORY) {
+            uint32_t parent = tree.nodes[node->parent].inode;
+            inode->flags = INODE_INLINE;
+            memcpy(inode->inline_data, &parent, sizeof(parent));
+        } else {
+            inode->flags = INODE_INLINE;
+            build_read_inline(node, inode);
+        }
+        fs->inode_bitmap[node->inode / 8] |= 1 << (node->inode % 8);
+    }
+    for (uint32_t block = 0; block < used_blocks; ++block) {
+        fs->block_bitmap[block / 8] |= 1 << (block % 8);
+    }
+    fs->block_hint = used_blocks;
+    fs_load_free_inodes(fs);
+
+    if (!fs->mapping) {
+        disk_write(fs, disk_offset_inode(fs, 1), fs->inodes, (size_t) tree.inodes * sizeof(inode_t));
+        disk_write(fs, disk_offset_bitmap(fs), fs->block_bitmap, (used_blocks + 7) / 8);
+        disk_write(fs, disk_offset_inode_bitmap(fs), fs->inode_bitmap, fs_inode_bitmap_size(fs));
+        memset(fs->inodes_dirty, 0, fs_inode_bitmap_size(fs));
+        memset(fs->block_bitmap_dirty, 0, fs_bitmap_dirty_size(fs));
+        fs->inodes_have_dirty = fs->block_bitmap_have_dirty = fs->inode_bitmap_dirty = 0;
+    }
+    build_free(&tree);
+    return 0;
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <stdint-gcc.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Dentry cache: (parent inode, name) -> inode for path resolution.
+ * Negative entries (inode 0) remember names that do not exist.
+ * Fixed number of entries, least recently used one is evicted.
+ */
+
+#define DCACHE_SIZE 4096
+#define DCACHE_BUCKETS 8192  // power of two
+#define DCACHE_NAME_LEN 64   // same as FILE_NAME_LEN
+
+typedef struct DentryCacheEntry {
+    uint32_t parent;
+    uint32_t inode;  // 0 - the name is known to be absent
+    char name[DCACHE_NAME_LEN];
+    int32_t hash_next;
+    int32_t lru_prev;
+    int32_t lru_next;
+} dcache_entry_t;
+
+typedef struct DentryCache {
+    dcache_entry_t entries[DCACHE_SIZE];
+    int32_t buckets[DCACHE_BUCKETS];  // -1 - empty
+    int32_t lru_head;  // most recently used
+    int32_t lru_tail;
+    uint32_t used;
+    uint64_t hits;
+    uint64_t misses;
+} dcache_t;
+
+dcache_t * dcache_create() {
+    dcache_t * cache = calloc(1, sizeof(dcache_t));
+    memset(cache->buckets, -1, sizeof(cache->buckets));
+    cache->lru_head = cache->lru_tail = -1;
+    return cache;
+}
+
+void dcache_destroy(dcache_t * cache) {
+    free(cache);
+}
+
+uint32_t dcache_bucket(uint32_t parent, const char * name) {
+    uint32_t hash = 2166136261u ^ parent;  // FNV-1a seeded with the parent
+    for (; *name; ++name) {
+        hash = (hash ^ (uint8_t) *name) * 16777619u;
+    }
+    return hash & (DCACHE_BUCKETS - 1);
+}
+
+void dcache_lru_unlink(dcache_t * cache, int32_t i) {
+    dcache_entry_t * e = cache->entries + i;
+    if (e->lru_prev >= 0) {
+        cache->entries[e->lru_prev].lru_next = e->lru_next;
+    } else {
+        cache->lru_head = e->lru_next;
+    }
+    if (e->lru_next >= 0) {
+        cache->entries[e->lru_next].lru_prev = e->lru_prev;
+    } else {
+        cache->lru_tail = e->lru_prev;
+    }
+}
+
+void dcache_lru_push_front(dcache_t * cache, int32_t i) {
+    dcache_entry_t * e = cache->entries + i;
+    e->lru_prev = -1;
+    e->lru_next = cache->lru_head;
+    if (cache->lru_head >= 0) {
+        cache->entries[cache->lru_head].lru_prev = i;
+    }
+    cache->lru_head = i;
+    if (cache->lru_tail < 0) {
+        cache->lru_tail = i;
+    }
+}
+
+int32_t dcache_find(dcache_t * cache, uint32_t parent, const char * name) {
+    int32_t i = cache->buckets[dcache_bucket(parent, name)];
+    for (; i >= 0; i = cache->entries[i].hash_next) {
+        if (cache->entries[i].parent == parent && strcmp(cache->entries[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void dcache_unhash(dcache_t * cache, int32_t i) {
+    dcache_entry_t * e = cache->entries + i;
+    int32_t * link = cache->buckets + dcache_bucket(e->parent, e->name);
+    while (*link != i) {
+        link = &cache->entries[*link].hash_next;
+    }
+    *link = e->hash_next;
+}
+
+// Returns 1 and fills *inode (0 for a negative entry) on a hit
+int dcache_lookup(dcache_t * cache, uint32_t parent, const char * name, uint32_t * inode) {
+    int32_t i = dcache_find(cache, parent, name);
+    if (i < 0) {
+        ++cache->misses;
+        return 0;
+    }
+    ++cache->hits;
+    dcache_lru_unlink(cache, i);
+    dcache_lru_push_front(cache, i);
+    *inode = cache->entries[i].inode;
+    return 1;
+}
+
+// Adds or updates an entry, inode 0 records a negative entry
+void dcache_insert(dcache_t * cache, uint32_t parent, const char * name, uint32_t inode) {
+    if (strlen(name) >= DCACHE_NAME_LEN) {
+        return;
+    }
+
+    int32_t i = dcache_find(cache, parent, name);
+    if (i >= 0) {
+        dcache_lru_unlink(cache, i);
+    } else {
+        if (cache->used < DCACHE_SIZE) {
+            i = cache->used++;
+        } else {
+            i = cache->lru_tail;
+            dcache_lru_unlink(cache, i);
+            if (cache->entries[i].parent != 0) {
+                dcache_unhash(cache, i);
+            }
+        }
+        dcache_entry_t * e = cache->entries + i;
+        e->parent = parent;
+        strcpy(e->name, name);
+        uint32_t bucket = dcache_bucket(parent, name);
+        e->hash_next = cache->buckets[bucket];
+        cache->buckets[bucket] = i;
+    }
+    cache->entries[i].inode = inode;
+    dcache_lru_push_front(cache, i);
+}
+
+// Forgets every entry of a directory, used when the directory inode is released
+void dcache_invalidate_dir(dcache_t * cache, uint32_t parent) {
+    for (uint32_t i = 0; i < cache->used; ++i) {
+        if (cache->entries[i].parent == parent) {
+            // Dead entries have parent 0 and sit at the LRU tail to be reused first
+            dcache_unhash(cache, i);
+            cache->entries[i].parent = 0;
+            dcache_lru_unlink(cache, i);
+            dcache_entry_t * e = cache->entries + i;
+            e->lru_next = -1;
+            e->lru_prev = cache->lru_tail;
+            if (cache->lru_tail >= 0) {
+                cache->entries[cache->lru_tail].lru_next = i;
+            } else {
+                cache->lru_head = i;
+            }
+            cache->lru_tail = i;
+        }
+    }
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdint-gcc.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Dedup index: content hash -> block, for sharing identical data blocks. The
+ * hashes themselves are persisted per block in the image (block_hashes), the
+ * index is rebuilt from them at mount. Open addressing, one block per hash: a
+ * newer block replaces an older one with the same hash. Entries are not removed,
+ * callers check that the block still has the hash and then compare contents.
+ */
+
+typedef struct DedupIndex {
+    uint32_t *hashes;  // 0 - empty slot
+    uint32_t *blocks;
+    uint32_t cap;      // power of two
+    uint32_t count;
+    uint64_t hits;
+} dedup_t;
+
+// Hash of a block, never 0
+uint32_t dedup_hash(const void * data, uint32_t len) {
+    const uint8_t * p = data;
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ len;
+    for (uint32_t i = 0; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, p + i, sizeof(word));
+        h = (h ^ word) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    h ^= h >> 29;
+    uint32_t hash = (uint32_t) (h ^ (h >> 32));
+    return hash ? hash : 1;
+}
+
+dedup_t * dedup_create(uint32_t expected) {
+    dedup_t * index = calloc(1, sizeof(dedup_t));
+    index->cap = 64;
+    while (index->cap < 2 * expected) {
+        index->cap *= 2;
+    }
+    index->hashes = calloc(index->cap, sizeof(uint32_t));
+    index->blocks = calloc(index->cap, sizeof(uint32_t));
+    return index;
+}
+
+void dedup_destroy(dedup_t * index) {
+    if (index == NULL) {
+        return;
+    }
+    free(index->hashes);
+    free(index->blocks);
+    free(index);
+}
+
+uint32_t dedup_slot(const dedup_t * index, uint32_t hash) {
+    uint32_t slot = hash & (index->cap - 1);
+    while (index->hashes[slot] != 0 && index->hashes[slot] != hash) {
+        slot = (slot + 1) & (index->cap - 1);
+    }
+    return slot;
+}
+
+// Block last stored with the hash, 0 if none
+uint32_t dedup_find(const dedup_t * index, uint32_t hash) {
+    uint32_t slot = dedup_slot(index, hash);
+    return index->hashes[slot] == hash ? index->blocks[slot] : 0;
+}
+
+// Returns 1 when the index is half full and should be rebuilt larger
+int dedup_insert(dedup_t * index, uint32_t hash, uint32_t block) {
+    uint32_t slot = dedup_slot(index, hash);
+    if (index->hashes[slot] == 0) {
+        index->hashes[slot] = hash;
+        ++index->count;
+    }
+    index->blocks[slot] = block;
+    return index->count * 2 > index->cap;
+}
@@ -2,260 +2,3057 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdint-gcc.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include "aio.h"
+#include "bcache.h"
+#include "dcache.h"
+#include "dedup.h"
+#include "journal.h"
+#include "lz.h"
+#include "stats.h"
+
 /*
- * 1024 inodes (1-based)
+ * Superblock (one block at offset 0, holds the geometry)
+ * inodes_count inodes (1-based)
  * Block bitmap
- * 512 blocks
+ * Inode bitmap
+ * Block refcounts (2 bytes per block, see block_refs)
+ * Block content hashes (4 bytes per block, see block_hashes)
+ * Journal (JOURNAL_SIZE bytes, block aligned)
+ * blocks_count blocks, block 0 is reserved so that a zero block pointer means "not allocated"
  */
 
 int check_error(const char* msg) {
     if (errno != 0) {
         perror(msg);
     }
-    return 0;
-}
+    return 0;
+}
+
+#define STRINGIZE_DETAIL(x) #x
+#define STRINGIZE(x) STRINGIZE_DETAIL(x)
+#define ASSERTED && check_error(STRINGIZE(__LINE__))
+
+
+
+#define SUPERBLOCK_MAGIC 0x3153464c  // "LFS1"
+#define SUPERBLOCK_VERSION 5
+#define DEFAULT_BLOCK_SIZE 512
+#define DEFAULT_INODES_COUNT 1024
+#define DEFAULT_BLOCKS_COUNT 131072  // 64 MiB of 512-byte blocks
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 4096          // sizes stack buffers of one block
+#define MAX_INODES_COUNT (1u << 22)  // the whole table is kept in memory
+#define MAX_BLOCKS_COUNT 0xfffffe00u // block numbers are 32-bit, (uint32_t) -1 means "no block"
+#define INODE_EXTENTS 5
+#define EXTENT_MAX_DEPTH 4  // 5 * 42^4 extents of 512-byte blocks, more than a 4 GiB file can have
+#define INODE_INLINE_SIZE (INODE_EXTENTS * 12)  // bytes of extents[]
+#define FILE_NAME_LEN 64
+#define MAX_RUN_IOVECS 256          // iovecs per preadv/pwritev call
+#define MAX_RUN_BYTES (1 << 30)     // one call transfers less than 2 GiB
+#define BITMAP_FLUSH_CHUNK 64  // granularity of dirty tracking for the block bitmap, refcounts and hashes, bytes
+#define BLOCK_REFS_PINNED 65535  // extra references saturate here, such a block is never freed
+#define JOURNAL_SIZE (2 << 20)          // two slots of 1 MiB
+#define JOURNAL_GROUP_SIZE (256 << 10)  // pending metadata that triggers a group commit
+#define INODE_LOCK_STRIPES 64      // inode i is guarded by lock i % INODE_LOCK_STRIPES
+#define BCACHE_DEFAULT_SIZE (1 << 20)  // buffer cache bytes
+#define READAHEAD_MIN_BLOCKS 8
+#define READAHEAD_MAX_BLOCKS 128
+#define COMPRESS_CLUSTER_BLOCKS 16  // unit of compression, see file_write_compressed
+
+enum InodeType {
+    REGULAR, DIRECTORY
+};
+
+// Run of logical blocks stored in a run of physical blocks, see fs_bmap
+typedef struct Extent {
+    uint32_t lblk;   // first logical block
+    uint32_t start;  // first physical block; child node in an index entry
+    uint32_t len;    // blocks; entries of the child in an index entry
+}__attribute__ ((packed)) extent_t;
+
+#define MAX_NODE_EXTENTS ((MAX_BLOCK_SIZE + sizeof(extent_t) - 1) / sizeof(extent_t))  // buffers hold a whole block
+
+/*
+ * INODE_INLINE: the contents live in the inode instead of extents[]. A regular
+ * file keeps up to INODE_INLINE_SIZE bytes of data there, a directory that has
+ * only "." and ".." keeps just the number of its parent. Both move to blocks
+ * once they grow.
+ */
+#define INODE_INLINE 1
+#define INODE_SNAPSHOT 2  // root of a snapshot, see snapshot.h
+#define INODE_COMPRESSED 4  // regular file stored in compressed clusters, see file_write_compressed
+
+typedef struct Inode {
+    uint32_t size;
+    uint32_t hard_links;
+    enum InodeType type;
+    uint8_t flags;
+    uint8_t extent_depth;   // 0 - extents[] map the file, otherwise they index tree nodes
+    uint16_t extent_count;  // entries used in extents[]
+    union {
+        extent_t extents[INODE_EXTENTS];
+        uint8_t inline_data[INODE_INLINE_SIZE];
+    };
+}__attribute__ ((packed)) inode_t;
+
+/*
+ * Geometry of the image, the first block. Offsets of everything else are derived
+ * from it (disk_offset_*). Block numbers stay 32-bit, byte offsets are 64-bit:
+ * 2^32 blocks of 4 KiB are 16 TiB, far beyond what the in-memory bitmaps allow.
+ */
+typedef struct Superblock {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;      // power of two, MIN_BLOCK_SIZE..MAX_BLOCK_SIZE
+    uint32_t inodes_count;    // multiple of 8, inode numbers are 1..inodes_count - 1
+    uint32_t blocks_count;    // multiple of BITMAP_FLUSH_CHUNK * 8
+    uint32_t journal_blocks;
+}__attribute__ ((packed)) superblock_t;
+
+typedef struct DirEntry {
+    uint32_t inode;
+    char name[FILE_NAME_LEN];
+}__attribute__ ((packed)) dir_entry_t;
+
+// Metadata blocks written by the current transaction, open addressing by block number
+typedef struct MetaBlocks {
+    uint32_t *idx;  // 0 - empty slot, block 0 is reserved
+    uint8_t *data;  // cap blocks
+    uint32_t cap;   // power of two
+    uint32_t count;
+} meta_blocks_t;
+
+typedef struct filesystem {
+    FILE *disk_device;
+    int fd;  // of disk_device, all image I/O is positional so there is no shared file position
+
+    /*
+     * Geometry, read from the image by fs_init. Before fs_create set the wanted
+     * block_size, inodes_count and blocks_count (0 - default), they are rounded up.
+     */
+    superblock_t sb;
+
+    // Whole inode table; heap copy with write-back of dirty entries, or the mapping itself
+    inode_t *inodes;
+    uint8_t *inodes_dirty;  // bit per inode
+    int inodes_have_dirty;
+
+    // Heap copies or pointers into the mapping, bit i set = block / inode i in use
+    uint8_t *block_bitmap;
+    uint8_t *inode_bitmap;  // bit 0 is reserved
+
+    /*
+     * Block sharing between clones and dedup (see snapshot.h): the number of
+     * owners besides the first. fs_dealloc_blocks only frees a block nobody else
+     * owns, file_write copies shared blocks before writing them.
+     */
+    uint16_t *block_refs;
+
+    /*
+     * Content hash of each data block written in dedup mode, 0 - unknown. A block
+     * loses its hash when it is freed or overwritten in place, whatever the mode,
+     * so that a hash always describes the current contents. dedup_index maps the
+     * hashes back to blocks when dedup is set before fs_init/fs_create.
+     */
+    uint32_t *block_hashes;
+    int dedup;
+    dedup_t *dedup_index;
+
+    // Bitmap and refcount changes are only marked here and written by fs_flush_bitmaps
+    uint8_t *block_bitmap_dirty;  // bit per BITMAP_FLUSH_CHUNK
+    int block_bitmap_have_dirty;
+    int inode_bitmap_dirty;
+    uint8_t *block_refs_dirty;    // bit per BITMAP_FLUSH_CHUNK
+    int block_refs_have_dirty;
+    uint8_t *block_hashes_dirty;  // bit per BITMAP_FLUSH_CHUNK
+    int block_hashes_have_dirty;
+
+    // Stack of free inode numbers built from inode_bitmap, lowest number on top
+    uint32_t *free_inodes;
+    uint32_t free_inodes_count;
+
+    uint32_t block_hint;  // next-fit cursor for fs_alloc_blocks
+
+    dcache_t *dcache;  // name lookups, kept in sync by fs_dir_add/fs_dir_remove
+
+    /*
+     * Buffer cache of image blocks, set cache_blocks before fs_init/fs_create:
+     * 0 - BCACHE_DEFAULT_SIZE bytes, negative - no cache. Not used in mmap mode.
+     * Metadata blocks are written back (or reach the disk through the journal),
+     * file data is written through and refreshes cached copies.
+     */
+    int32_t cache_blocks;
+    bcache_t *bcache;
+
+    /*
+     * Metadata journal, on unless no_journal is set or the image is mapped.
+     * While it is on, inode table, bitmap, directory and pointer block writes are
+     * kept in memory and reach the disk through journal_commit in fs_commit.
+     * Blocks freed by the transaction are only released at commit, so data
+     * written directly to the image never lands in a block the last committed
+     * state still uses.
+     */
+    int no_journal;
+    int journal_active;
+    journal_t journal;
+    meta_blocks_t meta_blocks;
+    uint32_t *tx_freed;
+    uint32_t tx_freed_count;
+    uint32_t tx_freed_cap;
+
+    /*
+     * mmap mode: set use_mmap before fs_init/fs_create. The whole image is mapped,
+     * inode table, bitmap and blocks are accessed in place, changes reach the disk
+     * on fs_sync/fs_close.
+     */
+    int use_mmap;
+    uint8_t *mapping;
+    size_t mapping_size;
+
+    // Set use_aio before fs_init/fs_create: 1 - io_uring or the thread pool, 2 - thread pool only
+    int use_aio;
+    aio_t *aio;  // NULL - multi-run transfers are issued one run at a time
+
+    /*
+     * Concurrent mode: set concurrent before fs_init/fs_create to share the
+     * filesystem between threads, see the locking notes at fs_lock_inode.
+     */
+    int concurrent;
+    pthread_rwlock_t op_lock;  // shared by every operation, exclusive for a commit
+    pthread_rwlock_t inode_locks[INODE_LOCK_STRIPES];
+    pthread_mutex_t alloc_lock;  // bitmaps, free inode stack, block_hint, tx_freed
+    pthread_mutex_t dcache_lock;
+    pthread_mutex_t meta_lock;   // meta_blocks
+    pthread_mutex_t cache_lock;  // bcache
+
+    int quiet;  // no per-allocation messages on stdout, for benchmarks and scripts
+    int compress;  // new regular files get INODE_COMPRESSED
+
+    /*
+     * Counters of this filesystem's work, see stats.h. Set stats.timing and
+     * stats.trace_cap before fs_init/fs_create to time events and to keep a ring
+     * of the last primitive I/O requests.
+     */
+    stats_t stats;
+} filesystem_t;
+
+
+int is_inode_empty(inode_t * inode) {
+    return inode->hard_links == 0;
+}
+
+int is_inode_inline(const inode_t * inode) {
+    return (inode->flags & INODE_INLINE) != 0;
+}
+
+// Returns 0 if the superblock describes a usable image
+int superblock_check(const superblock_t * sb) {
+    if (sb->magic != SUPERBLOCK_MAGIC || sb->version != SUPERBLOCK_VERSION) {
+        printf("superblock: not a linux1-fs image\n");
+        return -1;
+    }
+    if (sb->block_size < MIN_BLOCK_SIZE || sb->block_size > MAX_BLOCK_SIZE
+            || (sb->block_size & (sb->block_size - 1)) != 0) {
+        printf("superblock: block size must be a power of two from %d to %d\n", MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+        return -1;
+    }
+    if (sb->inodes_count < 8 || sb->inodes_count > MAX_INODES_COUNT || sb->inodes_count % 8 != 0) {
+        printf("superblock: inode count must be from 8 to %u\n", MAX_INODES_COUNT);
+        return -1;
+    }
+    if (sb->blocks_count == 0 || sb->blocks_count > MAX_BLOCKS_COUNT
+            || sb->blocks_count % (BITMAP_FLUSH_CHUNK * 8) != 0) {
+        printf("superblock: block count must be from 1 to %u\n", MAX_BLOCKS_COUNT);
+        return -1;
+    }
+    if ((uint64_t) sb->journal_blocks * sb->block_size < 2 * sizeof(journal_tx_header_t)) {
+        printf("superblock: journal too small\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Fills in the defaults and rounds the requested geometry up, returns -1 if it cannot be used
+int superblock_prepare(superblock_t * sb) {
+    sb->magic = SUPERBLOCK_MAGIC;
+    sb->version = SUPERBLOCK_VERSION;
+    if (sb->block_size == 0) {
+        sb->block_size = DEFAULT_BLOCK_SIZE;
+    }
+    if (sb->inodes_count == 0) {
+        sb->inodes_count = DEFAULT_INODES_COUNT;
+    }
+    if (sb->blocks_count == 0) {
+        sb->blocks_count = DEFAULT_BLOCKS_COUNT;
+    }
+    sb->inodes_count = (sb->inodes_count + 7) & ~7u;
+    const uint32_t blocks_unit = BITMAP_FLUSH_CHUNK * 8;
+    if (sb->blocks_count <= MAX_BLOCKS_COUNT) {
+        sb->blocks_count = (sb->blocks_count + blocks_unit - 1) / blocks_unit * blocks_unit;
+    }
+    sb->journal_blocks = sb->block_size ? JOURNAL_SIZE / sb->block_size : 0;
+    return superblock_check(sb);
+}
+
+uint32_t fs_block_size(filesystem_t * fs) {
+    return fs->sb.block_size;
+}
+// Entries of an extent tree node stored in a block
+uint32_t fs_node_extents(filesystem_t * fs) {
+    return fs->sb.block_size / sizeof(extent_t);
+}
+uint64_t fs_block_bitmap_size(filesystem_t * fs) {
+    return fs->sb.blocks_count / 8;
+}
+uint64_t fs_inode_bitmap_size(filesystem_t * fs) {
+    return fs->sb.inodes_count / 8;
+}
+uint64_t fs_bitmap_dirty_size(filesystem_t * fs) {
+    return (fs_block_bitmap_size(fs) / BITMAP_FLUSH_CHUNK + 7) / 8;
+}
+uint64_t fs_block_refs_size(filesystem_t * fs) {
+    return (uint64_t) fs->sb.blocks_count * sizeof(uint16_t);
+}
+uint64_t fs_refs_dirty_size(filesystem_t * fs) {
+    return (fs_block_refs_size(fs) / BITMAP_FLUSH_CHUNK + 7) / 8;
+}
+uint64_t fs_block_hashes_size(filesystem_t * fs) {
+    return (uint64_t) fs->sb.blocks_count * sizeof(uint32_t);
+}
+uint64_t fs_hashes_dirty_size(filesystem_t * fs) {
+    return (fs_block_hashes_size(fs) / BITMAP_FLUSH_CHUNK + 7) / 8;
+}
+
+uint64_t disk_offset_inode(filesystem_t * fs, uint32_t inode_idx) {
+    return fs->sb.block_size + (uint64_t) (inode_idx - 1) * sizeof(inode_t);
+}
+uint64_t disk_offset_bitmap(filesystem_t * fs) {
+    return disk_offset_inode(fs, 1) + (uint64_t) fs->sb.inodes_count * sizeof(inode_t);
+}
+uint64_t disk_offset_inode_bitmap(filesystem_t * fs) {
+    return disk_offset_bitmap(fs) + fs_block_bitmap_size(fs);
+}
+// Refcounts and hashes are 8-byte aligned, in mmap mode they are accessed in place
+uint64_t disk_offset_block_refs(filesystem_t * fs) {
+    return (disk_offset_inode_bitmap(fs) + fs_inode_bitmap_size(fs) + 7) / 8 * 8;
+}
+uint64_t disk_offset_block_hashes(filesystem_t * fs) {
+    return disk_offset_block_refs(fs) + fs_block_refs_size(fs);
+}
+// Journal and blocks start on a block boundary, so block I/O lines up with the page cache
+uint64_t disk_offset_journal(filesystem_t * fs) {
+    uint64_t end = disk_offset_block_hashes(fs) + fs_block_hashes_size(fs);
+    return (end + fs->sb.block_size - 1) / fs->sb.block_size * fs->sb.block_size;
+}
+uint64_t disk_offset_block(filesystem_t * fs, uint32_t block_idx) {
+    return disk_offset_journal(fs) + ((uint64_t) fs->sb.journal_blocks + block_idx) * fs->sb.block_size;
+}
+uint32_t disk_blocks_count(filesystem_t * fs) {
+    return fs->sb.blocks_count;
+}
+uint64_t disk_image_size(filesystem_t * fs) {
+    return disk_offset_block(fs, disk_blocks_count(fs));
+}
+
+void disk_read(filesystem_t * fs, uint64_t offset, void * buf, size_t len) {
+    uint64_t start = stats_clock(&fs->stats);
+    errno = 0;
+    pread(fs->fd, buf, len, offset) ASSERTED;
+    stats_io(&fs->stats, 0, offset, len, start);
+}
+void disk_write(filesystem_t * fs, uint64_t offset, const void * buf, size_t len) {
+    uint64_t start = stats_clock(&fs->stats);
+    errno = 0;
+    pwrite(fs->fd, buf, len, offset) ASSERTED;
+    stats_io(&fs->stats, 1, offset, len, start);
+}
+
+/*
+ * Locking in concurrent mode, all of it is skipped otherwise.
+ *
+ * Public operations (fs_pread, fs_pwrite, fs_stat, fs_dir_lookup, fs_dir_open,
+ * fs_listdir, fs_link, fs_unlink, fs_create_*) hold op_lock shared, then the
+ * striped locks of the inodes they touch in ascending stripe order: read for
+ * lookups and reads, write for anything that changes the inode or its contents.
+ * Internal helpers (file_read, file_write, dir_*, link_inode, unlink_entry) and
+ * fs_dir_add, fs_dir_remove, fs_dir_entries expect the caller to hold these.
+ * fs_release_inode is only safe on an inode no other thread can reach.
+ * alloc_lock, dcache_lock and meta_lock are leaves, nothing else is taken while
+ * one of them is held, except cache_lock which is taken last and may be nested
+ * inside meta_lock. fs_sync takes op_lock exclusively, so a commit sees no
+ * operation half done.
+ */
+void fs_locks_init(filesystem_t * fs) {
+    if (!fs->concurrent) {
+        return;
+    }
+    pthread_rwlock_init(&fs->op_lock, NULL);
+    for (uint32_t i = 0; i < INODE_LOCK_STRIPES; ++i) {
+        pthread_rwlock_init(fs->inode_locks + i, NULL);
+    }
+    pthread_mutex_init(&fs->alloc_lock, NULL);
+    pthread_mutex_init(&fs->dcache_lock, NULL);
+    pthread_mutex_init(&fs->meta_lock, NULL);
+    pthread_mutex_init(&fs->cache_lock, NULL);
+}
+
+void fs_locks_destroy(filesystem_t * fs) {
+    if (!fs->concurrent) {
+        return;
+    }
+    pthread_rwlock_destroy(&fs->op_lock);
+    for (uint32_t i = 0; i < INODE_LOCK_STRIPES; ++i) {
+        pthread_rwlock_destroy(fs->inode_locks + i);
+    }
+    pthread_mutex_destroy(&fs->alloc_lock);
+    pthread_mutex_destroy(&fs->dcache_lock);
+    pthread_mutex_destroy(&fs->meta_lock);
+    pthread_mutex_destroy(&fs->cache_lock);
+}
+
+void fs_mutex_lock(filesystem_t * fs, pthread_mutex_t * mutex) {
+    if (fs->concurrent) {
+        pthread_mutex_lock(mutex);
+    }
+}
+void fs_mutex_unlock(filesystem_t * fs, pthread_mutex_t * mutex) {
+    if (fs->concurrent) {
+        pthread_mutex_unlock(mutex);
+    }
+}
+
+void fs_lock_inode(filesystem_t * fs, uint32_t inode_idx, int write) {
+    if (fs->concurrent) {
+        pthread_rwlock_t * lock = fs->inode_locks + inode_idx % INODE_LOCK_STRIPES;
+        write ? pthread_rwlock_wrlock(lock) : pthread_rwlock_rdlock(lock);
+    }
+}
+void fs_unlock_inode(filesystem_t * fs, uint32_t inode_idx) {
+    if (fs->concurrent) {
+        pthread_rwlock_unlock(fs->inode_locks + inode_idx % INODE_LOCK_STRIPES);
+    }
+}
+
+// Write-locks two inodes without deadlocking against another pair, they may share a stripe
+void fs_lock_inode_pair(filesystem_t * fs, uint32_t a, uint32_t b) {
+    uint32_t first = a % INODE_LOCK_STRIPES < b % INODE_LOCK_STRIPES ? a : b;
+    uint32_t second = first == a ? b : a;
+    fs_lock_inode(fs, first, 1);
+    if (first % INODE_LOCK_STRIPES != second % INODE_LOCK_STRIPES) {
+        fs_lock_inode(fs, second, 1);
+    }
+}
+void fs_unlock_inode_pair(filesystem_t * fs, uint32_t a, uint32_t b) {
+    fs_unlock_inode(fs, a);
+    if (a % INODE_LOCK_STRIPES != b % INODE_LOCK_STRIPES) {
+        fs_unlock_inode(fs, b);
+    }
+}
+
+void fs_op_begin(filesystem_t * fs) {
+    if (fs->concurrent) {
+        pthread_rwlock_rdlock(&fs->op_lock);
+    }
+}
+void fs_op_end(filesystem_t * fs);
+
+inode_t * fs_inode_ptr(filesystem_t * fs, uint32_t idx) {
+    return fs->inodes + (idx - 1);
+}
+// In mmap mode returns pointer into the mapping, otherwise NULL
+void * fs_block_ptr(filesystem_t * fs, uint32_t idx) {
+    return fs->mapping ? fs->mapping + disk_offset_block(fs, idx) : NULL;
+}
+
+void read_inode(filesystem_t * fs, uint32_t idx, inode_t* inode) {
+    stats_add(&fs->stats, STAT_READ_INODE, 1);
+    memcpy(inode, fs_inode_ptr(fs, idx), sizeof(inode_t));
+}
+void write_inode(filesystem_t * fs, uint32_t idx, inode_t* inode) {
+    stats_add(&fs->stats, STAT_WRITE_INODE, 1);
+    memcpy(fs_inode_ptr(fs, idx), inode, sizeof(inode_t));
+    if (!fs->mapping) {
+        // Neighbouring inodes share the byte and may be written by other threads
+        __atomic_fetch_or(fs->inodes_dirty + (idx - 1) / 8, 1 << ((idx - 1) % 8), __ATOMIC_RELAXED);
+        __atomic_store_n(&fs->inodes_have_dirty, 1, __ATOMIC_RELAXED);
+    }
+}
+int is_inode_dirty(filesystem_t * fs, uint32_t idx) {
+    return (fs->inodes_dirty[(idx - 1) / 8] >> ((idx - 1) % 8)) & 1;
+}
+void write_dirty_inodes(filesystem_t * fs) {
+    if (fs->mapping || !fs->inodes_have_dirty) {
+        return;
+    }
+    uint64_t start = stats_clock(&fs->stats);
+
+    // Adjacent dirty inodes are written as one run
+    for (uint32_t first = 1; first <= fs->sb.inodes_count; ++first) {
+        if (!is_inode_dirty(fs, first)) {
+            continue;
+        }
+        uint32_t last = first;
+        while (last < fs->sb.inodes_count && is_inode_dirty(fs, last + 1)) {
+            ++last;
+        }
+        if (fs->journal_active) {
+            journal_add(&fs->journal, disk_offset_inode(fs, first), fs_inode_ptr(fs, first),
+                        (last - first + 1) * sizeof(inode_t));
+        } else {
+            disk_write(fs, disk_offset_inode(fs, first), fs_inode_ptr(fs, first), (last - first + 1) * sizeof(inode_t));
+        }
+        first = last;
+    }
+
+    memset(fs->inodes_dirty, 0, fs_inode_bitmap_size(fs));
+    fs->inodes_have_dirty = 0;
+    stats_done(&fs->stats, STAT_INODE_FLUSHES, start);
+}
+void mark_bitmap_dirty(filesystem_t * fs, uint32_t block_from, uint32_t count) {
+    if (fs->mapping || count == 0) {
+        return;  // bitmap lives in the mapping already
+    }
+    uint32_t chunk_from = block_from / 8 / BITMAP_FLUSH_CHUNK;
+    uint32_t chunk_to = (block_from + count - 1) / 8 / BITMAP_FLUSH_CHUNK;
+    for (uint32_t chunk = chunk_from; chunk <= chunk_to; ++chunk) {
+        fs->block_bitmap_dirty[chunk / 8] |= 1 << (chunk % 8);
+    }
+    fs->block_bitmap_have_dirty = 1;
+}
+void mark_block_refs_dirty(filesystem_t * fs, uint32_t block) {
+    if (!fs->mapping) {
+        uint32_t chunk = (uint64_t) block * sizeof(uint16_t) / BITMAP_FLUSH_CHUNK;
+        fs->block_refs_dirty[chunk / 8] |= 1 << (chunk % 8);
+        fs->block_refs_have_dirty = 1;
+    }
+}
+void mark_block_hash_dirty(filesystem_t * fs, uint32_t block) {
+    if (!fs->mapping) {
+        uint32_t chunk = (uint64_t) block * sizeof(uint32_t) / BITMAP_FLUSH_CHUNK;
+        fs->block_hashes_dirty[chunk / 8] |= 1 << (chunk % 8);
+        fs->block_hashes_have_dirty = 1;
+    }
+}
+void mark_inode_bitmap_dirty(filesystem_t * fs) {
+    if (!fs->mapping) {
+        fs->inode_bitmap_dirty = 1;
+    }
+}
+int is_chunk_dirty(const uint8_t * dirty, uint32_t chunk) {
+    return (dirty[chunk / 8] >> (chunk % 8)) & 1;
+}
+
+// Writes the dirty BITMAP_FLUSH_CHUNK chunks of a table at image offset base, adjacent ones as one write
+void flush_dirty_chunks(filesystem_t * fs, uint64_t base, const uint8_t * table, uint8_t * dirty, uint32_t chunks) {
+    for (uint32_t first = 0; first < chunks; ++first) {
+        if (!is_chunk_dirty(dirty, first)) {
+            continue;
+        }
+        uint32_t last = first;
+        while (last + 1 < chunks && is_chunk_dirty(dirty, last + 1)) {
+            ++last;
+        }
+        uint64_t offset = (uint64_t) first * BITMAP_FLUSH_CHUNK;
+        if (fs->journal_active) {
+            journal_add(&fs->journal, base + offset, table + offset, (last - first + 1) * BITMAP_FLUSH_CHUNK);
+        } else {
+            disk_write(fs, base + offset, table + offset, (last - first + 1) * BITMAP_FLUSH_CHUNK);
+        }
+        first = last;
+    }
+    memset(dirty, 0, (chunks + 7) / 8);
+}
+
+/*
+ * Writes the dirty parts of both bitmaps, of the block refcounts and hashes.
+ * Called once at the end of every high-level operation and from fs_sync.
+ */
+void fs_flush_bitmaps(filesystem_t * fs) {
+    fs_mutex_lock(fs, &fs->alloc_lock);
+    if (!fs->block_bitmap_have_dirty && !fs->inode_bitmap_dirty && !fs->block_refs_have_dirty
+            && !fs->block_hashes_have_dirty) {
+        fs_mutex_unlock(fs, &fs->alloc_lock);
+        return;
+    }
+    uint64_t start = stats_clock(&fs->stats);
+    if (fs->block_bitmap_have_dirty) {
+        flush_dirty_chunks(fs, disk_offset_bitmap(fs), fs->block_bitmap, fs->block_bitmap_dirty,
+                           fs_block_bitmap_size(fs) / BITMAP_FLUSH_CHUNK);
+        fs->block_bitmap_have_dirty = 0;
+    }
+    if (fs->block_refs_have_dirty) {
+        flush_dirty_chunks(fs, disk_offset_block_refs(fs), (const uint8_t *) fs->block_refs, fs->block_refs_dirty,
+                           fs_block_refs_size(fs) / BITMAP_FLUSH_CHUNK);
+        fs->block_refs_have_dirty = 0;
+    }
+    if (fs->block_hashes_have_dirty) {
+        flush_dirty_chunks(fs, disk_offset_block_hashes(fs), (const uint8_t *) fs->block_hashes,
+                           fs->block_hashes_dirty, fs_block_hashes_size(fs) / BITMAP_FLUSH_CHUNK);
+        fs->block_hashes_have_dirty = 0;
+    }
+
+    if (fs->inode_bitmap_dirty) {
+        if (fs->journal_active) {
+            journal_add(&fs->journal, disk_offset_inode_bitmap(fs), fs->inode_bitmap, fs_inode_bitmap_size(fs));
+        } else {
+            disk_write(fs, disk_offset_inode_bitmap(fs), fs->inode_bitmap, fs_inode_bitmap_size(fs));
+        }
+        fs->inode_bitmap_dirty = 0;
+    }
+    fs_mutex_unlock(fs, &fs->alloc_lock);
+    stats_done(&fs->stats, STAT_BITMAP_FLUSHES, start);
+}
+
+// Callers hold meta_lock, the returned block moves when the table grows
+uint8_t * meta_block_find(filesystem_t * fs, uint32_t idx) {
+    meta_blocks_t * mb = &fs->meta_blocks;
+    if (mb->count == 0) {
+        return NULL;
+    }
+    for (uint32_t slot = idx & (mb->cap - 1); mb->idx[slot] != 0; slot = (slot + 1) & (mb->cap - 1)) {
+        if (mb->idx[slot] == idx) {
+            return mb->data + (size_t) slot * fs_block_size(fs);
+        }
+    }
+    return NULL;
+}
+
+// Returns the buffer of a pending metadata block, *created is set if it was not pending yet
+uint8_t * meta_block_get(filesystem_t * fs, uint32_t idx, int * created) {
+    meta_blocks_t * mb = &fs->meta_blocks;
+    uint8_t * data = meta_block_find(fs, idx);
+    *created = data == NULL;
+    if (data != NULL) {
+        return data;
+    }
+
+    if ((mb->count + 1) * 2 > mb->cap) {
+        meta_blocks_t old = *mb;
+        mb->cap = old.cap ? old.cap * 2 : 64;
+        mb->idx = calloc(mb->cap, sizeof(uint32_t));
+        mb->data = malloc((size_t) mb->cap * fs_block_size(fs));
+        mb->count = 0;
+        for (uint32_t i = 0; i < old.cap; ++i) {
+            if (old.idx[i] != 0) {
+                int unused;
+                memcpy(meta_block_get(fs, old.idx[i], &unused), old.data + (size_t) i * fs_block_size(fs),
+                       fs_block_size(fs));
+            }
+        }
+        free(old.idx);
+        free(old.data);
+    }
+
+    uint32_t slot = idx & (mb->cap - 1);
+    while (mb->idx[slot] != 0) {
+        slot = (slot + 1) & (mb->cap - 1);
+    }
+    mb->idx[slot] = idx;
+    ++mb->count;
+    return mb->data + (size_t) slot * fs_block_size(fs);
+}
+
+void meta_blocks_clear(meta_blocks_t * mb) {
+    if (mb->count != 0) {
+        memset(mb->idx, 0, mb->cap * sizeof(uint32_t));
+        mb->count = 0;
+    }
+}
+
+void meta_blocks_free(meta_blocks_t * mb) {
+    free(mb->idx);
+    free(mb->data);
+    memset(mb, 0, sizeof(meta_blocks_t));
+}
+void read_block(filesystem_t * fs, uint32_t idx, void* block) {
+    const uint32_t bs = fs_block_size(fs);
+    stats_add(&fs->stats, STAT_READ_BLOCK, 1);
+    if (fs->mapping) {
+        memcpy(block, fs_block_ptr(fs, idx), bs);
+        return;
+    }
+    fs_mutex_lock(fs, &fs->meta_lock);
+    const uint8_t * pending = meta_block_find(fs, idx);
+    if (pending != NULL) {
+        memcpy(block, pending, bs);
+    }
+    fs_mutex_unlock(fs, &fs->meta_lock);
+    if (pending != NULL || fs->bcache == NULL) {
+        if (pending == NULL) {
+            disk_read(fs, disk_offset_block(fs, idx), block, bs);
+        }
+        return;
+    }
+
+    fs_mutex_lock(fs, &fs->cache_lock);
+    if (!bcache_lookup(fs->bcache, idx, block)) {
+        disk_read(fs, disk_offset_block(fs, idx), block, bs);
+        bcache_insert(fs->bcache, idx, block, 0);
+    }
+    fs_mutex_unlock(fs, &fs->cache_lock);
+}
+// Metadata block write, goes to the current transaction when journaling
+void write_block(filesystem_t * fs, uint32_t idx, const void* block, uint32_t size) {
+    const uint32_t bs = fs_block_size(fs);
+    stats_add(&fs->stats, STAT_WRITE_BLOCK, 1);
+    assert(size <= bs);
+    if (fs->mapping) {
+        memcpy(fs_block_ptr(fs, idx), block, size);
+        return;
+    }
+    if (fs->journal_active) {
+        int created;
+        fs_mutex_lock(fs, &fs->meta_lock);
+        uint8_t * pending = meta_block_get(fs, idx, &created);
+        if (created && size < bs) {
+            disk_read(fs, disk_offset_block(fs, idx), pending, bs);
+        }
+        memcpy(pending, block, size);
+        if (fs->bcache != NULL) {
+            // Clean in the cache: the journal brings the image up to date
+            fs_mutex_lock(fs, &fs->cache_lock);
+            bcache_insert(fs->bcache, idx, pending, 0);
+            fs_mutex_unlock(fs, &fs->cache_lock);
+        }
+        fs_mutex_unlock(fs, &fs->meta_lock);
+        return;
+    }
+    if (fs->bcache != NULL) {
+        char full[MAX_BLOCK_SIZE];
+        if (size < bs) {
+            read_block(fs, idx, full);
+            memcpy(full, block, size);
+            block = full;
+        }
+        fs_mutex_lock(fs, &fs->cache_lock);
+        bcache_insert(fs->bcache, idx, block, 1);
+        fs_mutex_unlock(fs, &fs->cache_lock);
+        return;
+    }
+    disk_write(fs, disk_offset_block(fs, idx), block, size);
+}
+
+int is_inode_allocated(filesystem_t * fs, uint32_t idx) {
+    return (fs->inode_bitmap[idx / 8] >> (idx % 8)) & 1;
+}
+
+void fs_load_free_inodes(filesystem_t * fs) {
+    fs->inode_bitmap[0] |= 1;  // inode 0 does not exist
+    fs->free_inodes_count = 0;
+    for (uint32_t i = fs->sb.inodes_count - 1; i >= 1; --i) {
+        if (!is_inode_allocated(fs, i)) {
+            fs->free_inodes[fs->free_inodes_count++] = i;
+        }
+    }
+}
+
+uint32_t fs_find_empty_inode(filesystem_t * fs) {
+    fs_mutex_lock(fs, &fs->alloc_lock);
+    if (fs->free_inodes_count == 0) {
+        fs_mutex_unlock(fs, &fs->alloc_lock);
+        printf("FATAL: no more inodes\n");
+        return -1;
+    }
+
+    uint32_t idx = fs->free_inodes[--fs->free_inodes_count];
+    fs->inode_bitmap[idx / 8] |= 1 << (idx % 8);
+    mark_inode_bitmap_dirty(fs);
+    fs_mutex_unlock(fs, &fs->alloc_lock);
+    stats_add(&fs->stats, STAT_INODE_ALLOCS, 1);
+    if (!fs->quiet) {
+        printf("Allocated inode %d\n", idx);
+    }
+    return idx;
+}
+
+void fs_free_inode(filesystem_t * fs, uint32_t idx) {
+    fs_mutex_lock(fs, &fs->alloc_lock);
+    fs->inode_bitmap[idx / 8] &= ~(1 << (idx % 8));
+    mark_inode_bitmap_dirty(fs);
+    fs->free_inodes[fs->free_inodes_count++] = idx;
+    fs_mutex_unlock(fs, &fs->alloc_lock);
+}
+
+/*
+ * Bitmap scanning a 64-bit word at a time; bit i of the map is bit i % 8 of byte i / 8,
+ * which on little-endian hosts is bit i % 64 of word i / 64.
+ */
+uint64_t bitmap_word(const uint8_t * bitmap, uint32_t word_idx) {
+    uint64_t word;
+    memcpy(&word, bitmap + word_idx * sizeof(word), sizeof(word));
+    return word;
+}
+
+// Index of the first clear bit in [from, nbits), or nbits if there is none
+uint32_t bitmap_find_zero(const uint8_t * bitmap, uint32_t nbits, uint32_t from) {
+    uint32_t words = nbits / 64;
+    for (uint32_t w = from / 64; w < words; ++w) {
+        uint64_t word = bitmap_word(bitmap, w);
+        if (w == from / 64) {
+            word |= (1ULL << (from % 64)) - 1;  // ignore bits before from
+        }
+        if (word != UINT64_MAX) {
+            return w * 64 + __builtin_ctzll(~word);
+        }
+    }
+    return nbits;
+}
+
+// Length of the run of clear bits starting at from, at most max_len
+uint32_t bitmap_zero_run(const uint8_t * bitmap, uint32_t nbits, uint32_t from, uint32_t max_len) {
+    uint32_t len = 0;
+    while (len < max_len && from + len < nbits) {
+        uint32_t pos = from + len;
+        uint64_t word = bitmap_word(bitmap, pos / 64) >> (pos % 64);
+        uint32_t avail = 64 - pos % 64;
+        if (word != 0) {
+            uint32_t zeros = __builtin_ctzll(word);
+            len += zeros < avail ? zeros : avail;
+            if (zeros < avail) {
+                break;
+            }
+        } else {
+            len += avail;
+        }
+    }
+    return len < max_len ? len : max_len;
+}
+
+void bitmap_set_range(uint8_t * bitmap, uint32_t from, uint32_t len) {
+    for (uint32_t i = from; i < from + len; ++i) {
+        bitmap[i / 8] |= 1 << (i % 8);
+    }
+}
+
+/*
+ * Finds a free run of exactly len blocks (next-fit from the hint, wrapping once).
+ * Returns its start or -1 if no free run is that long.
+ */
+uint32_t fs_find_free_run(filesystem_t * fs, uint32_t len) {
+    const uint8_t * bitmap = fs->block_bitmap;
+    uint32_t nbits = disk_blocks_count(fs);
+    uint32_t from = fs->block_hint < nbits ? fs->block_hint : 0;
+
+    for (int pass = 0; pass < 2; ++pass) {
+        uint32_t end = pass == 0 ? nbits : from;
+        uint32_t pos = pass == 0 ? from : 0;
+        while ((pos = bitmap_find_zero(bitmap, end, pos)) < end) {
+            uint32_t run = bitmap_zero_run(bitmap, end, pos, len);
+            if (run == len) {
+                return pos;
+            }
+            pos += run;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Allocates count blocks into out, preferring a single contiguous run: at goal
+ * (0 - none) if it is free there, otherwise the next one after the hint. Falls back
+ * to the first free runs after the hint. Returns the number of blocks allocated.
+ */
+uint32_t fs_alloc_blocks(filesystem_t * fs, uint32_t goal, uint32_t count, uint32_t * out) {
+    uint8_t * bitmap = fs->block_bitmap;
+    uint32_t nbits = disk_blocks_count(fs);
+    uint32_t allocated = 0;
+
+    fs_mutex_lock(fs, &fs->alloc_lock);
+    uint32_t start = -1;
+    if (goal != 0 && goal < nbits && bitmap_zero_run(bitmap, nbits, goal, count) == count) {
+        start = goal;
+    } else {
+        start = fs_find_free_run(fs, count);
+    }
+    if (start != (uint32_t) -1) {
+        bitmap_set_range(bitmap, start, count);
+        mark_bitmap_dirty(fs, start, count);
+        for (; allocated < count; ++allocated) {
+            out[allocated] = start + allocated;
+        }
+        fs->block_hint = start + count;
+    } else {
+        // The hint moves as runs are taken, the wraparound stops where the scan began
+        const uint32_t hint = fs->block_hint < nbits ? fs->block_hint : 0;
+        uint32_t pos = hint;
+        for (int pass = 0; pass < 2 && allocated < count; ++pass) {
+            uint32_t end = pass == 0 ? nbits : hint;
+            pos = pass == 0 ? pos : 0;
+            while (allocated < count && (pos = bitmap_find_zero(bitmap, end, pos)) < end) {
+                uint32_t run = bitmap_zero_run(bitmap, end, pos, count - allocated);
+                bitmap_set_range(bitmap, pos, run);
+                mark_bitmap_dirty(fs, pos, run);
+                for (uint32_t i = 0; i < run; ++i) {
+                    out[allocated++] = pos + i;
+                }
+                pos += run;
+                fs->block_hint = pos;
+            }
+        }
+    }
+    fs_mutex_unlock(fs, &fs->alloc_lock);
+
+    if (allocated == 0) {
+        printf("FATAL: no more blocks\n");
+        return 0;
+    }
+    stats_add(&fs->stats, STAT_BLOCK_ALLOCS, allocated);
+    for (uint32_t i = 0; i < allocated && !fs->quiet; ++i) {
+        printf("Allocated block %d\n", out[i]);
+    }
+    return allocated;
+}
+
+uint32_t fs_alloc_block(filesystem_t * fs) {
+    uint32_t block_idx;
+    if (fs_alloc_blocks(fs, 0, 1, &block_idx) == 0) {
+        return -1;
+    }
+    return block_idx;
+}
+
+// Owners of a block, more than one when it is shared by clones
+uint32_t fs_block_owners(filesystem_t * fs, uint32_t idx) {
+    return 1 + __atomic_load_n(fs->block_refs + idx, __ATOMIC_RELAXED);
+}
+
+// Adds an owner to count blocks starting at first
+void fs_ref_blocks(filesystem_t * fs, uint32_t first, uint32_t count) {
+    fs_mutex_lock(fs, &fs->alloc_lock);
+    for (uint32_t idx = first; idx < first + count; ++idx) {
+        if (fs->block_refs[idx] != BLOCK_REFS_PINNED) {
+            ++fs->block_refs[idx];
+            mark_block_refs_dirty(fs, idx);
+        }
+    }
+    fs_mutex_unlock(fs, &fs->alloc_lock);
+}
+
+/*
+ * Returns 1 if the data block has a single owner, who may then write it in place;
+ * it loses its hash, so dedup does not share it meanwhile. 0 - it is shared.
+ */
+int fs_claim_block(filesystem_t * fs, uint32_t idx) {
+    fs_mutex_lock(fs, &fs->alloc_lock);
+    int exclusive = fs->block_refs[idx] == 0;
+    if (exclusive && fs->block_hashes[idx] != 0) {
+        fs->block_hashes[idx] = 0;
+        mark_block_hash_dirty(fs, idx);
+    }
+    fs_mutex_unlock(fs, &fs->alloc_lock);
+    return exclusive;
+}
+
+// Drops an owner of count blocks starting at first, frees the blocks nobody else owns
+void fs_dealloc_blocks(filesystem_t * fs, uint32_t first, uint32_t count) {
+    uint32_t freed = 0;
+    fs_mutex_lock(fs, &fs->alloc_lock);
+    for (uint32_t idx = first; idx < first + count; ++idx) {
+        if (fs->block_refs[idx] != 0) {
+            if (fs->block_refs[idx] != BLOCK_REFS_PINNED) {
+                --fs->block_refs[idx];
+                mark_block_refs_dirty(fs, idx);
+            }
+            continue;
+        }
+        ++freed;
+        if (fs->block_hashes[idx] != 0) {
+            fs->block_hashes[idx] = 0;
+            mark_block_hash_dirty(fs, idx);
+        }
+        if (!fs->quiet) {
+            printf("Deallocated block %d\n", idx);
+        }
+        if (fs->journal_active) {
+            // Released by fs_commit
+            if (fs->tx_freed_count == fs->tx_freed_cap) {
+                fs->tx_freed_cap = fs->tx_freed_cap ? fs->tx_freed_cap * 2 : 64;
+                fs->tx_freed = realloc(fs->tx_freed, fs->tx_freed_cap * sizeof(uint32_t));
+            }
+            fs->tx_freed[fs->tx_freed_count++] = idx;
+        } else {
+            fs->block_bitmap[idx / 8] &= ~(1 << (idx % 8));
+        }
+    }
+    if (!fs->journal_active) {
+        mark_bitmap_dirty(fs, first, count);
+    }
+    fs_mutex_unlock(fs, &fs->alloc_lock);
+    stats_add(&fs->stats, STAT_BLOCK_FREES, freed);
+}
+
+void fs_dealloc_block(filesystem_t * fs, uint32_t idx) {
+    fs_dealloc_blocks(fs, idx, 1);
+}
+
+/*
+ * Makes all changes so far durable: with the journal as one transaction, otherwise
+ * by writing dirty bitmaps and inodes in place.
+ */
+void fs_commit(filesystem_t * fs) {
+    uint64_t start = stats_clock(&fs->stats);
+    if (!fs->journal_active) {
+        if (fs->bcache != NULL) {
+            fs_mutex_lock(fs, &fs->cache_lock);
+            bcache_flush(fs->bcache);
+            fs_mutex_unlock(fs, &fs->cache_lock);
+        }
+        fs_flush_bitmaps(fs);
+        write_dirty_inodes(fs);
+        stats_done(&fs->stats, STAT_COMMITS, start);
+        return;
+    }
+
+    fs_mutex_lock(fs, &fs->alloc_lock);
+    for (uint32_t i = 0; i < fs->tx_freed_count; ++i) {
+        uint32_t idx = fs->tx_freed[i];
+        fs->block_bitmap[idx / 8] &= ~(1 << (idx % 8));
+        mark_bitmap_dirty(fs, idx, 1);
+    }
+    fs->tx_freed_count = 0;
+    fs_mutex_unlock(fs, &fs->alloc_lock);
+
+    fs_flush_bitmaps(fs);
+    write_dirty_inodes(fs);
+    meta_blocks_t * mb = &fs->meta_blocks;
+    for (uint32_t slot = 0; slot < mb->cap; ++slot) {
+        uint32_t idx = mb->idx[slot];
+        // Blocks freed by this transaction are dropped, they may hold file data later
+        if (idx != 0 && (fs->block_bitmap[idx / 8] >> (idx % 8)) & 1) {
+            journal_add(&fs->journal, disk_offset_block(fs, idx), mb->data + (size_t) slot * fs_block_size(fs),
+                        fs_block_size(fs));
+        }
+    }
+    journal_commit(&fs->journal);
+    fs_mutex_lock(fs, &fs->meta_lock);  // fs_op_end peeks at the count without op_lock
+    meta_blocks_clear(mb);
+    fs_mutex_unlock(fs, &fs->meta_lock);
+    stats_done(&fs->stats, STAT_COMMITS, start);
+}
+
+// Enough pending metadata for a group commit
+int fs_meta_blocks_full(filesystem_t * fs) {
+    return (uint64_t) fs->meta_blocks.count * fs_block_size(fs) >= JOURNAL_GROUP_SIZE;
+}
+
+// Called at the end of every high-level operation, in concurrent mode fs_op_end commits
+void fs_op_done(filesystem_t * fs) {
+    if (!fs->journal_active) {
+        fs_flush_bitmaps(fs);
+    } else if (!fs->concurrent && fs_meta_blocks_full(fs)) {
+        fs_commit(fs);
+    }
+}
+
+void fs_init_dir_block(filesystem_t * fs, uint32_t inode_idx, uint32_t parent_inode);
+
+void fs_aio_start(filesystem_t * fs) {
+    if (!fs->use_aio || fs->mapping) {
+        return;
+    }
+    fs->aio = malloc(sizeof(aio_t));
+    if (aio_init(fs->aio, fs->fd, fs->use_aio == 2) != 0) {
+        aio_destroy(fs->aio);
+        free(fs->aio);
+        fs->aio = NULL;
+        return;
+    }
+    if (!fs->quiet) {
+        fprintf(stderr, "Async I/O: %s\n", aio_mode_name(fs->aio));
+    }
+}
+
+// Builds the dedup index from the persisted hashes, callers other than fs_init/fs_create hold alloc_lock
+void fs_dedup_start(filesystem_t * fs) {
+    if (!fs->dedup) {
+        return;
+    }
+    uint32_t count = 0;
+    for (uint32_t idx = 0; idx < disk_blocks_count(fs); ++idx) {
+        count += fs->block_hashes[idx] != 0;
+    }
+    dedup_destroy(fs->dedup_index);
+    fs->dedup_index = dedup_create(count);
+    for (uint32_t idx = 0; idx < disk_blocks_count(fs); ++idx) {
+        if (fs->block_hashes[idx] != 0) {
+            dedup_insert(fs->dedup_index, fs->block_hashes[idx], idx);
+        }
+    }
+}
+
+void fs_cache_start(filesystem_t * fs) {
+    if (fs->cache_blocks < 0 || fs->mapping) {
+        return;
+    }
+    uint32_t frames = fs->cache_blocks ? (uint32_t) fs->cache_blocks : BCACHE_DEFAULT_SIZE / fs_block_size(fs);
+    fs->bcache = bcache_create(frames, fs_block_size(fs), fs->fd, disk_offset_block(fs, 0));
+    fs->bcache->stats = &fs->stats;
+}
+
+// Bookkeeping sized by the geometry, the tables themselves only when they are not mapped
+void fs_alloc_tables(filesystem_t * fs) {
+    if (!fs->mapping) {
+        fs->inodes = calloc(fs->sb.inodes_count, sizeof(inode_t));
+        fs->block_bitmap = calloc(fs_block_bitmap_size(fs), 1);
+        fs->inode_bitmap = calloc(fs_inode_bitmap_size(fs), 1);
+        fs->block_refs = calloc(fs_block_refs_size(fs), 1);
+        fs->block_hashes = calloc(fs_block_hashes_size(fs), 1);
+    }
+    fs->inodes_dirty = calloc(fs_inode_bitmap_size(fs), 1);
+    fs->block_bitmap_dirty = calloc(fs_bitmap_dirty_size(fs), 1);
+    fs->block_refs_dirty = calloc(fs_refs_dirty_size(fs), 1);
+    fs->block_hashes_dirty = calloc(fs_hashes_dirty_size(fs), 1);
+    fs->free_inodes = malloc(fs->sb.inodes_count * sizeof(uint32_t));
+}
+
+void fs_free_tables(filesystem_t * fs) {
+    if (!fs->mapping) {
+        free(fs->inodes);
+        free(fs->block_bitmap);
+        free(fs->inode_bitmap);
+        free(fs->block_refs);
+        free(fs->block_hashes);
+    }
+    free(fs->inodes_dirty);
+    free(fs->block_bitmap_dirty);
+    free(fs->block_refs_dirty);
+    free(fs->block_hashes_dirty);
+    free(fs->free_inodes);
+    fs->inodes = NULL;
+    fs->block_bitmap = fs->inode_bitmap = NULL;
+    fs->block_refs = NULL;
+    fs->block_hashes = NULL;
+    fs->inodes_dirty = fs->block_bitmap_dirty = fs->block_refs_dirty = fs->block_hashes_dirty = NULL;
+    fs->free_inodes = NULL;
+}
+
+int fs_map(filesystem_t * fs) {
+    // Image files may be shorter than the full layout (sparse tail), so extend them first
+    int fd = fileno(fs->disk_device);
+    if (ftruncate(fd, disk_image_size(fs)) != 0) {
+        check_error("fs_map: ftruncate");
+        return -1;
+    }
+
+    void * addr = mmap(NULL, disk_image_size(fs), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        check_error("fs_map: mmap");
+        return -1;
+    }
+    fs->mapping = addr;
+    fs->mapping_size = disk_image_size(fs);
+    fs->inodes = (inode_t *) (fs->mapping + disk_offset_inode(fs, 1));
+    fs->block_bitmap = fs->mapping + disk_offset_bitmap(fs);
+    fs->inode_bitmap = fs->mapping + disk_offset_inode_bitmap(fs);
+    fs->block_refs = (uint16_t *) (fs->mapping + disk_offset_block_refs(fs));
+    fs->block_hashes = (uint32_t *) (fs->mapping + disk_offset_block_hashes(fs));
+    return 0;
+}
+
+// Returns 0 if the image was opened, the superblock must describe a usable geometry
+int fs_init(filesystem_t * fs, const char* path) {
+    fs->disk_device = fopen(path, "r+");
+    if (!fs->disk_device) {
+        check_error("fs_init: fopen");
+        return -1;
+    }
+    // All I/O goes through the descriptor, stdio must not cache anything
+    setvbuf(fs->disk_device, NULL, _IONBF, 0);
+    fs->fd = fileno(fs->disk_device);
+    stats_start(&fs->stats);
+
+    memset(&fs->sb, 0, sizeof(superblock_t));
+    disk_read(fs, 0, &fs->sb, sizeof(superblock_t));
+    if (superblock_check(&fs->sb) != 0) {
+        fclose(fs->disk_device);
+        stats_free(&fs->stats);
+        return -1;
+    }
+    fs_locks_init(fs);
+
+    // Finish the last committed transaction before anything is loaded
+    journal_init(&fs->journal, fs->fd, disk_offset_journal(fs), (uint64_t) fs->sb.journal_blocks * fs_block_size(fs));
+    fs->journal.stats = &fs->stats;
+    int replayed = journal_recover(&fs->journal);
+
+    if (fs->use_mmap) {
+        fs_map(fs);
+    }
+    fs_alloc_tables(fs);
+    if (!fs->mapping) {
+        // Inode table, both bitmaps, refcounts and hashes are adjacent, so they are loaded sequentially
+        uint8_t padding[8];
+        struct iovec tables[6] = {
+                {fs->inodes, fs->sb.inodes_count * sizeof(inode_t)},
+                {fs->block_bitmap, fs_block_bitmap_size(fs)},
+                {fs->inode_bitmap, fs_inode_bitmap_size(fs)},
+                {padding, disk_offset_block_refs(fs) - disk_offset_inode_bitmap(fs) - fs_inode_bitmap_size(fs)},
+                {fs->block_refs, fs_block_refs_size(fs)},
+                {fs->block_hashes, fs_block_hashes_size(fs)}
+        };
+        uint64_t start = stats_clock(&fs->stats);
+        errno = 0;
+        preadv(fs->fd, tables, 6, disk_offset_inode(fs, 1)) ASSERTED;
+        stats_io(&fs->stats, 0, disk_offset_inode(fs, 1),
+                 disk_offset_block_hashes(fs) + fs_block_hashes_size(fs) - disk_offset_inode(fs, 1), start);
+    }
+
+    fs_load_free_inodes(fs);
+    fs->dcache = dcache_create();
+    fs_aio_start(fs);
+    fs_cache_start(fs);
+    fs_dedup_start(fs);
+
+    fs->journal_active = !fs->no_journal && !fs->mapping;
+    if (!fs->journal_active && replayed) {
+        // Changes made without the journal must not be overwritten by a later replay
+        journal_invalidate(&fs->journal);
+        fsync(fs->fd);
+    }
+    return 0;
+}
+
+/*
+ * Creates an empty image with the geometry requested in fs->sb (see filesystem_t).
+ * Returns 0 on success.
+ */
+int fs_create(filesystem_t * fs, const char* path) {
+    if (superblock_prepare(&fs->sb) != 0) {
+        return -1;
+    }
+    fs->disk_device = fopen(path, "w+");
+    if (!fs->disk_device) {
+        check_error("fs_create: fopen");
+        return -1;
+    }
+    setvbuf(fs->disk_device, NULL, _IONBF, 0);
+    fs->fd = fileno(fs->disk_device);
+    stats_start(&fs->stats);
+    fs_locks_init(fs);
+
+    // The superblock takes the whole first block, the rest of it stays zero
+    char first_block[MAX_BLOCK_SIZE] = {0};
+    memcpy(first_block, &fs->sb, sizeof(superblock_t));
+    disk_write(fs, 0, first_block, fs_block_size(fs));
+    // Allocate inodes and bitmaps
+    errno = 0;
+    ftruncate(fs->fd, disk_offset_journal(fs)) ASSERTED;
+
+    if (fs->use_mmap) {
+        fs_map(fs);
+    }
+    fs_alloc_tables(fs);
+
+    journal_init(&fs->journal, fs->fd, disk_offset_journal(fs), (uint64_t) fs->sb.journal_blocks * fs_block_size(fs));
+    fs->journal.stats = &fs->stats;
+    fs->journal_active = !fs->no_journal && !fs->mapping;
+
+    // Reserve block 0 and create root
+    fs->block_bitmap[0] |= 1;
+    mark_bitmap_dirty(fs, 0, 1);
+    fs->inode_bitmap[0] |= 1 << 1;
+    mark_inode_bitmap_dirty(fs);
+    fs_load_free_inodes(fs);
+    fs->dcache = dcache_create();
+    fs_aio_start(fs);
+    fs_cache_start(fs);
+    fs_dedup_start(fs);
+    fs_init_dir_block(fs, 1, 1);
+    fs_op_done(fs);
+    return 0;
+}
+
+// Must not be called while the calling thread is inside an operation (e.g. holds a dir_iter_t)
+void fs_sync(filesystem_t * fs) {
+    if (fs->concurrent) {
+        pthread_rwlock_wrlock(&fs->op_lock);
+    }
+    if (fs->mapping) {
+        msync(fs->mapping, fs->mapping_size, MS_SYNC) ASSERTED;
+    } else {
+        fs_commit(fs);
+    }
+    if (fs->concurrent) {
+        pthread_rwlock_unlock(&fs->op_lock);
+    }
+}
+
+void fs_op_end(filesystem_t * fs) {
+    if (!fs->concurrent) {
+        return;
+    }
+    pthread_rwlock_unlock(&fs->op_lock);
+
+    // Group commit once enough metadata is pending, by whichever thread notices first
+    pthread_mutex_lock(&fs->meta_lock);
+    int full = fs->journal_active && fs_meta_blocks_full(fs);
+    pthread_mutex_unlock(&fs->meta_lock);
+    if (full) {
+        fs_sync(fs);
+    }
+}
+
+// Statistics and buffer cache counters as text or as one JSON object
+void fs_print_stats(filesystem_t * fs, FILE * out, int json) {
+    bcache_t * cache = fs->bcache;
+    if (!json) {
+        if (cache != NULL) {
+            fprintf(out, "stats: cache hits %lu, misses %lu, readahead %lu, writebacks %lu\n",
+                    cache->hits, cache->misses, cache->readahead, cache->writebacks);
+        }
+        stats_print(&fs->stats, out);
+        return;
+    }
+    fprintf(out, "{\n");
+    if (cache != NULL) {
+        fprintf(out, "  \"cache\": {\"hits\": %lu, \"misses\": %lu, \"readahead\": %lu, \"writebacks\": %lu},\n",
+                cache->hits, cache->misses, cache->readahead, cache->writebacks);
+    }
+    stats_json(&fs->stats, out);
+    fprintf(out, "\n}\n");
+}
+
+void fs_close(filesystem_t * fs) {
+    fs_sync(fs);
+    if (fs->journal_active) {
+        // Home writes of the last transaction are durable after this fsync, the journal is not needed
+        fsync(fs->fd);
+        journal_invalidate(&fs->journal);
+    }
+    journal_free(&fs->journal);
+    meta_blocks_free(&fs->meta_blocks);
+    stats_free(&fs->stats);
+    free(fs->tx_freed);
+    fs->tx_freed = NULL;
+    fs->tx_freed_count = fs->tx_freed_cap = 0;
+    fs_free_tables(fs);
+    if (fs->mapping) {
+        munmap(fs->mapping, fs->mapping_size);
+        fs->mapping = NULL;
+    }
+    dcache_destroy(fs->dcache);
+    fs->dcache = NULL;
+    dedup_destroy(fs->dedup_index);
+    fs->dedup_index = NULL;
+    if (fs->bcache != NULL) {
+        bcache_destroy(fs->bcache);
+        fs->bcache = NULL;
+    }
+    if (fs->aio != NULL) {
+        aio_destroy(fs->aio);
+        free(fs->aio);
+        fs->aio = NULL;
+    }
+    fs_locks_destroy(fs);
+    fclose(fs->disk_device);
+}
+
+/*
+ * Logical to physical block mapping by extents. The inode holds up to INODE_EXTENTS
+ * entries sorted by lblk; when they do not fit they become the root of a B-tree of
+ * extent_depth levels whose nodes are blocks of sorted entries. An index entry
+ * gives the first logical block under a child node, the node and its entry count.
+ * Unmapped blocks are holes, holes read as zeros.
+ */
+typedef struct BmapCursor {
+    extent_t last;     // found by the last lookup, len 0 - none
+    uint32_t leaf_idx;  // leaf node copied to leaf, 0 - none
+    extent_t leaf[MAX_NODE_EXTENTS];
+} bmap_cursor_t;
+
+// Has to be called after the mapping of the inode changed
+void bmap_cursor_reset(bmap_cursor_t * cur) {
+    cur->last.len = 0;
+    cur->leaf_idx = 0;
+}
+
+// Index of the last entry starting at or before lblk, -1 if there is none
+int32_t extent_search(const extent_t * entries, uint32_t count, uint32_t lblk) {
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (entries[mid].lblk <= lblk) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return (int32_t) lo - 1;
+}
+
+// Physical block of logical block lblk of the file, 0 for a hole
+uint32_t fs_bmap(filesystem_t * fs, bmap_cursor_t * cur, inode_t * inode, uint32_t lblk) {
+    extent_t * last = &cur->last;
+    if (lblk < last->lblk || lblk - last->lblk >= last->len) {
+        const extent_t * node = inode->extents;
+        uint32_t count = inode->extent_count;
+        extent_t index[MAX_NODE_EXTENTS];
+        for (uint32_t depth = inode->extent_depth; depth > 0; --depth) {
+            int32_t i = extent_search(node, count, lblk);
+            if (i < 0) {
+                return 0;
+            }
+            uint32_t child = node[i].start;
+            count = node[i].len;
+            if (depth > 1) {
+                read_block(fs, child, index);
+                node = index;
+            } else {
+                if (cur->leaf_idx != child) {
+                    read_block(fs, child, cur->leaf);
+                    cur->leaf_idx = child;
+                }
+                node = cur->leaf;
+            }
+        }
+        int32_t i = extent_search(node, count, lblk);
+        if (i < 0 || lblk - node[i].lblk >= node[i].len) {
+            return 0;
+        }
+        *last = node[i];
+    }
+    return last->start + (lblk - last->lblk);
+}
+
+/*
+ * Puts entry at pos of a node with count entries and room for cap. A full node is
+ * split: the upper half moves to a new block described by *split (len 0 - no split).
+ * Returns the new entry count of the node or -1 if no block is left.
+ */
+int32_t extent_node_insert(filesystem_t * fs, extent_t * entries, uint32_t count, uint32_t cap, uint32_t pos,
+                           extent_t entry, extent_t * split) {
+    split->len = 0;
+    if (count < cap) {
+        memmove(entries + pos + 1, entries + pos, (count - pos) * sizeof(extent_t));
+        entries[pos] = entry;
+        return count + 1;
+    }
+
+    uint32_t block_idx = fs_alloc_block(fs);
+    if (block_idx == (uint32_t) -1) {
+        return -1;
+    }
+    extent_t all[MAX_NODE_EXTENTS + 1];
+    memcpy(all, entries, pos * sizeof(extent_t));
+    all[pos] = entry;
+    memcpy(all + pos + 1, entries + pos, (count - pos) * sizeof(extent_t));
+    uint32_t keep = (count + 1) / 2;
+    memcpy(entries, all, keep * sizeof(extent_t));
+
+    extent_t node[MAX_NODE_EXTENTS] = {0};
+    memcpy(node, all + keep, (count + 1 - keep) * sizeof(extent_t));
+    write_block(fs, block_idx, node, fs_block_size(fs));
+    *split = (extent_t) {.lblk = all[keep].lblk, .start = block_idx, .len = count + 1 - keep};
+    return keep;
+}
+
+// Extent b continues a both logically and physically
+int extent_follows(const extent_t * a, const extent_t * b) {
+    return a->lblk + a->len == b->lblk && a->start + a->len == b->start;
+}
+
+// Adds ext to the subtree rooted at entries, arguments and result as for extent_node_insert
+int32_t extent_insert(filesystem_t * fs, extent_t * entries, uint32_t count, uint32_t cap, uint32_t depth,
+                      extent_t ext, extent_t * split) {
+    split->len = 0;
+    int32_t i = extent_search(entries, count, ext.lblk);
+    if (depth == 0) {
+        // Appends and fills of the block before an extent grow it instead of adding one
+        if (i >= 0 && extent_follows(entries + i, &ext)) {
+            entries[i].len += ext.len;
+            return count;
+        }
+        if ((uint32_t) (i + 1) < count && extent_follows(&ext, entries + i + 1)) {
+            entries[i + 1].lblk = ext.lblk;
+            entries[i + 1].start = ext.start;
+            entries[i + 1].len += ext.len;
+            return count;
+        }
+        return extent_node_insert(fs, entries, count, cap, i + 1, ext, split);
+    }
+
+    if (i < 0) {
+        i = 0;  // before the first extent of the file
+    }
+    extent_t * parent = entries + i;
+    extent_t child[MAX_NODE_EXTENTS];
+    extent_t child_split;
+    read_block(fs, parent->start, child);
+    int32_t child_count = extent_insert(fs, child, parent->len, fs_node_extents(fs), depth - 1, ext, &child_split);
+    if (child_count < 0) {
+        return -1;
+    }
+    write_block(fs, parent->start, child, fs_block_size(fs));
+    parent->lblk = child[0].lblk;
+    parent->len = child_count;
+    if (child_split.len == 0) {
+        return count;
+    }
+    // Out of space here leaks the split child, fsck reports its blocks
+    return extent_node_insert(fs, entries, count, cap, i + 1, child_split, split);
+}
+
+// Stores the entry count of the root after an update, the tree grows by one level when it split
+int extent_root_update(filesystem_t * fs, inode_t * inode, int32_t count, extent_t split) {
+    if (count < 0) {
+        return -1;
+    }
+    if (split.len != 0) {
+        // The root split: its lower half goes to a new node as well
+        uint32_t block_idx = fs_alloc_block(fs);
+        if (block_idx == (uint32_t) -1) {
+            inode->extent_count = count;
+            return -1;
+        }
+        extent_t node[MAX_NODE_EXTENTS] = {0};
+        memcpy(node, inode->extents, count * sizeof(extent_t));
+        write_block(fs, block_idx, node, fs_block_size(fs));
+        inode->extents[0] = (extent_t) {.lblk = node[0].lblk, .start = block_idx, .len = count};
+        inode->extents[1] = split;
+        count = 2;
+        ++inode->extent_depth;
+    }
+    inode->extent_count = count;
+    if (count == 0) {
+        inode->extent_depth = 0;
+    }
+    return 0;
+}
+
+/*
+ * Maps logical blocks ext.lblk.. to physical blocks ext.start.., they must be
+ * unmapped. The caller stores the inode. Returns -1 when out of space for tree
+ * nodes or when the tree cannot grow any deeper.
+ */
+int fs_map_extent(filesystem_t * fs, bmap_cursor_t * cur, inode_t * inode, extent_t ext) {
+    bmap_cursor_reset(cur);
+    if (inode->extent_count == INODE_EXTENTS && inode->extent_depth == EXTENT_MAX_DEPTH) {
+        printf("fs_pwrite: file too fragmented\n");
+        return -1;
+    }
+
+    extent_t split;
+    int32_t count = extent_insert(fs, inode->extents, inode->extent_count, INODE_EXTENTS, inode->extent_depth,
+                                  ext, &split);
+    return extent_root_update(fs, inode, count, split);
+}
+
+/*
+ * Unmaps up to len blocks from lblk in the subtree rooted at entries, stopping at
+ * the end of the extent that maps lblk; *removed gets their number, 0 if lblk is
+ * a hole. Cutting an extent in two may split nodes as extent_insert does, nodes
+ * left empty are freed. Returns the new entry count or -1.
+ */
+int32_t extent_remove(filesystem_t * fs, extent_t * entries, uint32_t count, uint32_t cap, uint32_t depth,
+                      uint32_t lblk, uint32_t len, uint32_t * removed, extent_t * split) {
+    split->len = 0;
+    *removed = 0;
+    int32_t i = extent_search(entries, count, lblk);
+    if (i < 0) {
+        return count;
+    }
+    extent_t * ext = entries + i;
+    if (depth == 0) {
+        uint32_t ext_end = ext->lblk + ext->len;
+        if (lblk >= ext_end) {
+            return count;
+        }
+        uint32_t end = lblk + len < ext_end ? lblk + len : ext_end;
+        *removed = end - lblk;
+        if (lblk == ext->lblk && end == ext_end) {
+            memmove(ext, ext + 1, (count - i - 1) * sizeof(extent_t));
+            return count - 1;
+        }
+        if (lblk == ext->lblk) {
+            ext->lblk = end;
+            ext->start += *removed;
+            ext->len -= *removed;
+            return count;
+        }
+        extent_t tail = {.lblk = end, .start = ext->start + (end - ext->lblk), .len = ext_end - end};
+        ext->len = lblk - ext->lblk;
+        if (tail.len == 0) {
+            return count;
+        }
+        int32_t new_count = extent_node_insert(fs, entries, count, cap, i + 1, tail, split);
+        if (new_count < 0) {
+            ext->len = ext_end - ext->lblk;  // the root is the inode itself, leave it whole
+        }
+        return new_count;
+    }
+
+    extent_t child[MAX_NODE_EXTENTS];
+    extent_t child_split;
+    read_block(fs, ext->start, child);
+    int32_t child_count = extent_remove(fs, child, ext->len, fs_node_extents(fs), depth - 1, lblk, len, removed,
+                                        &child_split);
+    if (child_count < 0) {
+        return -1;
+    }
+    if (child_count == 0) {
+        fs_dealloc_block(fs, ext->start);
+        memmove(ext, ext + 1, (count - i - 1) * sizeof(extent_t));
+        return count - 1;
+    }
+    write_block(fs, ext->start, child, fs_block_size(fs));
+    ext->lblk = child[0].lblk;
+    ext->len = child_count;
+    if (child_split.len == 0) {
+        return count;
+    }
+    return extent_node_insert(fs, entries, count, cap, i + 1, child_split, split);
+}
+
+/*
+ * Unmaps logical blocks lblk..lblk + len - 1 without releasing them. The caller
+ * stores the inode. Returns -1 when out of space for tree nodes.
+ */
+int fs_unmap_blocks(filesystem_t * fs, bmap_cursor_t * cur, inode_t * inode, uint32_t lblk, uint32_t len) {
+    bmap_cursor_reset(cur);
+    while (len > 0) {
+        if (inode->extent_count == INODE_EXTENTS && inode->extent_depth == EXTENT_MAX_DEPTH) {
+            printf("fs_pwrite: file too fragmented\n");
+            return -1;
+        }
+        uint32_t removed;
+        extent_t split;
+        int32_t count = extent_remove(fs, inode->extents, inode->extent_count, INODE_EXTENTS, inode->extent_depth,
+                                      lblk, len, &removed, &split);
+        if (extent_root_update(fs, inode, count, split) != 0) {
+            return -1;
+        }
+        removed = removed ? removed : 1;  // a hole
+        removed = removed < len ? removed : len;
+        lblk += removed;
+        len -= removed;
+    }
+    return 0;
+}
+
+void fs_free_extents(filesystem_t * fs, const extent_t * entries, uint32_t count, uint32_t depth) {
+    for (uint32_t i = 0; i < count; ++i) {
+        if (depth > 0) {
+            extent_t child[MAX_NODE_EXTENTS];
+            read_block(fs, entries[i].start, child);
+            fs_free_extents(fs, child, entries[i].len, depth - 1);
+            fs_dealloc_block(fs, entries[i].start);
+        } else {
+            fs_dealloc_blocks(fs, entries[i].start, entries[i].len);
+        }
+    }
+}
+
+// Releases every block owned by the inode, inode itself is not written
+void fs_free_file_blocks(filesystem_t * fs, inode_t * inode) {
+    if (!is_inode_inline(inode)) {
+        fs_free_extents(fs, inode->extents, inode->extent_count, inode->extent_depth);
+    }
+    inode->flags &= ~INODE_INLINE;
+    memset(inode->extents, 0, sizeof(inode->extents));
+    inode->extent_count = 0;
+    inode->extent_depth = 0;
+}
+
+/*
+ * Moves count blocks between the image and memory with one preadv/pwritev per
+ * run of physically contiguous blocks, all runs are submitted together when async
+ * I/O is on. mem[i] is the memory of the i-th block, blocks with phys[i] == 0
+ * are skipped. Bypasses the buffer cache.
+ */
+void fs_transfer_runs(filesystem_t * fs, const uint32_t * phys, char ** mem, uint32_t count, int write) {
+    // Each run of physically contiguous blocks becomes one vectored request,
+    // blocks that are also adjacent in memory share an iovec
+    const uint32_t bs = fs_block_size(fs);
+    struct iovec * iov = malloc(count * sizeof(struct iovec));
+    aio_request_t * reqs = malloc(count * sizeof(aio_request_t));
+    uint32_t nreqs = 0, niov = 0;
+    for (uint32_t first = 0; first < count; ++first) {
+        if (phys[first] == 0) {
+            continue;
+        }
+        uint32_t len = 0, iovcnt = 0;
+        while (first + len < count && phys[first + len] == phys[first] + len
+                && (uint64_t) (len + 1) * bs <= MAX_RUN_BYTES) {
+            struct iovec * last = iovcnt > 0 ? iov + niov + iovcnt - 1 : NULL;
+            if (last != NULL && (char *) last->iov_base + last->iov_len == mem[first + len]) {
+                last->iov_len += bs;
+            } else if (iovcnt < MAX_RUN_IOVECS) {
+                iov[niov + iovcnt++] = (struct iovec) {mem[first + len], bs};
+            } else {
+                break;
+            }
+            ++len;
+        }
+        reqs[nreqs++] = (aio_request_t) {
+                .write = write,
+                .iov = iov + niov,
+                .iovcnt = iovcnt,
+                .offset = disk_offset_block(fs, phys[first])
+        };
+        niov += iovcnt;
+        first += len - 1;
+    }
+
+    // Fragmented transfers keep all runs in flight at once
+    uint64_t start = stats_clock(&fs->stats);
+    if (fs->aio != NULL && nreqs > 1) {
+        aio_run(fs->aio, reqs, nreqs);
+    } else {
+        for (uint32_t i = 0; i < nreqs; ++i) {
+            reqs[i].result = aio_do_sync(fs->fd, reqs + i);
+        }
+    }
+    for (uint32_t i = 0; i < nreqs; ++i) {
+        if (reqs[i].result < 0) {
+            errno = -reqs[i].result;
+            check_error("fs_transfer_blocks");
+        } else {
+            stats_io(&fs->stats, write, reqs[i].offset, reqs[i].result, start);
+        }
+    }
+    free(reqs);
+    free(iov);
+}
+
+/*
+ * fs_transfer_runs through the buffer cache: cached blocks are copied, the rest
+ * is read and cached, written blocks refresh their cached copies. meta is set for
+ * directory contents, whose latest version may still be in the open journal
+ * transaction.
+ */
+void fs_transfer_blocks(filesystem_t * fs, const uint32_t * phys, char ** mem, uint32_t count, int write, int meta) {
+    if (fs->mapping) {
+        for (uint32_t i = 0; i < count; ++i) {
+            if (phys[i] == 0) {
+                continue;
+            }
+            if (write) {
+                memcpy(fs_block_ptr(fs, phys[i]), mem[i], fs_block_size(fs));
+            } else {
+                memcpy(mem[i], fs_block_ptr(fs, phys[i]), fs_block_size(fs));
+            }
+        }
+        return;
+    }
+
+    if (meta && !write && fs->journal_active) {
+        // Blocks written by the open transaction are newer than the image, read one by one
+        for (uint32_t i = 0; i < count; ++i) {
+            if (phys[i] != 0) {
+                read_block(fs, phys[i], mem[i]);
+            }
+        }
+        return;
+    }
+
+    if (fs->bcache == NULL) {
+        fs_transfer_runs(fs, phys, mem, count, write);
+        return;
+    }
+
+    uint32_t * todo = malloc(count * sizeof(uint32_t));
+    fs_mutex_lock(fs, &fs->cache_lock);
+    for (uint32_t i = 0; i < count; ++i) {
+        todo[i] = phys[i];
+        if (!write && phys[i] != 0 && bcache_lookup(fs->bcache, phys[i], mem[i])) {
+            todo[i] = 0;
+        }
+    }
+    fs_mutex_unlock(fs, &fs->cache_lock);
+
+    fs_transfer_runs(fs, todo, mem, count, write);
+
+    fs_mutex_lock(fs, &fs->cache_lock);
+    for (uint32_t i = 0; i < count; ++i) {
+        if (todo[i] == 0) {
+            continue;
+        }
+        if (write) {
+            bcache_update(fs->bcache, todo[i], mem[i]);
+        } else {
+            bcache_insert(fs->bcache, todo[i], mem[i], 0);
+        }
+    }
+    fs_mutex_unlock(fs, &fs->cache_lock);
+    free(todo);
+}
+
+// After a sequential read, pulls the next blocks of the file into the buffer cache
+void fs_readahead(filesystem_t * fs, uint32_t inode_idx, inode_t * inode, bmap_cursor_t * cur,
+                  uint32_t first, uint32_t count) {
+    bcache_t * cache = fs->bcache;
+    fs_mutex_lock(fs, &fs->cache_lock);
+    // Small reads may continue inside the last block of the previous one
+    int sequential = cache->ra_inode == inode_idx && first <= cache->ra_next && first + 1 >= cache->ra_next;
+    cache->ra_inode = inode_idx;
+    cache->ra_next = first + count;
+    fs_mutex_unlock(fs, &fs->cache_lock);
+
+    const uint32_t bs = fs_block_size(fs);
+    uint32_t from = first + count;
+    uint32_t file_blocks = ((uint64_t) inode->size + bs - 1) / bs;
+    if (!sequential || from >= file_blocks) {
+        return;
+    }
+    uint32_t window = count < READAHEAD_MIN_BLOCKS ? READAHEAD_MIN_BLOCKS : count;
+    if (window > READAHEAD_MAX_BLOCKS) {
+        window = READAHEAD_MAX_BLOCKS;
+    }
+    if (window > cache->nframes / 4) {
+        window = cache->nframes / 4;
+    }
+    if (from + window > file_blocks) {
+        window = file_blocks - from;
+    }
+
+    uint32_t phys[READAHEAD_MAX_BLOCKS];
+    char * mem[READAHEAD_MAX_BLOCKS];
+    char * buf = malloc((size_t) window * bs);
+    for (uint32_t i = 0; i < window; ++i) {
+        phys[i] = fs_bmap(fs, cur, inode, from + i);
+        mem[i] = buf + (size_t) i * bs;
+    }
+    uint32_t fetched = 0;
+    fs_mutex_lock(fs, &fs->cache_lock);
+    for (uint32_t i = 0; i < window; ++i) {
+        if (phys[i] != 0 && bcache_contains(cache, phys[i])) {
+            phys[i] = 0;
+        }
+        fetched += phys[i] != 0;
+    }
+    fs_mutex_unlock(fs, &fs->cache_lock);
+
+    if (fetched != 0) {
+        fs_transfer_runs(fs, phys, mem, window, 0);
+        fs_mutex_lock(fs, &fs->cache_lock);
+        for (uint32_t i = 0; i < window; ++i) {
+            if (phys[i] != 0) {
+                bcache_insert(cache, phys[i], mem[i], 0);
+            }
+        }
+        cache->readahead += fetched;
+        fs_mutex_unlock(fs, &fs->cache_lock);
+    }
+    free(buf);
+}
+
+/*
+ * Compressed files keep their data in clusters of COMPRESS_CLUSTER_BLOCKS logical
+ * blocks, each rewritten as a whole. A cluster that lz_compress shrinks by at
+ * least a block is stored as a cluster_header_t and the compressed bytes, mapped
+ * to the last blocks of its logical range. Any other cluster is stored as is from
+ * its first block on, so the first block tells the two apart. Unmapped blocks of
+ * a stored cluster and clusters without blocks read as zeros.
+ */
+typedef struct ClusterHeader {
+    uint32_t stored;  // compressed bytes after the header
+    uint32_t raw;     // bytes they decompress to, the rest of the cluster is zeros
+} cluster_header_t;
+
+// Reads cluster c into data (a cluster of bytes), phys gets its blocks. Returns -1 if it is corrupt
+int cluster_load(filesystem_t * fs, bmap_cursor_t * cur, inode_t * inode, uint32_t c, uint8_t * data,
+                 uint32_t * phys) {
+    const uint32_t bs = fs_block_size(fs);
+    const uint32_t cluster_bytes = COMPRESS_CLUSTER_BLOCKS * bs;
+    char * mem[COMPRESS_CLUSTER_BLOCKS];
+    uint32_t first_mapped = COMPRESS_CLUSTER_BLOCKS;
+    for (uint32_t i = 0; i < COMPRESS_CLUSTER_BLOCKS; ++i) {
+        phys[i] = fs_bmap(fs, cur, inode, c * COMPRESS_CLUSTER_BLOCKS + i);
+        if (phys[i] != 0 && first_mapped == COMPRESS_CLUSTER_BLOCKS) {
+            first_mapped = i;
+        }
+    }
+    memset(data, 0, cluster_bytes);
+    if (first_mapped == COMPRESS_CLUSTER_BLOCKS) {
+        return 0;
+    }
+    if (first_mapped == 0) {
+        for (uint32_t i = 0; i < COMPRESS_CLUSTER_BLOCKS; ++i) {
+            mem[i] = (char *) data + i * bs;
+        }
+        fs_transfer_blocks(fs, phys, mem, COMPRESS_CLUSTER_BLOCKS, 0, 0);
+        return 0;
+    }
+
+    uint32_t stored_blocks = COMPRESS_CLUSTER_BLOCKS - first_mapped;
+    uint8_t * stored = malloc(stored_blocks * bs);
+    for (uint32_t i = 0; i < stored_blocks; ++i) {
+        mem[i] = (char *) stored + i * bs;
+    }
+    fs_transfer_blocks(fs, phys + first_mapped, mem, stored_blocks, 0, 0);
+    cluster_header_t header;
+    memcpy(&header, stored, sizeof(header));
+    int result = 0;
+    if (header.stored > stored_blocks * bs - sizeof(header) || header.raw > cluster_bytes
+            || lz_decompress(stored + sizeof(header), header.stored, data, header.raw) != header.raw) {
+        printf("fs_pread: corrupt compressed cluster %u\n", c);
+        memset(data, 0, cluster_bytes);
+        result = -1;
+    }
+    free(stored);
+    return result;
+}
+
+/*
+ * Undoes a failed cluster_store: the fresh blocks mapped so far come out of the
+ * cluster and are freed, then its old blocks phys go back in. Blocks that still
+ * cannot be unmapped or mapped stay allocated, fsck reports them.
+ */
+void cluster_restore(filesystem_t * fs, bmap_cursor_t * cur, inode_t * inode, uint32_t first_lblk,
+                     const uint32_t * phys, const uint32_t * fresh, uint32_t allocated) {
+    uint32_t mapped[COMPRESS_CLUSTER_BLOCKS];
+    for (uint32_t i = 0; i < COMPRESS_CLUSTER_BLOCKS; ++i) {
+        mapped[i] = fs_bmap(fs, cur, inode, first_lblk + i);
+    }
+    for (uint32_t i = 0; i < COMPRESS_CLUSTER_BLOCKS; ++i) {
+        uint32_t len = 0;
+        while (i + len < COMPRESS_CLUSTER_BLOCKS && mapped[i + len] != 0 && mapped[i + len] != phys[i + len]) {
+            ++len;
+        }
+        if (len > 0 && fs_unmap_blocks(fs, cur, inode, first_lblk + i, len) == 0) {
+            memset(mapped + i, 0, len * sizeof(uint32_t));
+        }
+        i += len;
+    }
+    // Freed first, they make room for the tree nodes the old extents may need
+    for (uint32_t k = 0; k < allocated; ++k) {
+        uint32_t i = 0;
+        while (i < COMPRESS_CLUSTER_BLOCKS && mapped[i] != fresh[k]) {
+            ++i;
+        }
+        if (i == COMPRESS_CLUSTER_BLOCKS) {
+            fs_dealloc_block(fs, fresh[k]);
+        }
+    }
+    for (uint32_t i = 0; i < COMPRESS_CLUSTER_BLOCKS; ++i) {
+        if (mapped[i] != 0 || phys[i] == 0) {
+            continue;
+        }
+        uint32_t len = 1;
+        while (i + len < COMPRESS_CLUSTER_BLOCKS && mapped[i + len] == 0 && phys[i + len] == phys[i] + len) {
+            ++len;
+        }
+        fs_map_extent(fs, cur, inode, (extent_t) {.lblk = first_lblk + i, .start = phys[i], .len = len});
+        i += len - 1;
+    }
+}
+
+/*
+ * Stores the first blocks of data as cluster c in place of its old blocks phys,
+ * compressed when that saves a block, as a hole when it is all zeros. The caller
+ * stores the inode.
+ * Returns -1 when out of space, the cluster is then restored (see cluster_restore).
+ */
+int cluster_store(filesystem_t * fs, bmap_cursor_t * cur, inode_t * inode, uint32_t c, const uint8_t * data,
+                  uint32_t blocks, const uint32_t * phys) {
+    const uint32_t bs = fs_block_size(fs);
+    const uint32_t first_lblk = c * COMPRESS_CLUSTER_BLOCKS;
+    uint8_t * stored = malloc(COMPRESS_CLUSTER_BLOCKS * bs);
+    cluster_header_t header = {.raw = blocks * bs};
+    while (header.raw > 0 && data[header.raw - 1] == 0) {
+        --header.raw;  // trailing zeros come back from the cluster size
+    }
+    if (blocks > 1) {
+        header.stored = lz_compress(data, header.raw, stored + sizeof(header),
+                                    (blocks - 1) * bs - sizeof(header));
+    }
+    uint32_t count = blocks;
+    uint32_t lblk = first_lblk;
+    const uint8_t * src = data;
+    if (header.raw == 0) {
+        count = 0;
+    } else if (header.stored != 0) {
+        memcpy(stored, &header, sizeof(header));
+        count = (sizeof(header) + header.stored + bs - 1) / bs;
+        lblk = first_lblk + COMPRESS_CLUSTER_BLOCKS - count;
+        src = stored;
+    }
+
+    uint32_t goal = 0;
+    for (uint32_t i = 0; i < COMPRESS_CLUSTER_BLOCKS && goal == 0; ++i) {
+        goal = phys[i];
+    }
+    if (goal == 0 && first_lblk > 0) {
+        uint32_t prev = fs_bmap(fs, cur, inode, first_lblk - 1);
+        goal = prev ? prev + 1 : 0;
+    }
+    uint32_t fresh[COMPRESS_CLUSTER_BLOCKS];
+    uint32_t allocated = count ? fs_alloc_blocks(fs, goal, count, fresh) : 0;
+    int result = allocated < count ? -1 : fs_unmap_blocks(fs, cur, inode, first_lblk, COMPRESS_CLUSTER_BLOCKS);
+    for (uint32_t i = 0; i < count && result == 0; ++i) {
+        uint32_t len = 1;
+        while (i + len < count && fresh[i + len] == fresh[i] + len) {
+            ++len;
+        }
+        result = fs_map_extent(fs, cur, inode, (extent_t) {.lblk = lblk + i, .start = fresh[i], .len = len});
+        i += len - 1;
+    }
+    if (result != 0) {
+        cluster_restore(fs, cur, inode, first_lblk, phys, fresh, allocated);
+        free(stored);
+        return -1;
+    }
+
+    char * mem[COMPRESS_CLUSTER_BLOCKS];
+    for (uint32_t i = 0; i < count; ++i) {
+        mem[i] = (char *) src + i * bs;
+    }
+    fs_transfer_blocks(fs, fresh, mem, count, 1, 0);
+    for (uint32_t i = 0; i < COMPRESS_CLUSTER_BLOCKS; ++i) {
+        if (phys[i] != 0) {
+            fs_dealloc_block(fs, phys[i]);
+        }
+    }
+    free(stored);
+    return 0;
+}
+
+uint32_t file_read_compressed(filesystem_t * fs, inode_t * inode, uint64_t offset, void * buf, uint32_t len) {
+    const uint32_t cluster_bytes = COMPRESS_CLUSTER_BLOCKS * fs_block_size(fs);
+    uint8_t * data = malloc(cluster_bytes);
+    uint32_t phys[COMPRESS_CLUSTER_BLOCKS];
+    bmap_cursor_t cur;
+    bmap_cursor_reset(&cur);
+    uint32_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done;
+        uint32_t in_cluster = pos % cluster_bytes;
+        uint32_t part = cluster_bytes - in_cluster < len - done ? cluster_bytes - in_cluster : len - done;
+        if (cluster_load(fs, &cur, inode, pos / cluster_bytes, data, phys) != 0) {
+            break;
+        }
+        memcpy((char *) buf + done, data + in_cluster, part);
+        done += part;
+    }
+    free(data);
+    return done;
+}
+
+/*
+ * file_write for INODE_COMPRESSED: every cluster touched is read, merged with
+ * buf and stored anew. Shared blocks need no special care, the old blocks of a
+ * cluster are always replaced.
+ */
+uint32_t file_write_compressed(filesystem_t * fs, uint32_t inode_idx, inode_t * inode, uint64_t offset,
+                               const void * buf, uint32_t len) {
+    const uint32_t bs = fs_block_size(fs);
+    const uint32_t cluster_bytes = COMPRESS_CLUSTER_BLOCKS * bs;
+    uint64_t end = offset + len > inode->size ? offset + len : inode->size;
+    uint8_t * data = malloc(cluster_bytes);
+    uint32_t phys[COMPRESS_CLUSTER_BLOCKS];
+    bmap_cursor_t cur;
+    bmap_cursor_reset(&cur);
+    uint32_t done = 0;
+    while (done < len) {
+        uint64_t pos = offset + done;
+        uint32_t c = pos / cluster_bytes;
+        uint32_t in_cluster = pos % cluster_bytes;
+        uint32_t part = cluster_bytes - in_cluster < len - done ? cluster_bytes - in_cluster : len - done;
+        cluster_load(fs, &cur, inode, c, data, phys);
+        memcpy(data + in_cluster, (const char *) buf + done, part);
+        uint64_t cluster_end = end - (uint64_t) c * cluster_bytes;
+        uint32_t blocks = cluster_end < cluster_bytes ? (cluster_end + bs - 1) / bs : COMPRESS_CLUSTER_BLOCKS;
+        if (cluster_store(fs, &cur, inode, c, data, blocks, phys) != 0) {
+            break;
+        }
+        done += part;
+    }
+    free(data);
+
+    if (offset + done > inode->size) {
+        inode->size = offset + done;
+    }
+    write_inode(fs, inode_idx, inode);
+    return done;
+}
+
+/*
+ * Reads up to len bytes at offset from a file, returns the number of bytes read.
+ * Whole blocks go straight into buf, only partial head and tail blocks are bounced.
+ */
+uint32_t file_read(filesystem_t * fs, uint32_t inode_idx, uint64_t offset, void * buf, uint32_t len) {
+    inode_t inode;
+    read_inode(fs, inode_idx, &inode);
+    if (offset >= inode.size) {
+        return 0;
+    }
+    if (offset + len > inode.size) {
+        len = inode.size - offset;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    if (is_inode_inline(&inode)) {
+        memcpy(buf, inode.inline_data + offset, len);
+        return len;
+    }
+    if (inode.flags & INODE_COMPRESSED) {
+        return file_read_compressed(fs, &inode, offset, buf, len);
+    }
+
+    const uint32_t bs = fs_block_size(fs);
+    uint32_t first = offset / bs;
+    uint32_t count = (offset + len - 1) / bs - first + 1;
+    uint32_t * phys = malloc(count * sizeof(uint32_t));
+    char ** mem = malloc(count * sizeof(char *));
+    char head[MAX_BLOCK_SIZE], tail[MAX_BLOCK_SIZE];
+
+    bmap_cursor_t cur;
+    bmap_cursor_reset(&cur);
+    for (uint32_t i = 0; i < count; ++i) {
+        phys[i] = fs_bmap(fs, &cur, &inode, first + i);
+        mem[i] = (char *) buf + (uint64_t) i * bs - offset % bs;
+    }
+    if (offset % bs != 0 || (count == 1 && len < bs)) {
+        mem[0] = head;
+    }
+    if (count > 1 && (offset + len) % bs != 0) {
+        mem[count - 1] = tail;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        if (phys[i] == 0) {
+            memset(mem[i], 0, bs);
+        }
+    }
+    fs_transfer_blocks(fs, phys, mem, count, 0, inode.type == DIRECTORY);
+    if (fs->bcache != NULL && inode.type == REGULAR) {
+        fs_readahead(fs, inode_idx, &inode, &cur, first, count);
+    }
+
+    if (mem[0] == head) {
+        uint32_t head_len = bs - offset % bs;
+        memcpy(buf, head + offset % bs, head_len < len ? head_len : len);
+    }
+    if (count > 1 && mem[count - 1] == tail) {
+        uint32_t tail_len = (offset + len) % bs;
+        memcpy((char *) buf + len - tail_len, tail, tail_len);
+    }
+
+    free(mem);
+    free(phys);
+    return len;
+}
+
+// Moves the inline data of a regular file to a block, *inode is updated but not stored
+int fs_inline_to_blocks(filesystem_t * fs, inode_t * inode) {
+    char block[MAX_BLOCK_SIZE] = {0};
+    memcpy(block, inode->inline_data, inode->size);
+    inode->flags &= ~INODE_INLINE;
+    memset(inode->extents, 0, sizeof(inode->extents));
+    if (inode->size == 0) {
+        return 0;
+    }
+
+    uint32_t block_idx = fs_alloc_block(fs);
+    if (block_idx == (uint32_t) -1) {
+        return -1;
+    }
+    bmap_cursor_t cur;
+    bmap_cursor_reset(&cur);
+    fs_map_extent(fs, &cur, inode, (extent_t) {.lblk = 0, .start = block_idx, .len = 1});
+    char * mem = block;
+    fs_transfer_blocks(fs, &block_idx, &mem, 1, 1, 0);
+    return 0;
+}
+
+/*
+ * Dedup: a block about to be written whose contents are already in a block with
+ * the same hash gets that block, with one more owner, instead of a new one. The
+ * candidate is compared byte for byte, a hash only narrows the search.
+ * Returns the block or 0.
+ */
+uint32_t fs_dedup_share(filesystem_t * fs, uint32_t hash, const char * data) {
+    fs_mutex_lock(fs, &fs->alloc_lock);
+    uint32_t idx = dedup_find(fs->dedup_index, hash);
+    int found = idx != 0 && fs->block_hashes[idx] == hash;
+    fs_mutex_unlock(fs, &fs->alloc_lock);
+    if (!found) {
+        return 0;
+    }
+    char block[MAX_BLOCK_SIZE];
+    char * mem = block;
+    fs_transfer_blocks(fs, &idx, &mem, 1, 0, 0);
+    if (memcmp(block, data, fs_block_size(fs)) != 0) {
+        return 0;
+    }
+
+    // Freed or claimed for an in-place write meanwhile if the hash is gone
+    fs_mutex_lock(fs, &fs->alloc_lock);
+    found = fs->block_hashes[idx] == hash && fs->block_refs[idx] < BLOCK_REFS_PINNED - 1;
+    if (found) {
+        ++fs->block_refs[idx];
+        mark_block_refs_dirty(fs, idx);
+    }
+    fs_mutex_unlock(fs, &fs->alloc_lock);
+    if (found) {
+        stats_add(&fs->stats, STAT_DEDUP_HITS, 1);
+    }
+    return found ? idx : 0;
+}
+
+// Records the hash of a data block just written
+void fs_dedup_add(filesystem_t * fs, uint32_t idx, uint32_t hash) {
+    fs_mutex_lock(fs, &fs->alloc_lock);
+    fs->block_hashes[idx] = hash;
+    mark_block_hash_dirty(fs, idx);
+    if (dedup_insert(fs->dedup_index, hash, idx)) {
+        fs_dedup_start(fs);  // drops the entries of blocks that lost their hash
+    }
+    fs_mutex_unlock(fs, &fs->alloc_lock);
+}
+
+/*
+ * Writes len bytes at offset into a file, growing it if needed (a gap
+ * after the old end becomes a hole). Missing blocks are allocated in one batch
+ * so that they come out contiguous when possible. Returns bytes written.
+ */
+uint32_t file_write(filesystem_t * fs, uint32_t inode_idx, uint64_t offset, const void * buf, uint32_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    const uint32_t bs = fs_block_size(fs);
+    // inode_t holds a 32-bit size
+    if (offset + len > UINT32_MAX) {
+        printf("fs_pwrite: file too large\n");
+        return 0;
+    }
+
+    inode_t inode;
+    read_inode(fs, inode_idx, &inode);
+    if (inode.type == REGULAR && offset + len <= INODE_INLINE_SIZE
+            && (is_inode_inline(&inode) || (inode.size == 0 && inode.extent_count == 0))) {
+        // Small files need neither a block nor a bitmap update
+        inode.flags |= INODE_INLINE;
+        memcpy(inode.inline_data + offset, buf, len);
+        if (offset + len > inode.size) {
+            inode.size = offset + len;
+        }
+        write_inode(fs, inode_idx, &inode);
+        return len;
+    }
+    if (is_inode_inline(&inode) && fs_inline_to_blocks(fs, &inode) != 0) {
+        return 0;
+    }
+    if (inode.flags & INODE_COMPRESSED) {
+        return file_write_compressed(fs, inode_idx, &inode, offset, buf, len);
+    }
+
+    uint32_t first = offset / bs;
+    uint32_t count = (offset + len - 1) / bs - first + 1;
+    uint32_t * phys = malloc(count * sizeof(uint32_t));
+    char ** mem = malloc(count * sizeof(char *));
+    char head[MAX_BLOCK_SIZE], tail[MAX_BLOCK_SIZE];
+    bmap_cursor_t cur;
+    bmap_cursor_reset(&cur);
+
+    uint32_t missing = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        phys[i] = fs_bmap(fs, &cur, &inode, first + i);
+        missing += phys[i] == 0;
+        mem[i] = (char *) buf + (uint64_t) i * bs - offset % bs;
+    }
+
+    // Partial head and tail blocks are merged with their old contents
+    uint32_t head_off = offset % bs;
+    uint32_t tail_len = (offset + len) % bs;
+    if (head_off != 0 || (count == 1 && len < bs)) {
+        memset(head, 0, bs);
+        if (phys[0] != 0) {
+            read_block(fs, phys[0], head);
+        }
+        memcpy(head + head_off, buf, len < bs - head_off ? len : bs - head_off);
+        mem[0] = head;
+    }
+    if (count > 1 && tail_len != 0) {
+        memset(tail, 0, bs);
+        if (phys[count - 1] != 0) {
+            read_block(fs, phys[count - 1], tail);
+        }
+        memcpy(tail, (const char *) buf + len - tail_len, tail_len);
+        mem[count - 1] = tail;
+    }
+
+    // Shared blocks are written to fresh blocks, old[i] is the shared one
+    uint32_t * old = NULL;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (phys[i] == 0 || fs_claim_block(fs, phys[i])) {
+            continue;
+        }
+        uint32_t run = 1;
+        while (i + run < count && phys[i + run] == phys[i] + run && !fs_claim_block(fs, phys[i + run])) {
+            ++run;
+        }
+        if (old == NULL) {
+            old = calloc(count, sizeof(uint32_t));
+        }
+        if (fs_unmap_blocks(fs, &cur, &inode, first + i, run) != 0) {
+            // Out of blocks for tree nodes, only what comes before is written
+            count = i;
+            len = i == 0 ? 0 : (uint32_t) ((uint64_t) (first + i) * bs - offset);
+            break;
+        }
+        for (uint32_t k = i; k < i + run; ++k) {
+            old[k] = phys[k];
+            phys[k] = 0;
+        }
+        missing += run;
+        i += run - 1;
+    }
+    uint32_t cow_count = count;
+
+    // hashes[i] != 0 - block i is new and gets its hash once written
+    uint32_t * hashes = NULL;
+    uint8_t * deduped = NULL;
+    if (fs->dedup_index != NULL && inode.type == REGULAR && missing > 0) {
+        hashes = calloc(count, sizeof(uint32_t));
+        deduped = calloc(count, 1);
+        for (uint32_t i = 0; i < count; ++i) {
+            if (phys[i] != 0) {
+                continue;
+            }
+            hashes[i] = dedup_hash(mem[i], bs);
+            uint32_t shared = fs_dedup_share(fs, hashes[i], mem[i]);
+            if (shared == 0) {
+                continue;
+            }
+            if (fs_map_extent(fs, &cur, &inode, (extent_t) {.lblk = first + i, .start = shared, .len = 1}) != 0) {
+                fs_dealloc_block(fs, shared);
+                continue;
+            }
+            phys[i] = shared;
+            deduped[i] = 1;
+            hashes[i] = 0;
+            --missing;
+        }
+    }
 
-#define STRINGIZE_DETAIL(x) #x
-#define STRINGIZE(x) STRINGIZE_DETAIL(x)
-#define ASSERTED && check_error(STRINGIZE(__LINE__))
+    if (missing > 0) {
+        // Blocks right after the one preceding the first missing block extend its extent
+        uint32_t goal = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (phys[i] == 0) {
+                uint32_t prev = i > 0 ? phys[i - 1] : first > 0 ? fs_bmap(fs, &cur, &inode, first - 1) : 0;
+                goal = prev ? prev + 1 : 0;
+                break;
+            }
+        }
 
+        uint32_t * fresh = malloc(missing * sizeof(uint32_t));
+        uint32_t allocated = fs_alloc_blocks(fs, goal, missing, fresh);
+        uint32_t next = 0;
+        for (uint32_t i = 0; i < count && next < allocated; ++i) {
+            if (phys[i] != 0) {
+                continue;
+            }
+            // Missing blocks that got consecutive physical blocks are mapped as one extent
+            uint32_t len = 1;
+            while (i + len < count && next + len < allocated && phys[i + len] == 0
+                    && fresh[next + len] == fresh[next] + len) {
+                ++len;
+            }
+            extent_t ext = {.lblk = first + i, .start = fresh[next], .len = len};
+            if (fs_map_extent(fs, &cur, &inode, ext) != 0) {
+                break;
+            }
+            for (uint32_t k = 0; k < len; ++k) {
+                phys[i + k] = fresh[next + k];
+            }
+            next += len;
+            i += len - 1;
+        }
+        // Out of blocks for tree nodes, give the rest back
+        for (; next < allocated; ++next) {
+            fs_dealloc_block(fs, fresh[next]);
+        }
+        free(fresh);
 
+        // Write only the prefix that got blocks
+        for (uint32_t i = 0; i < count; ++i) {
+            if (phys[i] == 0) {
+                count = i;
+                len = i == 0 ? 0 : (uint32_t) ((uint64_t) (first + i) * bs - offset);
+                break;
+            }
+        }
+    }
 
-#define INODES_COUNT 1024
-#define MAX_BLOCKS_PER_INODE 16
-#define FILE_NAME_LEN 64
-#define BLOCK_SIZE 512
+    for (uint32_t i = 0; old != NULL && i < cow_count; ++i) {
+        if (old[i] == 0) {
+            continue;
+        }
+        if (i < count) {
+            fs_dealloc_block(fs, old[i]);
+        } else if (phys[i] != 0) {
+            // Copied but past a failure, keeps the old contents
+            char block[MAX_BLOCK_SIZE];
+            read_block(fs, old[i], block);
+            char * block_mem = block;
+            fs_transfer_blocks(fs, phys + i, &block_mem, 1, 1, 0);
+            fs_dealloc_block(fs, old[i]);
+        } else {
+            fs_map_extent(fs, &cur, &inode, (extent_t) {.lblk = first + i, .start = old[i], .len = 1});
+        }
+    }
+    free(old);
 
-enum InodeType {
-    REGULAR, DIRECTORY
-};
+    if (fs->journal_active && inode.type == DIRECTORY) {
+        // Directory contents are metadata and go through the journal
+        for (uint32_t i = 0; i < count; ++i) {
+            write_block(fs, phys[i], mem[i], bs);
+        }
+    } else if (deduped != NULL) {
+        // Shared blocks hold the data already
+        uint32_t * targets = malloc(count * sizeof(uint32_t));
+        for (uint32_t i = 0; i < count; ++i) {
+            targets[i] = deduped[i] ? 0 : phys[i];
+        }
+        fs_transfer_blocks(fs, targets, mem, count, 1, 0);
+        for (uint32_t i = 0; i < count; ++i) {
+            if (hashes[i] != 0 && phys[i] != 0) {
+                fs_dedup_add(fs, phys[i], hashes[i]);
+            }
+        }
+        free(targets);
+    } else {
+        fs_transfer_blocks(fs, phys, mem, count, 1, 0);
+    }
+    free(hashes);
+    free(deduped);
 
-typedef struct Inode {
-    uint32_t size;
-    uint32_t hard_links;
-    enum InodeType type;
-    uint32_t blocks[MAX_BLOCKS_PER_INODE];
-}__attribute__ ((packed)) inode_t;
+    if (offset + len > inode.size) {
+        inode.size = offset + len;
+    }
+    write_inode(fs, inode_idx, &inode);
 
-typedef struct BlockBitmap {
-    uint8_t bitmap[MAX_BLOCKS_PER_INODE * INODES_COUNT / sizeof(uint8_t)];
-}__attribute__ ((packed)) block_bitmap_t;
+    free(mem);
+    free(phys);
+    return len;
+}
 
-typedef struct DirEntry {
-    uint32_t inode;
-    char name[FILE_NAME_LEN];
-}__attribute__ ((packed)) dir_entry_t;
+uint32_t fs_pread(filesystem_t * fs, uint32_t inode_idx, uint64_t offset, void * buf, uint32_t len) {
+    fs_op_begin(fs);
+    fs_lock_inode(fs, inode_idx, 0);
+    uint32_t done = file_read(fs, inode_idx, offset, buf, len);
+    fs_unlock_inode(fs, inode_idx);
+    fs_op_end(fs);
+    return done;
+}
 
-typedef struct filesystem {
-    FILE *disk_device;
-    block_bitmap_t block_bitmap;
-} filesystem_t;
+uint32_t fs_pwrite(filesystem_t * fs, uint32_t inode_idx, uint64_t offset, const void * buf, uint32_t len) {
+    fs_op_begin(fs);
+    fs_lock_inode(fs, inode_idx, 1);
+    uint32_t done = file_write(fs, inode_idx, offset, buf, len);
+    fs_unlock_inode(fs, inode_idx);
+    fs_op_end(fs);
+    return done;
+}
 
+// Consistent copy of an inode while other threads may be changing it
+void fs_stat(filesystem_t * fs, uint32_t inode_idx, inode_t * inode) {
+    fs_op_begin(fs);
+    fs_lock_inode(fs, inode_idx, 0);
+    read_inode(fs, inode_idx, inode);
+    fs_unlock_inode(fs, inode_idx);
+    fs_op_end(fs);
+}
 
-int is_inode_empty(inode_t * inode) {
-    return inode->hard_links == 0;
+/*
+ * Directories are hash tables stored in the directory file: block 0 is the header,
+ * blocks 1..buckets are the bucket heads, overflow blocks are chained from their
+ * bucket. The table is rebuilt with twice the buckets once it is DIR_MAX_LOAD_PERCENT
+ * full, so lookup, insert and unlink read O(1) blocks on average.
+ * Table blocks are DIR_BLOCK_SIZE bytes whatever the filesystem block size is,
+ * a larger filesystem block holds several of them.
+ */
+#define DIR_MAGIC 0x48534944
+#define DIR_BLOCK_SIZE MIN_BLOCK_SIZE
+#define DIR_BUCKET_ENTRIES ((DIR_BLOCK_SIZE - 2 * sizeof(uint32_t)) / sizeof(dir_entry_t))
+#define DIR_MAX_LOAD_PERCENT 75
+
+typedef struct DirHeader {
+    uint32_t magic;
+    uint32_t buckets;     // power of two
+    uint32_t entries;     // including "." and ".."
+    uint32_t blocks;      // logical blocks in use, header included
+    uint32_t free_block;  // first released overflow block, chained through next
+}__attribute__ ((packed)) dir_header_t;
+
+typedef struct DirBucket {
+    uint32_t next;  // logical block of the next overflow block, 0 = end of chain
+    uint32_t count;
+    dir_entry_t entries[DIR_BUCKET_ENTRIES];
+    char padding[DIR_BLOCK_SIZE - 2 * sizeof(uint32_t) - DIR_BUCKET_ENTRIES * sizeof(dir_entry_t)];
+}__attribute__ ((packed)) dir_bucket_t;
+
+uint32_t dir_hash(const char * name) {
+    uint32_t hash = 2166136261u;  // FNV-1a
+    for (; *name; ++name) {
+        hash = (hash ^ (uint8_t) *name) * 16777619u;
+    }
+    return hash;
 }
 
-uint32_t disk_offset_inode(uint32_t inode_idx) {
-    return (inode_idx - 1) * sizeof(inode_t);
+void dir_read_block(filesystem_t * fs, uint32_t dir_inode_idx, uint32_t lblk, dir_bucket_t * bucket) {
+    file_read(fs, dir_inode_idx, (uint64_t) lblk * DIR_BLOCK_SIZE, bucket, DIR_BLOCK_SIZE);
 }
-uint32_t disk_offset_bitmap() {
-    return INODES_COUNT * sizeof(inode_t);
+void dir_write_block(filesystem_t * fs, uint32_t dir_inode_idx, uint32_t lblk, const dir_bucket_t * bucket) {
+    file_write(fs, dir_inode_idx, (uint64_t) lblk * DIR_BLOCK_SIZE, bucket, DIR_BLOCK_SIZE);
 }
-uint32_t disk_offset_block(uint32_t block_idx) {
-    return INODES_COUNT * sizeof(inode_t) + sizeof(block_bitmap_t) + block_idx * BLOCK_SIZE;
+
+uint32_t dir_inline_parent(const inode_t * dir_inode) {
+    uint32_t parent;
+    memcpy(&parent, dir_inode->inline_data, sizeof(parent));
+    return parent;
 }
 
-void read_inode(filesystem_t * fs, uint32_t idx, inode_t* inode) {
-    fseek(fs->disk_device, disk_offset_inode(idx), SEEK_SET) ASSERTED;
-    fread(inode, sizeof(inode_t), 1, fs->disk_device) ASSERTED;
+// Returns 1 if the directory is still inline (only "." and ".."), 0 if it has a table, -1 if it is not a directory
+int dir_is_inline(filesystem_t * fs, uint32_t dir_inode_idx) {
+    inode_t dir_inode;
+    read_inode(fs, dir_inode_idx, &dir_inode);
+    if (dir_inode.type != DIRECTORY) {
+        return -1;
+    }
+    return is_inode_inline(&dir_inode);
 }
-void write_inode(filesystem_t * fs, uint32_t idx, inode_t* inode) {
-    fseek(fs->disk_device, disk_offset_inode(idx), SEEK_SET) ASSERTED;
-    fwrite(inode, sizeof(inode_t), 1, fs->disk_device) ASSERTED;
+
+// Returns 0 and fills header if dir_inode_idx is a directory with a table
+int dir_read_header(filesystem_t * fs, uint32_t dir_inode_idx, dir_header_t * header) {
+    if (dir_is_inline(fs, dir_inode_idx) != 0) {
+        return -1;
+    }
+    file_read(fs, dir_inode_idx, 0, header, sizeof(dir_header_t));
+    return header->magic == DIR_MAGIC ? 0 : -1;
 }
-void write_bitmap(filesystem_t * fs) {
-    fseek(fs->disk_device, disk_offset_bitmap(), SEEK_SET) ASSERTED;
-    fwrite(&fs->block_bitmap, sizeof(block_bitmap_t), 1, fs->disk_device) ASSERTED;
+void dir_write_header(filesystem_t * fs, uint32_t dir_inode_idx, const dir_header_t * header) {
+    file_write(fs, dir_inode_idx, 0, header, sizeof(dir_header_t));
 }
-void read_block(filesystem_t * fs, uint32_t idx, void* block) {
-    fseek(fs->disk_device, disk_offset_block(idx), SEEK_SET) ASSERTED;
-    fread(block, BLOCK_SIZE, 1, fs->disk_device) ASSERTED;
+
+// Number of entries in a directory including "." and "..", 0 if it is not a directory
+uint32_t fs_dir_entries(filesystem_t * fs, uint32_t dir_inode_idx) {
+    if (dir_is_inline(fs, dir_inode_idx) == 1) {
+        return 2;
+    }
+    dir_header_t header;
+    return dir_read_header(fs, dir_inode_idx, &header) == 0 ? header.entries : 0;
 }
-void write_block(filesystem_t * fs, uint32_t idx, const void* block, uint32_t size) {
-    assert(size <= BLOCK_SIZE);
-    fseek(fs->disk_device, disk_offset_block(idx), SEEK_SET) ASSERTED;
-    fwrite(block, size, 1, fs->disk_device) ASSERTED;
+
+// Smallest table that holds count entries below the load limit
+uint32_t dir_buckets_for(uint32_t count) {
+    uint32_t buckets = 1;
+    while (count * 100 > buckets * DIR_BUCKET_ENTRIES * DIR_MAX_LOAD_PERCENT) {
+        buckets *= 2;
+    }
+    return buckets;
 }
 
-uint32_t fs_find_empty_inode(filesystem_t * fs) {
-    for (uint32_t i = 1; i < INODES_COUNT; ++i) {
-        inode_t inode;
-        read_inode(fs, i, &inode);
-        if (is_inode_empty(&inode)) {
-            printf("Allocated inode %d\n", i);
-            return i;
+/*
+ * Lays out the whole table for the given entries in memory, *blocks is set to
+ * its length in DIR_BLOCK_SIZE blocks. The caller frees the table.
+ */
+dir_bucket_t * dir_table(const dir_entry_t * entries, uint32_t count, uint32_t buckets, uint32_t * blocks_out) {
+    uint32_t * chain_len = calloc(buckets, sizeof(uint32_t));
+    for (uint32_t i = 0; i < count; ++i) {
+        ++chain_len[dir_hash(entries[i].name) & (buckets - 1)];
+    }
+    uint32_t blocks = 1 + buckets;
+    for (uint32_t b = 0; b < buckets; ++b) {
+        if (chain_len[b] > DIR_BUCKET_ENTRIES) {
+            blocks += (chain_len[b] - 1) / DIR_BUCKET_ENTRIES;
         }
     }
 
-    printf("FATAL: no more inodes\n");
-    return -1;
-}
+    dir_bucket_t * table = calloc(blocks, sizeof(dir_bucket_t));
+    dir_header_t * header = (dir_header_t *) table;
+    *header = (dir_header_t) {
+            .magic = DIR_MAGIC,
+            .buckets = buckets,
+            .entries = count,
+            .blocks = blocks
+    };
 
-uint32_t fs_alloc_block(filesystem_t * fs) {
-    block_bitmap_t * bb = &fs->block_bitmap;
-    for (uint32_t i = 0; i < sizeof(bb->bitmap) / sizeof(uint8_t); ++i) {
-        uint8_t value = bb->bitmap[i];
-        if (value != 0xFF) {
-            for (uint32_t bit = 0; bit < 8; ++bit) {
-                if ((value & (1 << bit)) == 0) {
-                    bb->bitmap[i] |= (1 << bit);
-                    write_bitmap(fs);
-                    uint32_t block_idx = i * 8 + bit;
-
-                    printf("Allocated block %d\n", block_idx);
-                    return block_idx;
-                }
-            }
+    // tail[b] is the block currently being filled for bucket b
+    uint32_t * tail = chain_len;
+    for (uint32_t b = 0; b < buckets; ++b) {
+        tail[b] = 1 + b;
+    }
+    uint32_t next_overflow = 1 + buckets;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t b = dir_hash(entries[i].name) & (buckets - 1);
+        dir_bucket_t * bucket = table + tail[b];
+        if (bucket->count == DIR_BUCKET_ENTRIES) {
+            bucket->next = next_overflow;
+            tail[b] = next_overflow++;
+            bucket = table + tail[b];
         }
+        bucket->entries[bucket->count++] = entries[i];
     }
+    free(chain_len);
+    *blocks_out = blocks;
+    return table;
+}
 
-    printf("FATAL: no more blocks\n");
-    return -1;
+/*
+ * Writes the whole table for the given entries from scratch as one sequential write.
+ * Used to create directories and to grow the table.
+ */
+void dir_build(filesystem_t * fs, uint32_t dir_inode_idx, const dir_entry_t * entries, uint32_t count,
+               uint32_t buckets) {
+    uint32_t blocks;
+    dir_bucket_t * table = dir_table(entries, count, buckets, &blocks);
+    file_write(fs, dir_inode_idx, 0, table, blocks * DIR_BLOCK_SIZE);
+    inode_t dir_inode;
+    read_inode(fs, dir_inode_idx, &dir_inode);
+    dir_inode.size = blocks * DIR_BLOCK_SIZE;  // blocks of an old, longer table stay owned by the inode
+    write_inode(fs, dir_inode_idx, &dir_inode);
+    free(table);
 }
 
-void fs_dealloc_block(filesystem_t * fs, uint32_t idx) {
-    block_bitmap_t * bb = &fs->block_bitmap;
-    bb->bitmap[idx / 8] &= ~(1 << (idx % 8));
-    write_bitmap(fs);
-    printf("Deallocated block %d\n", idx);
+/*
+ * Cursor over the entries of a directory, lives on the caller's stack.
+ * Entries are returned straight from the mapped block in mmap mode or from the
+ * single block copy held by the cursor, so iterating does not allocate.
+ * The directory must not be modified while it is iterated; in concurrent mode
+ * fs_dir_open read-locks it until fs_dir_close.
+ */
+typedef struct DirIter {
+    filesystem_t * fs;
+    uint32_t dir_inode_idx;
+    inode_t dir_inode;
+    dir_header_t header;
+    uint32_t bucket;  // current bucket
+    uint32_t lblk;    // current block of the bucket chain, 0 - go to the next bucket
+    uint32_t slot;
+    const dir_bucket_t * block;
+    uint32_t copy_phys;  // filesystem block held in block_copy, 0 - none; -1 - an inline directory
+    uint8_t block_copy[MAX_BLOCK_SIZE];
+    bmap_cursor_t bmap;
+    int locked;
+} dir_iter_t;
+
+int dir_iter_open(filesystem_t * fs, uint32_t dir_inode_idx, dir_iter_t * it) {
+    it->fs = fs;
+    it->dir_inode_idx = dir_inode_idx;
+    it->locked = 0;
+    it->bucket = 0;
+    it->lblk = 1;
+    it->slot = 0;
+    it->block = NULL;
+    it->copy_phys = 0;
+    bmap_cursor_reset(&it->bmap);
+    read_inode(fs, dir_inode_idx, &it->dir_inode);
+    if (it->dir_inode.type == DIRECTORY && is_inode_inline(&it->dir_inode)) {
+        // A table of one bucket holding "." and ".."
+        dir_entry_t dots[2] = {{.inode = dir_inode_idx, .name = "."},
+                               {.inode = dir_inline_parent(&it->dir_inode), .name = ".."}};
+        dir_bucket_t * bucket = (dir_bucket_t *) it->block_copy;
+        memset(bucket, 0, sizeof(dir_bucket_t));
+        bucket->count = 2;
+        memcpy(bucket->entries, dots, sizeof(dots));
+        it->header = (dir_header_t) {.magic = DIR_MAGIC, .buckets = 1, .entries = 2, .blocks = 2};
+        it->copy_phys = -1;
+        return 0;
+    }
+    return dir_read_header(fs, dir_inode_idx, &it->header);
 }
 
-void fs_init_dir_block(filesystem_t * fs, uint32_t inode_idx, uint32_t parent_inode) {
-    // Note: function does NOT link child-dir to its parent
+// Returns 0 if dir_inode_idx is a directory and the cursor is ready
+int fs_dir_open(filesystem_t * fs, uint32_t dir_inode_idx, dir_iter_t * it) {
+    fs_op_begin(fs);
+    fs_lock_inode(fs, dir_inode_idx, 0);
+    if (dir_iter_open(fs, dir_inode_idx, it) != 0) {
+        fs_unlock_inode(fs, dir_inode_idx);
+        fs_op_end(fs);
+        return -1;
+    }
+    it->locked = 1;
+    return 0;
+}
 
-    dir_entry_t entries[2] = {
-            {
-                    .inode = inode_idx,
-                    .name = "."
-            },
-            {
-                    .inode = parent_inode,
-                    .name = ".."
-            }
-    };
+const dir_bucket_t * dir_iter_load(dir_iter_t * it) {
+    if (it->copy_phys == (uint32_t) -1) {
+        return (const dir_bucket_t *) it->block_copy;
+    }
+    uint64_t offset = (uint64_t) it->lblk * DIR_BLOCK_SIZE;
+    uint32_t bs = fs_block_size(it->fs);
+    uint32_t phys = fs_bmap(it->fs, &it->bmap, &it->dir_inode, offset / bs);
+    const uint8_t * mapped = phys ? fs_block_ptr(it->fs, phys) : NULL;
+    if (mapped == NULL) {
+        // Neighbouring table blocks often share the filesystem block held already
+        if (phys == 0) {
+            memset(it->block_copy, 0, bs);
+        } else if (phys != it->copy_phys) {
+            read_block(it->fs, phys, it->block_copy);
+        }
+        it->copy_phys = phys;
+        mapped = it->block_copy;
+    }
+    return (const dir_bucket_t *) (mapped + offset % bs);
+}
 
-    uint32_t hard_links = (inode_idx == parent_inode) ? 2 : 1;
-    inode_t inode = {
-            .size = sizeof(entries),
-            .hard_links = hard_links,
-            .type = DIRECTORY,
-            .blocks = {fs_alloc_block(fs)}
-    };
-    write_inode(fs, inode_idx, &inode);
-    write_block(fs, inode.blocks[0], entries, sizeof(entries));
+// Returns the next entry or NULL at the end; the pointer is valid until the next call
+const dir_entry_t * fs_dir_next(dir_iter_t * it) {
+    while (it->bucket < it->header.buckets) {
+        if (it->block == NULL) {
+            it->block = dir_iter_load(it);
+            it->slot = 0;
+        }
+        if (it->slot < it->block->count) {
+            return it->block->entries + it->slot++;
+        }
+
+        if (it->block->next != 0) {
+            it->lblk = it->block->next;
+        } else {
+            it->lblk = 2 + it->bucket++;
+        }
+        it->block = NULL;
+    }
+    return NULL;
 }
 
-void fs_init(filesystem_t * fs, const char* path) {
-    fs->disk_device = fopen(path, "r+");
-    if (!fs->disk_device) {
-        check_error("fs_init: fopen");
-        return;
+/*
+ * ls-style variant: also returns the inode of the entry, pointing into the
+ * in-memory inode table, so no separate read_inode pass is needed.
+ * In concurrent mode the entry inode is not locked and may change under the caller.
+ */
+const dir_entry_t * fs_dir_next_with_inode(dir_iter_t * it, const inode_t ** inode) {
+    const dir_entry_t * entry = fs_dir_next(it);
+    if (entry != NULL) {
+        *inode = fs_inode_ptr(it->fs, entry->inode);
     }
+    return entry;
+}
 
-    fseek(fs->disk_device, disk_offset_bitmap(), SEEK_SET) ASSERTED;
-    fread(&fs->block_bitmap, sizeof(block_bitmap_t), 1, fs->disk_device) ASSERTED;
+void fs_dir_close(dir_iter_t * it) {
+    it->block = NULL;
+    it->bucket = it->header.buckets;
+    if (it->locked) {
+        it->locked = 0;
+        fs_unlock_inode(it->fs, it->dir_inode_idx);
+        fs_op_end(it->fs);
+    }
 }
 
-void fs_create(filesystem_t * fs, const char* path) {
-    fs->disk_device = fopen(path, "w+");
+/*
+ * Returns all entries of a directory in a malloc'ed array terminated by a zero
+ * entry, or NULL if dir_inode_idx is not a directory.
+ */
+dir_entry_t * dir_collect(filesystem_t * fs, uint32_t dir_inode_idx, uint32_t * count) {
+    dir_iter_t it;
+    if (dir_iter_open(fs, dir_inode_idx, &it) != 0) {
+        return NULL;
+    }
 
-    // Allocate inodes
-    char zero = '\0';
-    fseek(fs->disk_device, INODES_COUNT * sizeof(inode_t), SEEK_SET) ASSERTED;
-    fwrite(&zero, sizeof(zero), 1, fs->disk_device) ASSERTED;
+    dir_entry_t * result = calloc(sizeof(dir_entry_t), it.header.entries + 1);
+    uint32_t n = 0;
+    const dir_entry_t * entry;
+    while (n < it.header.entries && (entry = fs_dir_next(&it)) != NULL) {
+        result[n++] = *entry;
+    }
+    fs_dir_close(&it);
+    if (count) {
+        *count = n;
+    }
+    return result;
+}
 
-    // Create root
-    fs_init_dir_block(fs, 1, 1);
+// Prefer fs_dir_open/fs_dir_next, they do not allocate
+dir_entry_t * fs_listdir(filesystem_t * fs, uint32_t dir_inode_idx) {
+    fs_op_begin(fs);
+    fs_lock_inode(fs, dir_inode_idx, 0);
+    dir_entry_t * result = dir_collect(fs, dir_inode_idx, NULL);
+    fs_unlock_inode(fs, dir_inode_idx);
+    fs_op_end(fs);
+    return result;
 }
 
-void fs_close(filesystem_t * fs) {
-    fclose(fs->disk_device);
+void fs_listdir_free(dir_entry_t * result) {
+    free(result);
 }
 
-dir_entry_t * fs_listdir(filesystem_t * fs, uint32_t dir_inode_idx) {
+uint32_t dir_lookup(filesystem_t * fs, uint32_t dir_inode_idx, const char * name) {
+    uint32_t inode_idx;
+    fs_mutex_lock(fs, &fs->dcache_lock);
+    int cached = dcache_lookup(fs->dcache, dir_inode_idx, name, &inode_idx);
+    fs_mutex_unlock(fs, &fs->dcache_lock);
+    stats_add(&fs->stats, STAT_DIR_LOOKUPS, 1);
+    if (cached) {
+        stats_add(&fs->stats, STAT_DCACHE_HITS, 1);
+        return inode_idx;
+    }
+
     inode_t dir_inode;
     read_inode(fs, dir_inode_idx, &dir_inode);
-    if (dir_inode.type != DIRECTORY) {
-        return NULL;
+    if (dir_inode.type == DIRECTORY && is_inode_inline(&dir_inode)) {
+        if (strcmp(name, ".") == 0) {
+            return dir_inode_idx;
+        }
+        return strcmp(name, "..") == 0 ? dir_inline_parent(&dir_inode) : 0;
+    }
+    dir_header_t header;
+    if (dir_read_header(fs, dir_inode_idx, &header) != 0) {
+        return 0;
+    }
+
+    inode_idx = 0;
+    dir_bucket_t bucket;
+    uint32_t lblk = 1 + (dir_hash(name) & (header.buckets - 1));
+    for (; lblk != 0 && inode_idx == 0; lblk = bucket.next) {
+        dir_read_block(fs, dir_inode_idx, lblk, &bucket);
+        for (uint32_t i = 0; i < bucket.count; ++i) {
+            if (strcmp(bucket.entries[i].name, name) == 0) {
+                inode_idx = bucket.entries[i].inode;
+                break;
+            }
+        }
     }
+    fs_mutex_lock(fs, &fs->dcache_lock);
+    dcache_insert(fs->dcache, dir_inode_idx, name, inode_idx);
+    fs_mutex_unlock(fs, &fs->dcache_lock);
+    return inode_idx;
+}
 
-    uint32_t entries_cnt = dir_inode.size / sizeof(dir_entry_t);
-    dir_entry_t * result = calloc(sizeof(dir_entry_t), entries_cnt + 1);
+// Returns the inode linked as name in the directory or 0
+uint32_t fs_dir_lookup(filesystem_t * fs, uint32_t dir_inode_idx, const char * name) {
+    fs_op_begin(fs);
+    fs_lock_inode(fs, dir_inode_idx, 0);
+    uint32_t inode_idx = dir_lookup(fs, dir_inode_idx, name);
+    fs_unlock_inode(fs, dir_inode_idx);
+    fs_op_end(fs);
+    return inode_idx;
+}
 
-    char block_data[BLOCK_SIZE];
-    read_block(fs, dir_inode.blocks[0], block_data);
+// Adds an entry, returns -1 if the name is already taken
+int fs_dir_add(filesystem_t * fs, uint32_t dir_inode_idx, const char * name, uint32_t inode_idx) {
+    if (dir_is_inline(fs, dir_inode_idx) == 1) {
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            return -1;
+        }
+        // The first real entry gives the directory its table
+        inode_t dir_inode;
+        read_inode(fs, dir_inode_idx, &dir_inode);
+        dir_entry_t entries[2] = {{.inode = dir_inode_idx, .name = "."},
+                                  {.inode = dir_inline_parent(&dir_inode), .name = ".."}};
+        dir_inode.flags &= ~INODE_INLINE;
+        memset(dir_inode.extents, 0, sizeof(dir_inode.extents));
+        write_inode(fs, dir_inode_idx, &dir_inode);
+        dir_build(fs, dir_inode_idx, entries, 2, 1);
+    }
 
-    for (uint32_t read_size = 0, i = 0; read_size < dir_inode.size; read_size += sizeof(dir_entry_t), ++i) {
-        dir_entry_t * dirEntry = (dir_entry_t *) (block_data + read_size);
-        memcpy(result + i, dirEntry, sizeof(dir_entry_t));
+    dir_header_t header;
+    if (dir_read_header(fs, dir_inode_idx, &header) != 0) {
+        return -1;
     }
 
-    return result;
+    dir_bucket_t bucket, free_bucket;
+    uint32_t free_lblk = 0, last_lblk = 0;
+    uint32_t lblk = 1 + (dir_hash(name) & (header.buckets - 1));
+    for (; lblk != 0; lblk = bucket.next) {
+        dir_read_block(fs, dir_inode_idx, lblk, &bucket);
+        for (uint32_t i = 0; i < bucket.count; ++i) {
+            if (strcmp(bucket.entries[i].name, name) == 0) {
+                return -1;
+            }
+        }
+        if (free_lblk == 0 && bucket.count < DIR_BUCKET_ENTRIES) {
+            free_lblk = lblk;
+            free_bucket = bucket;
+        }
+        last_lblk = lblk;
+    }
+
+    if (free_lblk == 0) {
+        // Chain is full: take a released overflow block or append one, link it after the last
+        if (header.free_block != 0) {
+            free_lblk = header.free_block;
+            dir_read_block(fs, dir_inode_idx, free_lblk, &free_bucket);
+            header.free_block = free_bucket.next;
+        } else {
+            free_lblk = header.blocks++;
+        }
+        bucket.next = free_lblk;
+        dir_write_block(fs, dir_inode_idx, last_lblk, &bucket);
+        memset(&free_bucket, 0, sizeof(free_bucket));
+    }
+
+    dir_entry_t * entry = free_bucket.entries + free_bucket.count++;
+    memset(entry, 0, sizeof(dir_entry_t));
+    entry->inode = inode_idx;
+    strncpy(entry->name, name, FILE_NAME_LEN - 1);
+    dir_write_block(fs, dir_inode_idx, free_lblk, &free_bucket);
+    fs_mutex_lock(fs, &fs->dcache_lock);
+    dcache_insert(fs->dcache, dir_inode_idx, name, inode_idx);
+    fs_mutex_unlock(fs, &fs->dcache_lock);
+
+    ++header.entries;
+    dir_write_header(fs, dir_inode_idx, &header);
+
+    if (header.entries * 100 > header.buckets * DIR_BUCKET_ENTRIES * DIR_MAX_LOAD_PERCENT) {
+        uint32_t count;
+        dir_entry_t * entries = dir_collect(fs, dir_inode_idx, &count);
+        dir_build(fs, dir_inode_idx, entries, count, header.buckets * 2);
+        free(entries);
+    }
+    return 0;
 }
 
-void fs_listdir_free(dir_entry_t * result) {
-    free(result);
+/*
+ * Removes an entry and returns its inode, or 0 if there is no such name.
+ * The last entry of the chain fills the hole, an emptied overflow block is released.
+ */
+uint32_t fs_dir_remove(filesystem_t * fs, uint32_t dir_inode_idx, const char * name) {
+    dir_header_t header;
+    if (dir_read_header(fs, dir_inode_idx, &header) != 0) {
+        return 0;
+    }
+
+    dir_bucket_t hole, tail;
+    uint32_t hole_lblk = 0, hole_slot = 0, removed = 0;
+    uint32_t prev_lblk = 0;
+    uint32_t lblk = 1 + (dir_hash(name) & (header.buckets - 1));
+    while (1) {
+        dir_read_block(fs, dir_inode_idx, lblk, &tail);
+        for (uint32_t i = 0; removed == 0 && i < tail.count; ++i) {
+            if (strcmp(tail.entries[i].name, name) == 0) {
+                removed = tail.entries[i].inode;
+                hole_lblk = lblk;
+                hole_slot = i;
+                hole = tail;
+            }
+        }
+        if (tail.next == 0) {
+            break;
+        }
+        prev_lblk = lblk;
+        lblk = tail.next;
+    }
+    if (removed == 0) {
+        return 0;
+    }
+    fs_mutex_lock(fs, &fs->dcache_lock);
+    dcache_insert(fs->dcache, dir_inode_idx, name, 0);
+    fs_mutex_unlock(fs, &fs->dcache_lock);
+
+    // tail is the last block of the chain now
+    dir_bucket_t * hole_bucket = hole_lblk == lblk ? &tail : &hole;
+    hole_bucket->entries[hole_slot] = tail.entries[tail.count - 1];
+    memset(tail.entries + tail.count - 1, 0, sizeof(dir_entry_t));
+    --tail.count;
+    if (hole_bucket == &hole) {
+        dir_write_block(fs, dir_inode_idx, hole_lblk, &hole);
+    }
+
+    if (tail.count == 0 && prev_lblk != 0) {
+        dir_bucket_t prev;
+        dir_read_block(fs, dir_inode_idx, prev_lblk, &prev);
+        prev.next = 0;
+        dir_write_block(fs, dir_inode_idx, prev_lblk, &prev);
+        tail.next = header.free_block;
+        header.free_block = lblk;
+    }
+    dir_write_block(fs, dir_inode_idx, lblk, &tail);
+
+    --header.entries;
+    dir_write_header(fs, dir_inode_idx, &header);
+    return removed;
 }
 
-void fs_link(filesystem_t * fs, uint32_t linking_inode, const char* name, uint32_t dir_inode_idx) {
-    inode_t dir_inode;
-    read_inode(fs, dir_inode_idx, &dir_inode);
+void fs_init_dir_block(filesystem_t * fs, uint32_t inode_idx, uint32_t parent_inode) {
+    // Note: function does NOT link child-dir to its parent
 
-    dir_entry_t entry = { .inode = linking_inode };
-    strcpy(entry.name, name);
-    char block[BLOCK_SIZE];
-    read_block(fs, dir_inode.blocks[0], block);
-    memcpy(block + dir_inode.size, &entry, sizeof(entry));
-    write_block(fs, dir_inode.blocks[0], block, BLOCK_SIZE);
+    // "." and ".." only, the directory stays inline until fs_dir_add
+    uint32_t hard_links = (inode_idx == parent_inode) ? 2 : 1;
+    inode_t inode = {
+            .size = 0,
+            .hard_links = hard_links,
+            .type = DIRECTORY,
+            .flags = INODE_INLINE
+    };
+    memcpy(inode.inline_data, &parent_inode, sizeof(parent_inode));
+    write_inode(fs, inode_idx, &inode);
+}
 
-    dir_inode.size += sizeof(dir_entry_t);
-    write_inode(fs, dir_inode_idx, &dir_inode);
+int link_inode(filesystem_t * fs, uint32_t linking_inode, const char* name, uint32_t dir_inode_idx) {
+    if (strlen(name) >= FILE_NAME_LEN) {
+        printf("fs_link: name too long %s\n", name);
+        return -1;
+    }
+    if (fs_dir_add(fs, dir_inode_idx, name, linking_inode) != 0) {
+        printf("fs_link: cannot link %s into dir %d\n", name, dir_inode_idx);
+        return -1;
+    }
 
     inode_t file_inode;
     read_inode(fs, linking_inode, &file_inode);
     ++file_inode.hard_links;
     write_inode(fs, linking_inode, &file_inode);
+    fs_op_done(fs);
+    return 0;
 }
 
-uint32_t fs_create_regular_file(filesystem_t * fs, uint32_t size, const void* data) {
-    assert(size <= BLOCK_SIZE);
-    uint32_t block_idx = fs_alloc_block(fs);
-    write_block(fs, block_idx, data, size);
+int fs_link(filesystem_t * fs, uint32_t linking_inode, const char* name, uint32_t dir_inode_idx) {
+    fs_op_begin(fs);
+    fs_lock_inode_pair(fs, dir_inode_idx, linking_inode);
+    int res = link_inode(fs, linking_inode, name, dir_inode_idx);
+    fs_unlock_inode_pair(fs, dir_inode_idx, linking_inode);
+    fs_op_end(fs);
+    return res;
+}
 
+// Returns the new file inode or 0
+uint32_t fs_create_regular_file(filesystem_t * fs, uint32_t size, const void* data) {
+    fs_op_begin(fs);
     uint32_t inode_idx = fs_find_empty_inode(fs);
+    if (inode_idx == (uint32_t) -1) {
+        fs_op_end(fs);
+        return 0;
+    }
+    // Not reachable by other threads until it is linked, no inode lock needed
     inode_t inode = {
-            .size = size,
+            .size = 0,
             .hard_links = 0,
             .type = REGULAR,
-            .blocks = { block_idx }
+            .flags = fs->compress ? INODE_COMPRESSED : 0
     };
     write_inode(fs, inode_idx, &inode);
+    file_write(fs, inode_idx, 0, data, size);
+    fs_op_done(fs);
+    fs_op_end(fs);
 
     return inode_idx;
 }
 
+void fs_release_inode(filesystem_t * fs, uint32_t inode_idx);
+
+// Returns the new directory inode or 0
 uint32_t fs_create_directory(filesystem_t * fs, uint32_t parent_inode, const char* name) {
+    fs_op_begin(fs);
     uint32_t inode_idx = fs_find_empty_inode(fs);
+    if (inode_idx == (uint32_t) -1) {
+        fs_op_end(fs);
+        return 0;
+    }
+    fs_lock_inode_pair(fs, parent_inode, inode_idx);
     fs_init_dir_block(fs, inode_idx, parent_inode);
-    fs_link(fs, inode_idx, name, parent_inode);
-    return inode_idx;
+    uint32_t result = inode_idx;
+    if (link_inode(fs, inode_idx, name, parent_inode) != 0) {  // flushes bitmaps
+        fs_release_inode(fs, inode_idx);
+        fs_op_done(fs);
+        result = 0;
+    }
+    fs_unlock_inode_pair(fs, parent_inode, inode_idx);
+    fs_op_end(fs);
+    return result;
 }
 
 uint32_t fs_parse_path(filesystem_t * fs, const char* path) {
@@ -268,7 +3065,6 @@ uint32_t fs_parse_path(filesystem_t * fs, const char* path) {
     ++path;
 
     uint32_t inode_idx = 1;
-    inode_t inode;
 
     while (*path != 0) {
         char * next_slash = strchr(path, '/');  // next_slash may be end of str
@@ -279,24 +3075,14 @@ uint32_t fs_parse_path(filesystem_t * fs, const char* path) {
         }
         *next_slash = 0;
 
-        dir_entry_t * files = fs_listdir(fs, inode_idx);
-        if (files == NULL) {
+        inode_t inode;
+        fs_stat(fs, inode_idx, &inode);
+        if (inode.type != DIRECTORY) {
             printf("parse_path: incorrect path, inode %d\n", inode_idx);
             return 0;
         }
-        dir_entry_t * cur_file = files;
-
-        uint32_t next_inode = 0;
-        while (cur_file->inode != 0) {
-            if (strcmp(path, cur_file->name) == 0) {
-                next_inode = cur_file->inode;
-                break;
-            }
-            ++cur_file;
-        }
-
-        fs_listdir_free(files);
 
+        uint32_t next_inode = fs_dir_lookup(fs, inode_idx, path);
         if (next_inode == 0) {
             printf("parse_path: not found %s in inode %d\n", path, inode_idx);
             return 0;
@@ -312,19 +3098,30 @@ uint32_t fs_parse_path(filesystem_t * fs, const char* path) {
     return inode_idx;
 }
 
+// Reads the whole file, buffer must hold the file size
 uint32_t fs_read_regular_file(filesystem_t * fs, uint32_t inode_idx, void* buffer) {
+    inode_t inode;
+    fs_stat(fs, inode_idx, &inode);
+    return fs_pread(fs, inode_idx, 0, buffer, inode.size);
+}
+
+int fs_unlink(filesystem_t * fs, const char* name, uint32_t dir_inode_idx);
+
+// Frees the blocks and the number of an inode regardless of its link count
+void fs_release_inode(filesystem_t * fs, uint32_t inode_idx) {
     inode_t inode;
     read_inode(fs, inode_idx, &inode);
-    if (inode.size == 0) {
-        return 0;
+    if (inode.type == DIRECTORY) {
+        fs_mutex_lock(fs, &fs->dcache_lock);
+        dcache_invalidate_dir(fs->dcache, inode_idx);
+        fs_mutex_unlock(fs, &fs->dcache_lock);
     }
-
-    read_block(fs, inode.blocks[0], buffer);
-    return inode.size;
+    fs_free_file_blocks(fs, &inode);  // deallocate blocks
+    memset(&inode, 0, sizeof(inode_t));
+    write_inode(fs, inode_idx, &inode);  // deallocate inode
+    fs_free_inode(fs, inode_idx);
 }
 
-void fs_unlink(filesystem_t * fs, const char* name, uint32_t dir_inode_idx);
-
 void fs_decrement_links(filesystem_t * fs, uint32_t inode_idx) {
     inode_t inode;
     read_inode(fs, inode_idx, &inode);
@@ -336,49 +3133,53 @@ void fs_decrement_links(filesystem_t * fs, uint32_t inode_idx) {
     }
 
     if (inode.hard_links == 0 || (inode.hard_links == 1 && inode.type == DIRECTORY)) {
-        assert(inode.type != DIRECTORY || inode.size == 2 * sizeof(dir_entry_t));
+        assert(inode.type != DIRECTORY || fs_dir_entries(fs, inode_idx) == 2);
 
-        fs_dealloc_block(fs, inode.blocks[0]);  // deallocate block
-        memset(&inode, 0, sizeof(inode_t));
-        write_inode(fs, inode_idx, &inode);  // deallocate inode
+        fs_release_inode(fs, inode_idx);
+    } else {
+        write_inode(fs, inode_idx, &inode);
     }
 }
 
-void fs_unlink(filesystem_t * fs, const char* name, uint32_t dir_inode_idx) {
-    inode_t inode;
-    read_inode(fs, dir_inode_idx, &inode);
-    char block[BLOCK_SIZE];
-    read_block(fs, inode.blocks[0], block);
-    dir_entry_t * list = (dir_entry_t *) block;
-
-    uint32_t unlinked_inode = 0;
-    uint32_t i = 0;
-    for (; list->inode != 0; ++i, ++list) {
-        if (strcmp(list->name, name) == 0) {
-            unlinked_inode = list->inode;
-            break;
-        }
-    }
-
+int unlink_entry(filesystem_t * fs, const char* name, uint32_t dir_inode_idx, uint32_t unlinked_inode) {
     inode_t inode_of_child;
     read_inode(fs, unlinked_inode, &inode_of_child);
-    if (inode_of_child.type == DIRECTORY && inode_of_child.size > 2 * sizeof(dir_entry_t)) {
+    if (inode_of_child.type == DIRECTORY && fs_dir_entries(fs, unlinked_inode) > 2) {
         printf("fs_unlink: cannot unlink dir with files in it\n");
-        return;
+        return -1;
     }
 
     // Remove from dir
-    memmove(list, list + 1, inode.size - (i + 1) * sizeof(dir_entry_t));
-    memset(block + (inode.size - sizeof(dir_entry_t)), 0, sizeof(dir_entry_t));
-    inode.size -= sizeof(dir_entry_t);
+    fs_dir_remove(fs, dir_inode_idx, name);
 
-    if (unlinked_inode == 0) {
-        printf("fs_unlink: in dir %d not found %s\n", dir_inode_idx, name);
-        return;
-    }
+    fs_decrement_links(fs, unlinked_inode);
+    fs_op_done(fs);
+    return 0;
+}
 
-    write_block(fs, inode.blocks[0], block, BLOCK_SIZE);
-    write_inode(fs, dir_inode_idx, &inode);
+int fs_unlink(filesystem_t * fs, const char* name, uint32_t dir_inode_idx) {
+    fs_op_begin(fs);
+    int res = -1;
+    while (1) {
+        // The child is only known after the lookup, locks are then retaken in stripe order
+        fs_lock_inode(fs, dir_inode_idx, 0);
+        uint32_t unlinked_inode = dir_lookup(fs, dir_inode_idx, name);
+        fs_unlock_inode(fs, dir_inode_idx);
+        if (unlinked_inode == 0) {
+            printf("fs_unlink: in dir %d not found %s\n", dir_inode_idx, name);
+            break;
+        }
 
-    fs_decrement_links(fs, unlinked_inode);
+        fs_lock_inode_pair(fs, dir_inode_idx, unlinked_inode);
+        int same = dir_lookup(fs, dir_inode_idx, name) == unlinked_inode;
+        if (same) {
+            res = unlink_entry(fs, name, dir_inode_idx, unlinked_inode);
+        }
+        fs_unlock_inode_pair(fs, dir_inode_idx, unlinked_inode);
+        if (same) {
+            break;
+        }
+    }
+    fs_op_end(fs);
+    return res;
 }
@@ -0,0 +1,406 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdarg.h>
+
+#include "fs.h"
+
+/*
+ * Consistency checker. Worker threads share the inode table in two passes:
+ *   1. every directory is read and each entry adds a reference to its target;
+ *   2. every referenced inode has its blocks (and extent tree nodes) counted in
+ *      an owner table. Data blocks may be shared by clones, a tree node or a
+ *      block claimed by a node and something else is reported.
+ * Block usage and refcounts derived from the owners, inode usage and link counts
+ * are then compared with the image and, with repair, written back. So are dedup
+ * hashes, which only file data blocks may have. Unreferenced inodes are released
+ * (children of a released directory show up as orphans on the next run),
+ * entries pointing to free inodes are removed. Duplicate blocks and broken
+ * directory tables are only reported.
+ */
+
+#define FSCK_CHUNK 64          // inodes taken by a worker at a time
+#define FSCK_MAX_THREADS 64
+#define FSCK_REPORT_LIMIT 20   // problems printed per kind
+
+enum FsckProblem {
+    FSCK_BAD_DIR,        // directory table unreadable or inconsistent
+    FSCK_BAD_DOTS,       // "." or ".." wrong
+    FSCK_DANGLING,       // entry points to a free inode
+    FSCK_BAD_POINTER,    // block number outside the image
+    FSCK_DUP_BLOCK,      // block owned twice
+    FSCK_ORPHAN,         // allocated inode without references
+    FSCK_LINKS,          // hard_links differs from the references
+    FSCK_INODE_BITMAP,   // inode bitmap differs from inode usage
+    FSCK_BLOCK_LEAKED,   // marked used, owned by nobody
+    FSCK_BLOCK_MISSING,  // owned, marked free
+    FSCK_REFCOUNT,       // block refcount differs from the owners
+    FSCK_STALE_HASH,     // content hash on a block that holds no file data
+    FSCK_PROBLEM_KINDS
+};
+
+const char * fsck_problem_names[FSCK_PROBLEM_KINDS] = {
+        "bad directories", "bad ./.. entries", "dangling entries", "bad block pointers", "duplicate blocks",
+        "orphan inodes", "wrong link counts", "inode bitmap errors", "leaked blocks", "missing blocks",
+        "wrong block refcounts", "stale block hashes"
+};
+
+#define FSCK_NODE_OWNER 0x80000000u  // in owners: the block is an extent tree node
+
+typedef struct FsckDangling {
+    uint32_t dir;
+    char name[FILE_NAME_LEN];
+} fsck_dangling_t;
+
+typedef struct Fsck {
+    filesystem_t * fs;
+    uint32_t next_inode;  // work distribution, taken FSCK_CHUNK at a time
+    int pass;
+
+    uint32_t *refs;          // names referring to each inode
+    uint32_t *owners;        // per block: extents claiming it, FSCK_NODE_OWNER for a node
+    uint64_t problems[FSCK_PROBLEM_KINDS];
+
+    pthread_mutex_t lock;  // report output and the dangling list
+    fsck_dangling_t *dangling;
+    uint32_t dangling_count;
+    uint32_t dangling_cap;
+} fsck_t;
+
+void fsck_report(fsck_t * ck, enum FsckProblem kind, const char * fmt, ...) __attribute__ ((format (printf, 3, 4)));
+
+void fsck_report(fsck_t * ck, enum FsckProblem kind, const char * fmt, ...) {
+    uint64_t seen = __atomic_fetch_add(ck->problems + kind, 1, __ATOMIC_RELAXED);
+    if (seen >= FSCK_REPORT_LIMIT) {
+        return;
+    }
+    pthread_mutex_lock(&ck->lock);
+    va_list args;
+    va_start(args, fmt);
+    printf("fsck: ");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+    pthread_mutex_unlock(&ck->lock);
+}
+
+int fsck_inode_in_use(filesystem_t * fs, uint32_t idx) {
+    return is_inode_allocated(fs, idx) || !is_inode_empty(fs_inode_ptr(fs, idx));
+}
+
+void fsck_add_dangling(fsck_t * ck, uint32_t dir, const char * name) {
+    pthread_mutex_lock(&ck->lock);
+    if (ck->dangling_count == ck->dangling_cap) {
+        ck->dangling_cap = ck->dangling_cap ? ck->dangling_cap * 2 : 16;
+        ck->dangling = realloc(ck->dangling, ck->dangling_cap * sizeof(fsck_dangling_t));
+    }
+    fsck_dangling_t * d = ck->dangling + ck->dangling_count++;
+    d->dir = dir;
+    strncpy(d->name, name, FILE_NAME_LEN - 1);
+    d->name[FILE_NAME_LEN - 1] = 0;
+    pthread_mutex_unlock(&ck->lock);
+}
+
+// Pass 1: reads the whole table of a directory and counts references
+void fsck_check_dir(fsck_t * ck, uint32_t dir_idx) {
+    filesystem_t * fs = ck->fs;
+    if (is_inode_inline(fs_inode_ptr(fs, dir_idx))) {
+        uint32_t dotdot = dir_inline_parent(fs_inode_ptr(fs, dir_idx));
+        if (dotdot == 0 || dotdot >= fs->sb.inodes_count || fs_inode_ptr(fs, dotdot)->type != DIRECTORY
+                || (dir_idx == 1 && dotdot != 1)) {
+            fsck_report(ck, FSCK_BAD_DOTS, "directory %u: . -> %u, .. -> %u", dir_idx, dir_idx, dotdot);
+        }
+        return;
+    }
+    dir_header_t header;
+    if (dir_read_header(fs, dir_idx, &header) != 0) {
+        fsck_report(ck, FSCK_BAD_DIR, "directory %u: bad header", dir_idx);
+        return;
+    }
+    inode_t dir_inode = *fs_inode_ptr(fs, dir_idx);
+    if (header.buckets == 0 || (header.buckets & (header.buckets - 1)) != 0 || header.blocks < 1 + header.buckets
+            || (uint64_t) header.blocks * DIR_BLOCK_SIZE > dir_inode.size) {
+        fsck_report(ck, FSCK_BAD_DIR, "directory %u: bad geometry, %u buckets in %u blocks",
+                    dir_idx, header.buckets, header.blocks);
+        return;
+    }
+
+    // Overflow blocks on the free list have no entries, so every block can be scanned in order
+    dir_bucket_t * table = malloc((size_t) header.blocks * DIR_BLOCK_SIZE);
+    file_read(fs, dir_idx, 0, table, header.blocks * DIR_BLOCK_SIZE);
+    uint32_t entries = 0, dot = 0, dotdot = 0;
+    for (uint32_t lblk = 1; lblk < header.blocks; ++lblk) {
+        const dir_bucket_t * bucket = table + lblk;
+        if (bucket->count > DIR_BUCKET_ENTRIES || bucket->next >= header.blocks) {
+            fsck_report(ck, FSCK_BAD_DIR, "directory %u: block %u is corrupt", dir_idx, lblk);
+            continue;
+        }
+        for (uint32_t i = 0; i < bucket->count; ++i) {
+            const dir_entry_t * entry = bucket->entries + i;
+            ++entries;
+            if (memchr(entry->name, 0, FILE_NAME_LEN) == NULL) {
+                fsck_report(ck, FSCK_BAD_DIR, "directory %u: unterminated name", dir_idx);
+                continue;
+            }
+            if (strcmp(entry->name, ".") == 0) {
+                dot = entry->inode;
+                continue;
+            }
+            if (strcmp(entry->name, "..") == 0) {
+                dotdot = entry->inode;
+                continue;
+            }
+            if (entry->inode == 0 || entry->inode >= fs->sb.inodes_count || !fsck_inode_in_use(fs, entry->inode)) {
+                fsck_report(ck, FSCK_DANGLING, "directory %u: %s -> free inode %u", dir_idx, entry->name,
+                            entry->inode);
+                fsck_add_dangling(ck, dir_idx, entry->name);
+                continue;
+            }
+            __atomic_fetch_add(ck->refs + entry->inode, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(table);
+
+    if (entries != header.entries) {
+        fsck_report(ck, FSCK_BAD_DIR, "directory %u: header says %u entries, found %u", dir_idx,
+                    header.entries, entries);
+    }
+    if (dot != dir_idx || dotdot == 0 || dotdot >= fs->sb.inodes_count
+            || fs_inode_ptr(fs, dotdot)->type != DIRECTORY || (dir_idx == 1 && dotdot != 1)) {
+        fsck_report(ck, FSCK_BAD_DOTS, "directory %u: . -> %u, .. -> %u", dir_idx, dot, dotdot);
+    }
+}
+
+// Data blocks can have several owners, a node only one
+void fsck_mark_block(fsck_t * ck, uint32_t inode_idx, uint32_t block, int node) {
+    if (block >= disk_blocks_count(ck->fs)) {
+        fsck_report(ck, FSCK_BAD_POINTER, "inode %u: block %u is outside the image", inode_idx, block);
+        return;
+    }
+    uint32_t seen = __atomic_fetch_add(ck->owners + block, node ? FSCK_NODE_OWNER + 1 : 1, __ATOMIC_RELAXED);
+    if (node ? seen != 0 : (seen & FSCK_NODE_OWNER) != 0) {
+        fsck_report(ck, FSCK_DUP_BLOCK, "inode %u: block %u is owned twice", inode_idx, block);
+    }
+}
+
+void fsck_mark_extents(fsck_t * ck, uint32_t inode_idx, const extent_t * entries, uint32_t count, uint32_t depth) {
+    const uint32_t nblocks = disk_blocks_count(ck->fs);
+    for (uint32_t i = 0; i < count; ++i) {
+        const extent_t * ext = entries + i;
+        if (depth == 0) {
+            if (ext->start == 0 || ext->start >= nblocks || ext->len > nblocks - ext->start) {
+                fsck_report(ck, FSCK_BAD_POINTER, "inode %u: extent of %u blocks at %u is outside the image",
+                            inode_idx, ext->len, ext->start);
+                continue;
+            }
+            for (uint32_t block = ext->start; block < ext->start + ext->len; ++block) {
+                fsck_mark_block(ck, inode_idx, block, 0);
+            }
+            continue;
+        }
+
+        if (ext->start == 0 || ext->len > fs_node_extents(ck->fs)) {
+            fsck_report(ck, FSCK_BAD_POINTER, "inode %u: bad extent node %u of %u entries", inode_idx,
+                        ext->start, ext->len);
+            continue;
+        }
+        fsck_mark_block(ck, inode_idx, ext->start, 1);
+        if (ext->start >= nblocks) {
+            continue;
+        }
+        extent_t child[MAX_NODE_EXTENTS];
+        read_block(ck->fs, ext->start, child);
+        fsck_mark_extents(ck, inode_idx, child, ext->len, depth - 1);
+    }
+}
+
+// Pass 2: blocks of every inode that will stay
+void fsck_check_blocks(fsck_t * ck, uint32_t inode_idx) {
+    const inode_t * inode = fs_inode_ptr(ck->fs, inode_idx);
+    if (is_inode_inline(inode)) {
+        if (inode->extent_count != 0 || (inode->type == REGULAR && inode->size > INODE_INLINE_SIZE)) {
+            fsck_report(ck, FSCK_BAD_POINTER, "inode %u: inline inode with %u extents, size %u", inode_idx,
+                        inode->extent_count, inode->size);
+        }
+        return;
+    }
+    if (inode->extent_count > INODE_EXTENTS || inode->extent_depth > EXTENT_MAX_DEPTH) {
+        fsck_report(ck, FSCK_BAD_POINTER, "inode %u: bad extent root, %u entries, depth %u", inode_idx,
+                    inode->extent_count, inode->extent_depth);
+        return;
+    }
+    fsck_mark_extents(ck, inode_idx, inode->extents, inode->extent_count, inode->extent_depth);
+}
+
+int fsck_keeps_inode(fsck_t * ck, uint32_t idx) {
+    return fsck_inode_in_use(ck->fs, idx) && (idx == 1 || ck->refs[idx] > 0);
+}
+
+void * fsck_worker(void * arg) {
+    fsck_t * ck = arg;
+    const uint32_t inodes_count = ck->fs->sb.inodes_count;
+    uint32_t from;
+    while ((from = __atomic_fetch_add(&ck->next_inode, FSCK_CHUNK, __ATOMIC_RELAXED)) < inodes_count) {
+        uint32_t to = from + FSCK_CHUNK < inodes_count ? from + FSCK_CHUNK : inodes_count;
+        for (uint32_t idx = from ? from : 1; idx < to; ++idx) {
+            if (!fsck_inode_in_use(ck->fs, idx)) {
+                continue;
+            }
+            if (ck->pass == 1 && fs_inode_ptr(ck->fs, idx)->type == DIRECTORY) {
+                fsck_check_dir(ck, idx);
+            } else if (ck->pass == 2 && fsck_keeps_inode(ck, idx)) {
+                fsck_check_blocks(ck, idx);
+            }
+        }
+    }
+    return NULL;
+}
+
+void fsck_run_pass(fsck_t * ck, int pass, uint32_t threads) {
+    pthread_t tids[FSCK_MAX_THREADS];
+    ck->pass = pass;
+    ck->next_inode = 0;
+    for (uint32_t i = 0; i < threads; ++i) {
+        pthread_create(tids + i, NULL, fsck_worker, ck);
+    }
+    for (uint32_t i = 0; i < threads; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+}
+
+// Link count the inode should have: one per name, plus "." of a directory, plus the root's own ".."
+uint32_t fsck_expected_links(fsck_t * ck, uint32_t idx) {
+    const inode_t * inode = fs_inode_ptr(ck->fs, idx);
+    return ck->refs[idx] + (inode->type == DIRECTORY) + (idx == 1);
+}
+
+/*
+ * Checks the image, repairing it if asked. The filesystem must not be used by
+ * anybody else meanwhile; with threads > 1 it has to be opened in concurrent mode.
+ * Returns 0 if the image is clean, 1 if every problem was repaired, 4 otherwise
+ * (the e2fsck convention).
+ */
+int fs_fsck(filesystem_t * fs, int repair, uint32_t threads) {
+    if (threads < 1) {
+        threads = 1;
+    }
+    if (threads > FSCK_MAX_THREADS) {
+        threads = FSCK_MAX_THREADS;
+    }
+    assert(threads == 1 || fs->concurrent);
+
+    fsck_t ck;
+    memset(&ck, 0, sizeof(ck));
+    ck.fs = fs;
+    ck.refs = calloc(fs->sb.inodes_count, sizeof(uint32_t));
+    ck.owners = calloc(disk_blocks_count(fs), sizeof(uint32_t));
+    ck.owners[0] = FSCK_NODE_OWNER + 1;  // block 0 is reserved
+    pthread_mutex_init(&ck.lock, NULL);
+
+    if (!fsck_inode_in_use(fs, 1) || fs_inode_ptr(fs, 1)->type != DIRECTORY) {
+        fsck_report(&ck, FSCK_BAD_DIR, "root inode is not a directory");
+    }
+    fsck_run_pass(&ck, 1, threads);
+    fsck_run_pass(&ck, 2, threads);
+
+    // Inodes: usage, link counts
+    uint64_t unrepaired = ck.problems[FSCK_BAD_DIR] + ck.problems[FSCK_BAD_DOTS] +
+                          ck.problems[FSCK_BAD_POINTER] + ck.problems[FSCK_DUP_BLOCK];
+    for (uint32_t idx = 1; idx < fs->sb.inodes_count; ++idx) {
+        inode_t inode;
+        read_inode(fs, idx, &inode);
+        if (!fsck_inode_in_use(fs, idx)) {
+            continue;
+        }
+        // Blocks of an orphan were not marked in pass 2, the bitmap repair frees them
+        if (!fsck_keeps_inode(&ck, idx)) {
+            fsck_report(&ck, FSCK_ORPHAN, "inode %u: allocated but not referenced", idx);
+            if (repair) {
+                memset(&inode, 0, sizeof(inode));
+                write_inode(fs, idx, &inode);
+                fs->inode_bitmap[idx / 8] &= ~(1 << (idx % 8));
+                mark_inode_bitmap_dirty(fs);
+            }
+            continue;
+        }
+        if (inode.hard_links != fsck_expected_links(&ck, idx)) {
+            fsck_report(&ck, FSCK_LINKS, "inode %u: %u links, %u expected", idx, inode.hard_links,
+                        fsck_expected_links(&ck, idx));
+            if (repair) {
+                inode.hard_links = fsck_expected_links(&ck, idx);
+                write_inode(fs, idx, &inode);
+            }
+        }
+        if (!is_inode_allocated(fs, idx)) {
+            fsck_report(&ck, FSCK_INODE_BITMAP, "inode %u: in use but marked free", idx);
+            if (repair) {
+                fs->inode_bitmap[idx / 8] |= 1 << (idx % 8);
+                mark_inode_bitmap_dirty(fs);
+            }
+        }
+    }
+
+    // Blocks
+    uint8_t * bitmap = fs->block_bitmap;
+    for (uint32_t block = 0; block < disk_blocks_count(fs); ++block) {
+        // Shared data blocks have one ref per owner but the first, saturated counts stay pinned
+        uint32_t owners = ck.owners[block] & ~FSCK_NODE_OWNER;
+        uint32_t refs = owners > 1 && !(ck.owners[block] & FSCK_NODE_OWNER) ? owners - 1 : 0;
+        refs = refs < BLOCK_REFS_PINNED ? refs : BLOCK_REFS_PINNED;
+        uint16_t have = fs->block_refs[block];
+        if (have != refs && (have != BLOCK_REFS_PINNED || refs == 0)) {
+            fsck_report(&ck, FSCK_REFCOUNT, "block %u: refcount %u, %u expected", block, have, refs);
+            if (repair) {
+                fs->block_refs[block] = refs;
+                mark_block_refs_dirty(fs, block);
+            }
+        }
+
+        if (fs->block_hashes[block] != 0 && (owners == 0 || (ck.owners[block] & FSCK_NODE_OWNER))) {
+            fsck_report(&ck, FSCK_STALE_HASH, "block %u: content hash, but no file data", block);
+            if (repair) {
+                fs->block_hashes[block] = 0;
+                mark_block_hash_dirty(fs, block);
+            }
+        }
+
+        int used = (bitmap[block / 8] >> (block % 8)) & 1;
+        int owned = owners > 0;
+        if (used == owned) {
+            continue;
+        }
+        fsck_report(&ck, owned ? FSCK_BLOCK_MISSING : FSCK_BLOCK_LEAKED, "block %u: marked %s", block,
+                    used ? "used, owned by nobody" : "free, but owned");
+        if (repair) {
+            bitmap[block / 8] ^= 1 << (block % 8);
+            mark_bitmap_dirty(fs, block, 1);
+        }
+    }
+
+    if (repair) {
+        for (uint32_t i = 0; i < ck.dangling_count; ++i) {
+            fs_dir_remove(fs, ck.dangling[i].dir, ck.dangling[i].name);
+        }
+        fs_load_free_inodes(fs);
+        fs_op_done(fs);
+        fs_sync(fs);
+    }
+
+    uint64_t total = 0;
+    for (int kind = 0; kind < FSCK_PROBLEM_KINDS; ++kind) {
+        if (ck.problems[kind] != 0) {
+            printf("fsck: %s: %lu\n", fsck_problem_names[kind], ck.problems[kind]);
+        }
+        total += ck.problems[kind];
+    }
+    printf("fsck: %lu problems%s\n", total, total && repair ? ", repaired where possible" : "");
+
+    pthread_mutex_destroy(&ck.lock);
+    free(ck.dangling);
+    free(ck.owners);
+    free(ck.refs);
+    if (total == 0) {
+        return 0;
+    }
+    return repair && unrepaired == 0 ? 1 : 4;
+}
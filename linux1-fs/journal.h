@@ -0,0 +1,199 @@
+#pragma once
+
+#include <stdint-gcc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "stats.h"
+
+/*
+ * Redo journal for metadata.
+ *
+ * A transaction is a list of (image offset, bytes) records. It is written to the
+ * journal region as one sequential write followed by a single fsync, and only then
+ * applied to its home locations. The region holds two slots and transaction N goes
+ * to slot N % 2: N stays replayable while N + 1 is written, and the fsync of N + 1
+ * also makes the home writes of N durable, so a group commit costs one flush.
+ * On open the newest valid slot is replayed; replaying it twice is harmless.
+ */
+
+#define JOURNAL_MAGIC 0x4c4e524a
+
+typedef struct JournalTxHeader {
+    uint32_t magic;
+    uint32_t records;
+    uint64_t seq;
+    uint64_t length;    // bytes of records following the header
+    uint64_t checksum;  // of the records, detects torn writes
+}__attribute__ ((packed)) journal_tx_header_t;
+
+typedef struct JournalRecord {
+    uint64_t offset;
+    uint32_t length;
+}__attribute__ ((packed)) journal_record_t;
+
+typedef struct Journal {
+    int fd;
+    uint64_t slot_offset[2];
+    uint64_t slot_size;
+    uint64_t seq;  // last committed transaction
+
+    // Records of the transaction being collected, header space reserved at the front
+    uint8_t *buf;
+    uint64_t len;
+    uint64_t cap;
+    uint32_t records;
+
+    stats_t *stats;  // NULL - writes are not counted
+} journal_t;
+
+uint64_t journal_checksum(const uint8_t * data, uint64_t len) {
+    uint64_t hash = 14695981039346656037ull;  // FNV-1a
+    for (uint64_t i = 0; i < len; ++i) {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+void journal_init(journal_t * j, int fd, uint64_t region_offset, uint64_t region_size) {
+    memset(j, 0, sizeof(journal_t));
+    j->fd = fd;
+    j->slot_size = region_size / 2;
+    j->slot_offset[0] = region_offset;
+    j->slot_offset[1] = region_offset + j->slot_size;
+    j->len = sizeof(journal_tx_header_t);
+}
+
+void journal_free(journal_t * j) {
+    free(j->buf);
+    j->buf = NULL;
+    j->cap = 0;
+}
+
+// Reads the transaction in a slot, returns a malloc'ed copy (header included) or NULL if it is not valid
+uint8_t * journal_read_slot(journal_t * j, int slot) {
+    journal_tx_header_t header;
+    if (pread(j->fd, &header, sizeof(header), j->slot_offset[slot]) != sizeof(header) ||
+            header.magic != JOURNAL_MAGIC || header.length > j->slot_size - sizeof(header)) {
+        return NULL;
+    }
+
+    uint8_t * tx = malloc(sizeof(header) + header.length);
+    if (pread(j->fd, tx, sizeof(header) + header.length, j->slot_offset[slot]) != (ssize_t) (sizeof(header) + header.length)
+            || journal_checksum(tx + sizeof(header), header.length) != header.checksum) {
+        free(tx);
+        return NULL;
+    }
+    return tx;
+}
+
+// Writes every record of a transaction to its home location
+void journal_apply(journal_t * j, const uint8_t * tx) {
+    const journal_tx_header_t * header = (const journal_tx_header_t *) tx;
+    const uint8_t * pos = tx + sizeof(journal_tx_header_t);
+    for (uint32_t i = 0; i < header->records; ++i) {
+        journal_record_t record;
+        memcpy(&record, pos, sizeof(record));
+        pos += sizeof(record);
+        uint64_t start = j->stats ? stats_clock(j->stats) : 0;
+        if (pwrite(j->fd, pos, record.length, record.offset) != record.length) {
+            perror("journal_apply: pwrite");
+        }
+        if (j->stats) {
+            stats_io(j->stats, 1, record.offset, record.length, start);
+        }
+        pos += record.length;
+    }
+}
+
+/*
+ * Replays the newest committed transaction, if any. Returns 1 if something was
+ * replayed (and flushed), 0 otherwise.
+ */
+int journal_recover(journal_t * j) {
+    uint8_t * tx[2] = {journal_read_slot(j, 0), journal_read_slot(j, 1)};
+    int newest = -1;
+    for (int slot = 0; slot < 2; ++slot) {
+        if (tx[slot] != NULL && (newest < 0 ||
+                ((journal_tx_header_t *) tx[slot])->seq > ((journal_tx_header_t *) tx[newest])->seq)) {
+            newest = slot;
+        }
+    }
+
+    if (newest >= 0) {
+        j->seq = ((journal_tx_header_t *) tx[newest])->seq;
+        journal_apply(j, tx[newest]);
+        fsync(j->fd);
+    }
+    free(tx[0]);
+    free(tx[1]);
+    return newest >= 0;
+}
+
+// Makes both slots invalid, callers fsync first so that nothing replayable is lost
+void journal_invalidate(journal_t * j) {
+    journal_tx_header_t empty = {0};
+    for (int slot = 0; slot < 2; ++slot) {
+        if (pwrite(j->fd, &empty, sizeof(empty), j->slot_offset[slot]) != sizeof(empty)) {
+            perror("journal_invalidate: pwrite");
+        }
+    }
+}
+
+void journal_add(journal_t * j, uint64_t offset, const void * data, uint32_t length) {
+    uint64_t need = j->len + sizeof(journal_record_t) + length;
+    if (need > j->cap) {
+        j->cap = need * 2;
+        j->buf = realloc(j->buf, j->cap);
+    }
+    journal_record_t record = {.offset = offset, .length = length};
+    memcpy(j->buf + j->len, &record, sizeof(record));
+    memcpy(j->buf + j->len + sizeof(record), data, length);
+    j->len = need;
+    ++j->records;
+}
+
+int journal_fits(journal_t * j) {
+    return j->len <= j->slot_size;
+}
+
+/*
+ * Commits the collected records: one write into the next slot, fsync, then the
+ * home writes. A transaction larger than a slot cannot be logged and is written
+ * in place after an fsync, without crash atomicity.
+ */
+void journal_commit(journal_t * j) {
+    if (j->records == 0) {
+        return;
+    }
+
+    journal_tx_header_t * header = (journal_tx_header_t *) j->buf;
+    header->magic = JOURNAL_MAGIC;
+    header->records = j->records;
+    header->seq = j->seq + 1;
+    header->length = j->len - sizeof(journal_tx_header_t);
+    header->checksum = journal_checksum(j->buf + sizeof(journal_tx_header_t), header->length);
+
+    if (journal_fits(j)) {
+        uint64_t start = j->stats ? stats_clock(j->stats) : 0;
+        if (pwrite(j->fd, j->buf, j->len, j->slot_offset[header->seq % 2]) != (ssize_t) j->len) {
+            perror("journal_commit: pwrite");
+        }
+        if (j->stats) {
+            stats_io(j->stats, 1, j->slot_offset[header->seq % 2], j->len, start);
+        }
+        ++j->seq;
+        fsync(j->fd);
+    } else {
+        // The older transactions must not be replayed over the in-place writes
+        fprintf(stderr, "journal: transaction of %lu bytes does not fit, writing in place\n", j->len);
+        fsync(j->fd);
+        journal_invalidate(j);
+        fsync(j->fd);
+    }
+    journal_apply(j, j->buf);
+
+    j->len = sizeof(journal_tx_header_t);
+    j->records = 0;
+}
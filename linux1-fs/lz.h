@@ -0,0 +1,172 @@
+#pragma once
+
+#include <stdint-gcc.h>
+#include <string.h>
+
+/*
+ * Small LZ77 compressor in the LZ4 block format, for compressed files (see
+ * file_write_compressed). A block is a series of sequences:
+ *   token: literal count << 4 | (match length - LZ_MIN_MATCH), 15 in a field
+ *          means that bytes follow, each adding its value, until one is < 255;
+ *   the literals;
+ *   match offset, 2 bytes little-endian, and the match is copied from that far
+ *   back in the output (it may overlap the bytes it produces).
+ * The last sequence has literals only. Matches are found through a hash table
+ * of the last position of every 4-byte sequence, one candidate per position.
+ */
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5  // the input ends with literals, as in LZ4
+#define LZ_MIN_INPUT 13     // shorter input is stored as literals
+
+uint32_t lz_read32(const uint8_t * p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Appends the continuation bytes of a length field, NULL if out of room
+uint8_t * lz_put_length(uint8_t * op, const uint8_t * end, uint32_t len) {
+    for (; len >= 255; len -= 255) {
+        if (op == end) {
+            return NULL;
+        }
+        *op++ = 255;
+    }
+    if (op == end) {
+        return NULL;
+    }
+    *op++ = len;
+    return op;
+}
+
+// Appends a sequence, match_len 0 - the last one. NULL if out of room
+uint8_t * lz_put_sequence(uint8_t * op, const uint8_t * end, const uint8_t * literals, uint32_t literal_len,
+                          uint32_t offset, uint32_t match_len) {
+    if (op == end) {
+        return NULL;
+    }
+    uint32_t match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+    uint8_t * token = op++;
+    *token = (literal_len < 15 ? literal_len : 15) << 4 | (match_code < 15 ? match_code : 15);
+    if (literal_len >= 15 && (op = lz_put_length(op, end, literal_len - 15)) == NULL) {
+        return NULL;
+    }
+    if ((uint64_t) (end - op) < literal_len) {
+        return NULL;
+    }
+    memcpy(op, literals, literal_len);
+    op += literal_len;
+    if (match_len == 0) {
+        return op;
+    }
+    if (end - op < 2) {
+        return NULL;
+    }
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    if (match_code >= 15) {
+        return lz_put_length(op, end, match_code - 15);
+    }
+    return op;
+}
+
+// Compresses len bytes of src into dst, returns the compressed size or 0 if it exceeds cap
+uint32_t lz_compress(const uint8_t * src, uint32_t len, uint8_t * dst, uint32_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS] = {0};  // position + 1, 0 - none
+    uint8_t * op = dst;
+    const uint8_t * end = dst + cap;
+    uint32_t anchor = 0, ip = 0;
+    uint32_t limit = len >= LZ_MIN_INPUT ? len - LZ_MIN_INPUT : 0;
+    while (ip < limit) {
+        uint32_t seq = lz_read32(src + ip);
+        uint32_t h = lz_hash(seq);
+        uint32_t ref = table[h];
+        table[h] = ip + 1;
+        if (ref == 0 || ip - (ref - 1) > LZ_MAX_OFFSET || lz_read32(src + ref - 1) != seq) {
+            ++ip;
+            continue;
+        }
+        --ref;
+        uint32_t match_len = LZ_MIN_MATCH;
+        while (ip + match_len < len - LZ_LAST_LITERALS && src[ref + match_len] == src[ip + match_len]) {
+            ++match_len;
+        }
+        op = lz_put_sequence(op, end, src + anchor, ip - anchor, ip - ref, match_len);
+        if (op == NULL) {
+            return 0;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+    op = lz_put_sequence(op, end, src + anchor, len - anchor, 0, 0);
+    return op == NULL ? 0 : op - dst;
+}
+
+// Reads a length continuation at *ip, -1 past the end of the input
+int64_t lz_get_length(const uint8_t * src, uint32_t len, uint32_t * ip) {
+    int64_t total = 0;
+    uint8_t byte;
+    do {
+        if (*ip >= len) {
+            return -1;
+        }
+        byte = src[(*ip)++];
+        total += byte;
+    } while (byte == 255);
+    return total;
+}
+
+// Decompresses len bytes of src into dst, returns the output size or -1 if the input is corrupt or exceeds cap
+int64_t lz_decompress(const uint8_t * src, uint32_t len, uint8_t * dst, uint32_t cap) {
+    uint32_t ip = 0;
+    uint64_t op = 0;
+    while (ip < len) {
+        uint8_t token = src[ip++];
+        uint64_t literal_len = token >> 4;
+        if (literal_len == 15) {
+            int64_t more = lz_get_length(src, len, &ip);
+            if (more < 0) {
+                return -1;
+            }
+            literal_len += more;
+        }
+        if (literal_len > len - ip || literal_len > cap - op) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+        if (ip == len) {
+            break;  // the last sequence
+        }
+
+        if (len - ip < 2) {
+            return -1;
+        }
+        uint32_t offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        uint64_t match_len = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            int64_t more = lz_get_length(src, len, &ip);
+            if (more < 0) {
+                return -1;
+            }
+            match_len += more;
+        }
+        if (offset == 0 || offset > op || match_len > cap - op) {
+            return -1;
+        }
+        for (uint64_t i = 0; i < match_len; ++i) {
+            dst[op + i] = dst[op - offset + i];
+        }
+        op += match_len;
+    }
+    return op;
+}
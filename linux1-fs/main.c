@@ -1,105 +1,505 @@
 #include <stdio.h>
 #include <string.h>
 #include "fs.h"
+#include "build.h"
+#include "fsck.h"
+#include "snapshot.h"
+#include "tree.h"
+
+#define STREAM_CHUNK (64 * 1024)
+#define BATCH_MAX_ARGS 8
+#define BATCH_LINE_LEN 4096
 
 void print_help() {
-    printf("Usage: <path_to_filesystem> <operation>\n"
-           "Supported operations: create ls link write cat mkdir unlink\n");
+    printf("Usage: [--mmap] [--no-journal] [--aio | --aio-threads] [--cache <blocks>] [--quiet] [--compress] [--dedup] "
+           "<path_to_filesystem> "
+           "<operation>\n"
+           "Supported operations: create ls link write cat mkdir unlink clone snapshot diff du find rm cp batch fsck stats\n"
+           "  --mmap         map the whole image into memory instead of using pread/pwrite (not journaled)\n"
+           "  --no-journal   write metadata in place, an interrupted operation may corrupt the image\n"
+           "  --aio          submit multi-run block transfers asynchronously (io_uring, else threads)\n"
+           "  --aio-threads  same with the thread pool engine only\n"
+           "  --cache        buffer cache size in blocks, 0 - no cache (default 1 MiB worth)\n"
+           "  --quiet        do not report every allocated inode and block\n"
+           "  --compress     store the data of new regular files in compressed clusters\n"
+           "  --dedup        share file blocks with identical contents instead of writing them again\n"
+           "  create [--block-size <bytes>] [--inodes <n>] [--blocks <n>] [--from <host_dir>]\n"
+           "                                  new image, 512..4096 byte blocks (default "
+           STRINGIZE(DEFAULT_BLOCK_SIZE) " bytes,\n"
+           "                                  " STRINGIZE(DEFAULT_INODES_COUNT) " inodes, "
+           STRINGIZE(DEFAULT_BLOCKS_COUNT) " blocks), packed with a copy of host_dir\n"
+           "  clone <path> <dir_path> <name>  copy of a file or tree sharing its data blocks until written\n"
+           "  snapshot <name>                 clone of the whole tree as /name, without earlier snapshots\n"
+           "  diff <dir_a> <dir_b>            paths added, deleted and modified from dir_a to dir_b\n"
+           "  du [--threads <n>] <path>       files, directories, bytes and blocks under path, shared blocks once\n"
+           "  find [--threads <n>] <path> [--name <pattern>] [--type f|d]  paths under path, in no set order\n"
+           "  rm [-r] [--threads <n>] <dir_path> <name>       unlink, with -r a directory and everything in it\n"
+           "  cp [-r] [--threads <n>] <path> <dir_path> <name>  copy a file, with -r a directory tree\n"
+           "                                  (recursive operations walk the tree with n threads, default all CPUs)\n"
+           "  batch [--group <n>] [<script>]  run operations from script or stdin, one per line,\n"
+           "                                  syncing the image every n operations (0 - only at the end)\n"
+           "  fsck [--repair] [--threads <n>]  check the image, exit status 0 - clean, 1 - repaired, 4 - errors left\n"
+           "  stats [--json] [--timing] [--trace <n>] <operation> ...  run the operation, then report its\n"
+           "                                  counters on stderr, timed and with the last n I/O requests\n");
 }
 
-int main(int argc, char** argv) {
-    if (argc < 3) {
-        print_help();
-        return 0;
+// Parses -r and --threads of a recursive operation, returns the index of its first path
+int parse_tree_options(int argc, char** argv, int * recursive, uint32_t * threads) {
+    *recursive = 0;
+    *threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int arg = 1;
+    for (; arg < argc; ++arg) {
+        if (strcmp(argv[arg], "-r") == 0) {
+            *recursive = 1;
+        } else if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+            *threads = strtoul(argv[++arg], NULL, 10);
+        } else {
+            break;
+        }
     }
+    return arg;
+}
 
-    char* filepath = argv[1];
-    filesystem_t fs = {0};
+// Operations that walk a tree with several threads, the filesystem is then opened in concurrent mode
+int is_tree_command(const char * op) {
+    return strcmp(op, "du") == 0 || strcmp(op, "find") == 0 || strcmp(op, "rm") == 0 || strcmp(op, "cp") == 0;
+}
 
-    if (strcmp(argv[2], "create") == 0) {
-        fs_create(&fs, filepath);
-    } else {
-        fs_init(&fs, filepath);
-        if (strcmp(argv[2], "ls") == 0) {
-            const char *dir_path = "/";
-            if (argc > 3) {
-                dir_path = argv[3];
-            }
-            uint32_t dir_inode = fs_parse_path(&fs, dir_path);
+// Runs one operation, argv[0] is its name. Returns 0 on success.
+int run_command(filesystem_t * fs, int argc, char** argv) {
+    if (strcmp(argv[0], "ls") == 0) {
+        const char *dir_path = "/";
+        if (argc > 1) {
+            dir_path = argv[1];
+        }
+        uint32_t dir_inode = fs_parse_path(fs, dir_path);
 
-            if (dir_inode != 0) {
-                printf("TYPE\tSIZE\tLINKS\tINODE\tNAME\n");
+        if (dir_inode == 0) {
+            return 1;
+        }
+        dir_iter_t it;
+        if (fs_dir_open(fs, dir_inode, &it) != 0) {
+            return 1;
+        }
+        printf("TYPE\tSIZE\tLINKS\tINODE\tNAME\n");
 
-                dir_entry_t *result = fs_listdir(&fs, dir_inode);
-                dir_entry_t *iter = result;
-                while (iter->inode != 0) {
-                    inode_t inode = {0};
-                    read_inode(&fs, iter->inode, &inode);
+        const dir_entry_t *entry;
+        const inode_t *inode;
+        while ((entry = fs_dir_next_with_inode(&it, &inode)) != NULL) {
+            char type = inode->type == REGULAR ? 'R' : 'D';
+            printf("%c\t%d\t%d\t%d\t%s\n", type, inode->size, inode->hard_links, entry->inode, entry->name);
+        }
+        fs_dir_close(&it);
+    } else if (strcmp(argv[0], "link") == 0) {
+        if (argc < 4) {
+            printf("need args: <path_to_linking> <link_dir> <link_name>\n");
+            return 1;
+        }
+        const char *path_to_linking = argv[1];
+        const char *link_dir = argv[2];
+        const char *link_name = argv[3];
+        uint32_t linking_inode = fs_parse_path(fs, path_to_linking);
+        uint32_t dir_inode = fs_parse_path(fs, link_dir);
+        if (linking_inode == 0 || dir_inode == 0) {
+            return 1;
+        }
+        return fs_link(fs, linking_inode, link_name, dir_inode) != 0;
+    } else if (strcmp(argv[0], "write") == 0) {
+        if (argc < 3) {
+            printf("need args: <dirpath> <name> [<text> | -]\n");
+            return 1;
+        }
+        const char *dir_path = argv[1];
+        const char *name = argv[2];
+        uint32_t dir_inode = fs_parse_path(fs, dir_path);
+        if (dir_inode == 0) {
+            return 1;
+        }
 
-                    char type = inode.type == REGULAR ? 'R' : 'D';
-                    printf("%c\t%d\t%d\t%d\t%s\n", type, inode.size, inode.hard_links, iter->inode, iter->name);
-                    ++iter;
+        uint32_t inode_idx;
+        if (argc > 3 && strcmp(argv[3], "-") != 0) {
+            const char *data = argv[3];
+            uint32_t len = strlen(data);
+            inode_idx = fs_create_regular_file(fs, len, data);
+        } else {
+            // No text: file contents come from stdin
+            inode_idx = fs_create_regular_file(fs, 0, NULL);
+            static char chunk[STREAM_CHUNK];
+            uint64_t offset = 0;
+            size_t len;
+            while (inode_idx != 0 && (len = fread(chunk, 1, sizeof(chunk), stdin)) > 0) {
+                if (fs_pwrite(fs, inode_idx, offset, chunk, len) != len) {
+                    break;
                 }
-                fs_listdir_free(result);
+                offset += len;
             }
-        } else if (strcmp(argv[2], "link") == 0) {
-            if (argc < 6) {
-                printf("need args: <path_to_linking> <link_dir> <link_name>\n");
-            } else {
-                const char *path_to_linking = argv[3];
-                const char *link_dir = argv[4];
-                const char *link_name = argv[5];
-                uint32_t linking_inode = fs_parse_path(&fs, path_to_linking);
-                uint32_t dir_inode = fs_parse_path(&fs, link_dir);
-                fs_link(&fs, linking_inode, link_name, dir_inode);
+        }
+        if (inode_idx == 0) {
+            return 1;
+        }
+        if (fs_link(fs, inode_idx, name, dir_inode) != 0) {
+            fs_release_inode(fs, inode_idx);
+            fs_op_done(fs);
+            return 1;
+        }
+    } else if (strcmp(argv[0], "cat") == 0) {
+        if (argc < 2) {
+            printf("need args: <filepath>\n");
+            return 1;
+        }
+        const char *path = argv[1];
+        uint32_t inode = fs_parse_path(fs, path);
+        if (inode == 0) {
+            return 1;
+        }
+
+        static char chunk[STREAM_CHUNK];
+        uint64_t offset = 0;
+        uint32_t len;
+        while ((len = fs_pread(fs, inode, offset, chunk, sizeof(chunk))) > 0) {
+            fwrite(chunk, 1, len, stdout);
+            offset += len;
+        }
+        if (isatty(STDOUT_FILENO)) {
+            printf("\n");
+        }
+    } else if (strcmp(argv[0], "mkdir") == 0) {
+        if (argc < 3) {
+            printf("need args: <parent_dir_path> <dir_name>\n");
+            return 1;
+        }
+        const char *dir_path = argv[1];
+        const char *name = argv[2];
+        uint32_t dir_inode = fs_parse_path(fs, dir_path);
+        if (dir_inode == 0) {
+            return 1;
+        }
+        return fs_create_directory(fs, dir_inode, name) == 0;
+    } else if (strcmp(argv[0], "unlink") == 0) {
+        if (argc < 3) {
+            printf("need args: <dir_path> <name>\n");
+            return 1;
+        }
+        const char *path = argv[1];
+        const char *name = argv[2];
+        uint32_t inode = fs_parse_path(fs, path);
+        if (inode == 0) {
+            return 1;
+        }
+        return fs_unlink(fs, name, inode) != 0;
+    } else if (strcmp(argv[0], "clone") == 0) {
+        if (argc < 4) {
+            printf("need args: <path> <dir_path> <name>\n");
+            return 1;
+        }
+        uint32_t src_inode = fs_parse_path(fs, argv[1]);
+        uint32_t dir_inode = fs_parse_path(fs, argv[2]);
+        if (src_inode == 0 || dir_inode == 0) {
+            return 1;
+        }
+        return fs_clone(fs, src_inode, dir_inode, argv[3], 0) == 0;
+    } else if (strcmp(argv[0], "snapshot") == 0) {
+        if (argc < 2) {
+            printf("need args: <name>\n");
+            return 1;
+        }
+        return fs_snapshot(fs, argv[1]) == 0;
+    } else if (strcmp(argv[0], "diff") == 0) {
+        if (argc < 3) {
+            printf("need args: <dir_a> <dir_b>\n");
+            return 1;
+        }
+        uint32_t a_inode = fs_parse_path(fs, argv[1]);
+        uint32_t b_inode = fs_parse_path(fs, argv[2]);
+        if (a_inode == 0 || b_inode == 0) {
+            return 1;
+        }
+        fs_diff(fs, a_inode, b_inode);
+    } else if (strcmp(argv[0], "du") == 0) {
+        int recursive;
+        uint32_t threads;
+        int arg = parse_tree_options(argc, argv, &recursive, &threads);
+        if (arg >= argc) {
+            printf("need args: <path>\n");
+            return 1;
+        }
+        // Parsing the path cuts it at the slashes
+        char *path_copy = strdup(argv[arg]);
+        uint32_t inode = fs_parse_path(fs, path_copy);
+        free(path_copy);
+        if (inode == 0) {
+            return 1;
+        }
+        fs_du(fs, inode, argv[arg], threads);
+    } else if (strcmp(argv[0], "find") == 0) {
+        int recursive;
+        uint32_t threads;
+        int arg = parse_tree_options(argc, argv, &recursive, &threads);
+        if (arg >= argc) {
+            printf("need args: <path> [--name <pattern>] [--type f|d]\n");
+            return 1;
+        }
+        const char *path = argv[arg];
+        tree_find_t find = {.pattern = NULL, .type = -1};
+        for (++arg; arg + 1 < argc; arg += 2) {
+            if (strcmp(argv[arg], "--name") == 0) {
+                find.pattern = argv[arg + 1];
+            } else if (strcmp(argv[arg], "--type") == 0) {
+                find.type = strcmp(argv[arg + 1], "d") == 0 ? DIRECTORY : REGULAR;
             }
-        } else if (strcmp(argv[2], "write") == 0) {
-            if (argc < 6) {
-                printf("need args: <dirpath> <name> <text>\n");
+        }
+        char *path_copy = strdup(path);
+        uint32_t inode = fs_parse_path(fs, path_copy);
+        free(path_copy);
+        if (inode == 0) {
+            return 1;
+        }
+        fs_find(fs, inode, path, &find, threads);
+    } else if (strcmp(argv[0], "rm") == 0) {
+        int recursive;
+        uint32_t threads;
+        int arg = parse_tree_options(argc, argv, &recursive, &threads);
+        if (arg + 1 >= argc) {
+            printf("need args: [-r] <dir_path> <name>\n");
+            return 1;
+        }
+        uint32_t dir_inode = fs_parse_path(fs, argv[arg]);
+        if (dir_inode == 0) {
+            return 1;
+        }
+        if (!recursive) {
+            return fs_unlink(fs, argv[arg + 1], dir_inode) != 0;
+        }
+        return fs_remove_tree(fs, dir_inode, argv[arg + 1], threads) != 0;
+    } else if (strcmp(argv[0], "cp") == 0) {
+        int recursive;
+        uint32_t threads;
+        int arg = parse_tree_options(argc, argv, &recursive, &threads);
+        if (arg + 2 >= argc) {
+            printf("need args: [-r] <path> <dir_path> <name>\n");
+            return 1;
+        }
+        uint32_t src_inode = fs_parse_path(fs, argv[arg]);
+        uint32_t dir_inode = fs_parse_path(fs, argv[arg + 1]);
+        if (src_inode == 0 || dir_inode == 0) {
+            return 1;
+        }
+        inode_t src;
+        fs_stat(fs, src_inode, &src);
+        if (src.type == DIRECTORY && !recursive) {
+            printf("cp: -r not specified, omitting directory\n");
+            return 1;
+        }
+        return fs_copy_tree(fs, src_inode, dir_inode, argv[arg + 2], threads) == 0;
+    } else {
+        print_help();
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Splits a script line into arguments in place. Arguments are separated by
+ * spaces or tabs, double quotes keep spaces inside one argument.
+ */
+int split_line(char* line, char** args, int max_args) {
+    int count = 0;
+    char* src = line;
+    while (count < max_args) {
+        while (*src == ' ' || *src == '\t' || *src == '\n' || *src == '\r') {
+            ++src;
+        }
+        if (*src == 0 || *src == '#') {
+            break;
+        }
+
+        char* dst = src;
+        args[count++] = dst;
+        int quoted = 0;
+        while (*src != 0 && (quoted || (*src != ' ' && *src != '\t' && *src != '\n' && *src != '\r'))) {
+            if (*src == '"') {
+                quoted = !quoted;
+                ++src;
             } else {
-                const char *dir_path = argv[3];
-                const char *name = argv[4];
-                const char *data = argv[5];
-                uint32_t len = strlen(data);
-                uint32_t dir_inode = fs_parse_path(&fs, dir_path);
-                uint32_t inode_idx = fs_create_regular_file(&fs, len, data);
-                fs_link(&fs, inode_idx, name, dir_inode);
+                *dst++ = *src++;
             }
-        } else if (strcmp(argv[2], "cat") == 0) {
-            if (argc < 4) {
-                printf("need args: <filepath>\n");
+        }
+        if (*src != 0) {
+            ++src;
+        }
+        *dst = 0;
+    }
+    return count;
+}
+
+// Runs every line of script against one open filesystem, returns the number of failures
+int run_batch(filesystem_t * fs, FILE* script, uint32_t group) {
+    static char line[BATCH_LINE_LEN];
+    char* args[BATCH_MAX_ARGS];
+    uint32_t line_no = 0, executed = 0, failed = 0, since_sync = 0;
+
+    while (fgets(line, sizeof(line), script) != NULL) {
+        ++line_no;
+        int argc = split_line(line, args, BATCH_MAX_ARGS);
+        if (argc == 0) {
+            continue;
+        }
+
+        // Reported on stderr so that it does not mix with ls/cat output
+        char op[16];
+        snprintf(op, sizeof(op), "%s", args[0]);
+        int status = run_command(fs, argc, args);
+        fflush(stdout);
+        fprintf(stderr, "batch: line %u: %s: %s\n", line_no, op, status == 0 ? "ok" : "failed");
+        ++executed;
+        failed += status != 0;
+
+        if (group != 0 && ++since_sync == group) {
+            fs_sync(fs);
+            since_sync = 0;
+        }
+    }
+
+    fs_sync(fs);
+    fprintf(stderr, "batch: %u operations, %u failed\n", executed, failed);
+    if (fs->bcache != NULL) {
+        fprintf(stderr, "batch: buffer cache hits %lu, misses %lu, readahead %lu, writebacks %lu\n",
+                fs->bcache->hits, fs->bcache->misses, fs->bcache->readahead, fs->bcache->writebacks);
+    }
+    return failed;
+}
+
+int main(int argc, char** argv) {
+    filesystem_t fs = {0};
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--mmap") == 0) {
+            fs.use_mmap = 1;
+        } else if (strcmp(argv[1], "--no-journal") == 0) {
+            fs.no_journal = 1;
+        } else if (strcmp(argv[1], "--aio") == 0) {
+            fs.use_aio = 1;
+        } else if (strcmp(argv[1], "--aio-threads") == 0) {
+            fs.use_aio = 2;
+        } else if (strcmp(argv[1], "--quiet") == 0) {
+            fs.quiet = 1;
+        } else if (strcmp(argv[1], "--compress") == 0) {
+            fs.compress = 1;
+        } else if (strcmp(argv[1], "--dedup") == 0) {
+            fs.dedup = 1;
+        } else if (strcmp(argv[1], "--cache") == 0 && argc > 2) {
+            int32_t blocks = strtol(argv[2], NULL, 10);
+            fs.cache_blocks = blocks > 0 ? blocks : -1;
+            ++argv;
+            --argc;
+        } else {
+            print_help();
+            return 1;
+        }
+        ++argv;
+        --argc;
+    }
+
+    if (argc < 3) {
+        print_help();
+        return 0;
+    }
+
+    char* filepath = argv[1];
+    int status = 0;
+
+    int stats = 0;  // 1 - text report, 2 - JSON
+    if (strcmp(argv[2], "stats") == 0) {
+        stats = 1;
+        int arg = 3;
+        for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; ++arg) {
+            if (strcmp(argv[arg], "--json") == 0) {
+                stats = 2;
+            } else if (strcmp(argv[arg], "--timing") == 0) {
+                fs.stats.timing = 1;
+            } else if (strcmp(argv[arg], "--trace") == 0 && arg + 1 < argc) {
+                fs.stats.trace_cap = strtoul(argv[++arg], NULL, 10);
             } else {
-                const char *path = argv[3];
-                uint32_t inode = fs_parse_path(&fs, path);
+                break;
+            }
+        }
+        if (arg == argc) {
+            print_help();
+            return 1;
+        }
+        // The operation takes the place of "stats"
+        argv += arg - 2;
+        argc -= arg - 2;
+        argv[1] = filepath;
+    }
 
-                char block[BLOCK_SIZE];
-                uint32_t size = fs_read_regular_file(&fs, inode, block);
-                block[size] = 0;
-                printf("%s\n", block);
+    if (strcmp(argv[2], "create") == 0) {
+        const char *host_dir = NULL;
+        for (int arg = 3; arg + 1 < argc; arg += 2) {
+            uint32_t value = strtoul(argv[arg + 1], NULL, 10);
+            if (strcmp(argv[arg], "--from") == 0) {
+                host_dir = argv[arg + 1];
+            } else if (strcmp(argv[arg], "--block-size") == 0) {
+                fs.sb.block_size = value;
+            } else if (strcmp(argv[arg], "--inodes") == 0) {
+                fs.sb.inodes_count = value;
+            } else if (strcmp(argv[arg], "--blocks") == 0) {
+                fs.sb.blocks_count = value;
             }
-        } else if (strcmp(argv[2], "mkdir") == 0) {
-            if (argc < 5) {
-                printf("need args: <parent_dir_path> <dir_name>\n");
-            } else {
-                const char *dir_path = argv[3];
-                const char *name = argv[4];
-                uint32_t dir_inode = fs_parse_path(&fs, dir_path);
-                fs_create_directory(&fs, dir_inode, name);
+        }
+        if ((host_dir ? fs_create_from(&fs, filepath, host_dir) : fs_create(&fs, filepath)) != 0) {
+            return 1;
+        }
+    } else if (strcmp(argv[2], "fsck") == 0) {
+        int repair = 0;
+        uint32_t threads = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int arg = 3; arg < argc; ++arg) {
+            if (strcmp(argv[arg], "--repair") == 0) {
+                repair = 1;
+            } else if (strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc) {
+                threads = strtoul(argv[++arg], NULL, 10);
             }
-        } else if (strcmp(argv[2], "unlink") == 0) {
-            if (argc < 5) {
-                printf("need args: <dir_path> <name>\n");
-            } else {
-                const char *path = argv[3];
-                const char *name = argv[4];
-                uint32_t inode = fs_parse_path(&fs, path);
-                fs_unlink(&fs, name, inode);
+        }
+        fs.concurrent = 1;
+        if (fs_init(&fs, filepath) != 0) {
+            return 4;
+        }
+        status = fs_fsck(&fs, repair, threads);
+    } else {
+        fs.concurrent = is_tree_command(argv[2]);
+        if (fs_init(&fs, filepath) != 0) {
+            return 1;
+        }
+        if (strcmp(argv[2], "batch") == 0) {
+            uint32_t group = 0;
+            int arg = 3;
+            if (arg + 1 < argc && strcmp(argv[arg], "--group") == 0) {
+                group = strtoul(argv[arg + 1], NULL, 10);
+                arg += 2;
+            }
+
+            FILE* script = stdin;
+            if (arg < argc) {
+                script = fopen(argv[arg], "r");
+                if (script == NULL) {
+                    check_error("batch: fopen");
+                    fs_close(&fs);
+                    return 1;
+                }
+            }
+            status = run_batch(&fs, script, group) != 0;
+            if (script != stdin) {
+                fclose(script);
             }
         } else {
-            print_help();
+            status = run_command(&fs, argc - 2, argv + 2) != 0;
         }
     }
 
+    if (stats) {
+        fs_sync(&fs);
+        fflush(stdout);
+        fs_print_stats(&fs, stderr, stats == 2);
+    }
     fs_close(&fs);
-    return 0;
+    return status;
 }
@@ -0,0 +1,342 @@
+#pragma once
+
+#include <limits.h>
+
+#include "fs.h"
+
+/*
+ * Clones and snapshots. A clone copies the inodes, directory tables and extent
+ * tree nodes of a subtree, while the data blocks of its regular files are shared
+ * with the source: each extent only gains a reference in block_refs. Cloning thus
+ * costs O(metadata), and a write to a shared block gives the writer a private copy
+ * (see file_write). Hard links within the subtree stay hard links in the clone.
+ * A snapshot is a clone of the root, made a child of the root and flagged
+ * INODE_SNAPSHOT, so that the following snapshots leave it out.
+ * The source subtree must not change while it is cloned.
+ */
+
+typedef struct CloneTree {
+    uint32_t *src;    // source inodes in breadth-first order
+    uint32_t *parent; // source parent of src[i], 0 for the root of the subtree
+    uint32_t count;
+    uint32_t cap;
+    uint32_t *map;    // source inode -> clone inode, 0 - not in the tree
+    uint32_t *links;  // names of each source inode inside the tree
+} clone_tree_t;
+
+int clone_skips(filesystem_t * fs, const dir_entry_t * entry, int skip_snapshots) {
+    return strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0
+           || (skip_snapshots && (fs_inode_ptr(fs, entry->inode)->flags & INODE_SNAPSHOT));
+}
+
+void clone_add(clone_tree_t * tree, uint32_t inode_idx, uint32_t parent) {
+    if (tree->count == tree->cap) {
+        tree->cap = tree->cap ? tree->cap * 2 : 64;
+        tree->src = realloc(tree->src, tree->cap * sizeof(uint32_t));
+        tree->parent = realloc(tree->parent, tree->cap * sizeof(uint32_t));
+    }
+    tree->parent[tree->count] = parent;
+    tree->src[tree->count++] = inode_idx;
+    tree->map[inode_idx] = (uint32_t) -1;  // found, numbered later
+}
+
+// Finds the inodes under src_idx, map marks the ones found
+int clone_scan(filesystem_t * fs, clone_tree_t * tree, uint32_t src_idx, int skip_snapshots) {
+    memset(tree, 0, sizeof(clone_tree_t));
+    tree->map = calloc(fs->sb.inodes_count, sizeof(uint32_t));
+    tree->links = calloc(fs->sb.inodes_count, sizeof(uint32_t));
+    clone_add(tree, src_idx, 0);
+    for (uint32_t i = 0; i < tree->count; ++i) {
+        if (fs_inode_ptr(fs, tree->src[i])->type != DIRECTORY) {
+            continue;
+        }
+        uint32_t count;
+        dir_entry_t * entries = dir_collect(fs, tree->src[i], &count);
+        if (entries == NULL) {
+            return -1;
+        }
+        for (uint32_t k = 0; k < count; ++k) {
+            if (clone_skips(fs, entries + k, skip_snapshots)) {
+                continue;
+            }
+            ++tree->links[entries[k].inode];
+            if (tree->map[entries[k].inode] == 0) {
+                clone_add(tree, entries[k].inode, tree->src[i]);
+            }
+        }
+        free(entries);
+    }
+    return 0;
+}
+
+void clone_free(clone_tree_t * tree) {
+    free(tree->src);
+    free(tree->parent);
+    free(tree->map);
+    free(tree->links);
+}
+
+/*
+ * Copies the nodes of an extent subtree to new blocks and references its data
+ * blocks. Returns the entries cloned, fewer than count when out of blocks for
+ * nodes: the copy then holds only those, so that it can be freed as usual.
+ */
+uint32_t clone_extents(filesystem_t * fs, extent_t * entries, uint32_t count, uint32_t depth) {
+    for (uint32_t i = 0; i < count; ++i) {
+        if (depth == 0) {
+            fs_ref_blocks(fs, entries[i].start, entries[i].len);
+            continue;
+        }
+        uint32_t block_idx = fs_alloc_block(fs);
+        if (block_idx == (uint32_t) -1) {
+            return i;
+        }
+        extent_t child[MAX_NODE_EXTENTS] = {0};
+        read_block(fs, entries[i].start, child);
+        uint32_t cloned = clone_extents(fs, child, entries[i].len, depth - 1);
+        write_block(fs, block_idx, child, fs_block_size(fs));
+        entries[i].start = block_idx;
+        if (cloned < entries[i].len) {
+            entries[i].len = cloned;
+            return i + 1;
+        }
+    }
+    return count;
+}
+
+// Fills clone inode dst_idx from src_idx, parent is the clone of its parent
+int clone_inode(filesystem_t * fs, clone_tree_t * tree, uint32_t src_idx, uint32_t parent, int skip_snapshots) {
+    uint32_t dst_idx = tree->map[src_idx];
+    inode_t inode;
+    read_inode(fs, src_idx, &inode);
+    inode.flags &= ~INODE_SNAPSHOT;
+    inode.hard_links = tree->links[src_idx];
+
+    if (inode.type == REGULAR) {
+        int result = 0;
+        if (!is_inode_inline(&inode)) {
+            uint32_t cloned = clone_extents(fs, inode.extents, inode.extent_count, inode.extent_depth);
+            result = cloned < inode.extent_count ? -1 : 0;
+            inode.extent_count = cloned;
+        }
+        write_inode(fs, dst_idx, &inode);
+        return result;
+    }
+
+    inode.hard_links = tree->links[src_idx] + 1;
+    if (is_inode_inline(&inode)) {
+        memcpy(inode.inline_data, &parent, sizeof(parent));
+        write_inode(fs, dst_idx, &inode);
+        return 0;
+    }
+    uint32_t count;
+    dir_entry_t * entries = dir_collect(fs, src_idx, &count);
+    if (entries == NULL) {
+        return -1;
+    }
+    uint32_t kept = 0;
+    for (uint32_t k = 0; k < count; ++k) {
+        if (strcmp(entries[k].name, ".") == 0) {
+            entries[kept] = entries[k];
+            entries[kept++].inode = dst_idx;
+        } else if (strcmp(entries[k].name, "..") == 0) {
+            entries[kept] = entries[k];
+            entries[kept++].inode = parent;
+        } else if (!clone_skips(fs, entries + k, skip_snapshots)) {
+            entries[kept] = entries[k];
+            entries[kept++].inode = tree->map[entries[k].inode];
+        }
+    }
+    inode_t dir_inode = {.hard_links = inode.hard_links, .type = DIRECTORY};
+    write_inode(fs, dst_idx, &dir_inode);
+    dir_build(fs, dst_idx, entries, kept, dir_buckets_for(kept));
+    free(entries);
+    return 0;
+}
+
+/*
+ * Clones the subtree at src_idx as dst_dir/name and returns the new inode, 0 on
+ * failure. skip_snapshots leaves out snapshot roots found in the subtree.
+ */
+uint32_t fs_clone(filesystem_t * fs, uint32_t src_idx, uint32_t dst_dir, const char * name, int skip_snapshots) {
+    if (dir_lookup(fs, dst_dir, name) != 0) {
+        printf("clone: %s already exists in dir %u\n", name, dst_dir);
+        return 0;
+    }
+    clone_tree_t tree;
+    if (clone_scan(fs, &tree, src_idx, skip_snapshots) != 0) {
+        clone_free(&tree);
+        return 0;
+    }
+    if (tree.count > fs->free_inodes_count) {
+        printf("clone: %u inodes needed, %u free\n", tree.count, fs->free_inodes_count);
+        clone_free(&tree);
+        return 0;
+    }
+    for (uint32_t i = 0; i < tree.count; ++i) {
+        tree.map[tree.src[i]] = fs_find_empty_inode(fs);
+    }
+
+    int result = 0;
+    for (uint32_t i = 0; i < tree.count && result == 0; ++i) {
+        uint32_t parent = i == 0 ? dst_dir : tree.map[tree.parent[i]];
+        result = clone_inode(fs, &tree, tree.src[i], parent, skip_snapshots);
+    }
+
+    uint32_t root = tree.map[src_idx];
+    if (result != 0 || link_inode(fs, root, name, dst_dir) != 0) {
+        printf("clone: out of space\n");
+        for (uint32_t i = 0; i < tree.count; ++i) {
+            fs_release_inode(fs, tree.map[tree.src[i]]);
+        }
+        fs_op_done(fs);
+        root = 0;
+    }
+    clone_free(&tree);
+    return root;
+}
+
+// Snapshot of the whole tree as /name, earlier snapshots are not included
+uint32_t fs_snapshot(filesystem_t * fs, const char * name) {
+    uint32_t root = fs_clone(fs, 1, 1, name, 1);
+    if (root != 0) {
+        inode_t inode;
+        read_inode(fs, root, &inode);
+        inode.flags |= INODE_SNAPSHOT;
+        write_inode(fs, root, &inode);
+        fs_op_done(fs);
+    }
+    return root;
+}
+
+typedef struct DiffTotals {
+    uint32_t added, deleted, modified;
+    uint64_t shared, only_a, only_b;  // data blocks at the same offset in both, in one side only
+} diff_totals_t;
+
+int diff_compare_entries(const void * a, const void * b) {
+    return strcmp(((const dir_entry_t *) a)->name, ((const dir_entry_t *) b)->name);
+}
+
+// Data blocks of a file, for files that exist on one side only
+uint64_t diff_file_blocks(filesystem_t * fs, uint32_t inode_idx) {
+    inode_t inode;
+    read_inode(fs, inode_idx, &inode);
+    if (inode.type != REGULAR || is_inode_inline(&inode)) {
+        return 0;
+    }
+    const uint32_t bs = fs_block_size(fs);
+    bmap_cursor_t cur;
+    bmap_cursor_reset(&cur);
+    uint64_t blocks = 0;
+    for (uint32_t lblk = 0; lblk < (inode.size + bs - 1) / bs; ++lblk) {
+        blocks += fs_bmap(fs, &cur, &inode, lblk) != 0;
+    }
+    return blocks;
+}
+
+// Blocks that differ between two regular files, counted into the totals; -1 if only the inline data differs
+int64_t diff_files(filesystem_t * fs, uint32_t a_idx, uint32_t b_idx, diff_totals_t * totals) {
+    inode_t a, b;
+    read_inode(fs, a_idx, &a);
+    read_inode(fs, b_idx, &b);
+    if (is_inode_inline(&a) && is_inode_inline(&b)) {
+        return a.size != b.size || memcmp(a.inline_data, b.inline_data, a.size) != 0 ? -1 : 0;
+    }
+    const uint32_t bs = fs_block_size(fs);
+    uint32_t a_blocks = is_inode_inline(&a) ? 0 : (a.size + bs - 1) / bs;
+    uint32_t b_blocks = is_inode_inline(&b) ? 0 : (b.size + bs - 1) / bs;
+    bmap_cursor_t a_cur, b_cur;
+    bmap_cursor_reset(&a_cur);
+    bmap_cursor_reset(&b_cur);
+    int64_t changed = 0;
+    for (uint32_t lblk = 0; lblk < a_blocks || lblk < b_blocks; ++lblk) {
+        uint32_t a_phys = lblk < a_blocks ? fs_bmap(fs, &a_cur, &a, lblk) : 0;
+        uint32_t b_phys = lblk < b_blocks ? fs_bmap(fs, &b_cur, &b, lblk) : 0;
+        if (a_phys == b_phys) {
+            totals->shared += a_phys != 0;
+            continue;
+        }
+        ++changed;
+        totals->only_a += a_phys != 0;
+        totals->only_b += b_phys != 0;
+    }
+    return changed == 0 && a.size != b.size ? -1 : changed;
+}
+
+void diff_report(filesystem_t * fs, char tag, const char * path, uint32_t inode_idx, diff_totals_t * totals) {
+    uint64_t blocks = diff_file_blocks(fs, inode_idx);
+    if (tag == 'A') {
+        ++totals->added;
+        totals->only_b += blocks;
+    } else {
+        ++totals->deleted;
+        totals->only_a += blocks;
+    }
+    printf("%c %s%s\n", tag, path, fs_inode_ptr(fs, inode_idx)->type == DIRECTORY ? "/" : "");
+}
+
+// Compares two directories entry by entry, path is the relative path of both
+void diff_dirs(filesystem_t * fs, uint32_t a_dir, uint32_t b_dir, char * path, diff_totals_t * totals) {
+    uint32_t a_count, b_count;
+    dir_entry_t * a = dir_collect(fs, a_dir, &a_count);
+    dir_entry_t * b = dir_collect(fs, b_dir, &b_count);
+    if (a == NULL || b == NULL) {
+        free(a);
+        free(b);
+        return;
+    }
+    qsort(a, a_count, sizeof(dir_entry_t), diff_compare_entries);
+    qsort(b, b_count, sizeof(dir_entry_t), diff_compare_entries);
+
+    size_t path_len = strlen(path);
+    uint32_t i = 0, k = 0;
+    while (i < a_count || k < b_count) {
+        int cmp = i == a_count ? 1 : k == b_count ? -1 : strcmp(a[i].name, b[k].name);
+        const char * name = cmp <= 0 ? a[i].name : b[k].name;
+        uint32_t idx = cmp <= 0 ? a[i].inode : b[k].inode;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || (fs_inode_ptr(fs, idx)->flags & INODE_SNAPSHOT)) {
+            i += cmp <= 0;
+            k += cmp >= 0;
+            continue;
+        }
+        snprintf(path + path_len, PATH_MAX - path_len, "%s%s", path_len ? "/" : "", name);
+        if (cmp < 0) {
+            diff_report(fs, 'D', path, a[i++].inode, totals);
+            continue;
+        }
+        if (cmp > 0) {
+            diff_report(fs, 'A', path, b[k++].inode, totals);
+            continue;
+        }
+        uint32_t a_idx = a[i++].inode, b_idx = b[k++].inode;
+        enum InodeType a_type = fs_inode_ptr(fs, a_idx)->type, b_type = fs_inode_ptr(fs, b_idx)->type;
+        if (a_type != b_type) {
+            diff_report(fs, 'D', path, a_idx, totals);
+            diff_report(fs, 'A', path, b_idx, totals);
+        } else if (a_type == DIRECTORY) {
+            diff_dirs(fs, a_idx, b_idx, path, totals);
+        } else {
+            int64_t changed = diff_files(fs, a_idx, b_idx, totals);
+            if (changed > 0) {
+                ++totals->modified;
+                printf("M %s (%ld blocks)\n", path, changed);
+            } else if (changed < 0) {
+                ++totals->modified;
+                printf("M %s\n", path);
+            }
+        }
+    }
+    path[path_len] = 0;
+    free(a);
+    free(b);
+}
+
+// Prints the paths added (A), deleted (D) and modified (M) from directory a to b, snapshots aside
+void fs_diff(filesystem_t * fs, uint32_t a_dir, uint32_t b_dir) {
+    char path[PATH_MAX] = "";
+    diff_totals_t totals = {0};
+    diff_dirs(fs, a_dir, b_dir, path, &totals);
+    printf("diff: %u added, %u deleted, %u modified; data blocks shared %lu, only in a %lu, only in b %lu\n",
+           totals.added, totals.deleted, totals.modified, totals.shared, totals.only_a, totals.only_b);
+}
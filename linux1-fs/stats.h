@@ -0,0 +1,171 @@
+#pragma once
+
+#include <stdint-gcc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Statistics: event counters, the time spent in timed events when timing is
+ * on, and an optional ring buffer of the last primitive I/O requests (offset,
+ * size, duration). Everything is updated with relaxed atomics, so threads of a
+ * concurrent filesystem share one instance; a record being overwritten while
+ * the ring is dumped may come out torn.
+ */
+
+enum StatCounter {
+    STAT_READ_INODE,
+    STAT_WRITE_INODE,
+    STAT_READ_BLOCK,      // metadata block reads (read_block)
+    STAT_WRITE_BLOCK,
+    STAT_DISK_READS,      // read syscalls or async requests
+    STAT_DISK_WRITES,
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_INODE_FLUSHES,   // timed
+    STAT_BITMAP_FLUSHES,  // timed
+    STAT_COMMITS,         // timed
+    STAT_INODE_ALLOCS,
+    STAT_BLOCK_ALLOCS,
+    STAT_BLOCK_FREES,
+    STAT_DIR_LOOKUPS,
+    STAT_DCACHE_HITS,
+    STAT_DEDUP_HITS,      // blocks shared instead of written
+    STAT_COUNT
+};
+
+const char * const stat_names[STAT_COUNT] = {
+        "read_inode", "write_inode", "read_block", "write_block",
+        "disk_reads", "disk_writes", "bytes_read", "bytes_written",
+        "inode_flushes", "bitmap_flushes", "commits",
+        "inode_allocs", "block_allocs", "block_frees",
+        "dir_lookups", "dcache_hits", "dedup_hits"
+};
+
+typedef struct StatsTraceRecord {
+    uint64_t seq;
+    uint64_t offset;
+    uint64_t len;
+    uint64_t ns;  // 0 without timing
+    uint8_t write;
+} stats_trace_record_t;
+
+typedef struct Stats {
+    int timing;          // set before use: measure timed events and I/O with clock_gettime
+    uint32_t trace_cap;  // set before stats_start: ring size in records, 0 - no trace
+
+    uint64_t count[STAT_COUNT];
+    uint64_t ns[STAT_COUNT];  // disk_* entries hold the time spent in I/O
+    stats_trace_record_t *trace;
+    uint64_t trace_next;  // records made so far
+} stats_t;
+
+void stats_start(stats_t * st) {
+    if (st->trace_cap == 0) {
+        return;
+    }
+    uint32_t cap = 1;
+    while (cap < st->trace_cap) {
+        cap *= 2;
+    }
+    st->trace_cap = cap;
+    st->trace = calloc(cap, sizeof(stats_trace_record_t));
+}
+
+void stats_free(stats_t * st) {
+    free(st->trace);
+    st->trace = NULL;
+}
+
+// Start of a timed event, 0 when timing is off
+uint64_t stats_clock(stats_t * st) {
+    if (!st->timing) {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void stats_add(stats_t * st, enum StatCounter counter, uint64_t n) {
+    __atomic_fetch_add(st->count + counter, n, __ATOMIC_RELAXED);
+}
+
+// Counts one event that began at start (a stats_clock value), returns its duration
+uint64_t stats_done(stats_t * st, enum StatCounter counter, uint64_t start) {
+    stats_add(st, counter, 1);
+    if (start == 0) {
+        return 0;
+    }
+    uint64_t ns = stats_clock(st) - start;
+    __atomic_fetch_add(st->ns + counter, ns, __ATOMIC_RELAXED);
+    return ns;
+}
+
+// One primitive I/O request of len bytes at the image offset, begun at start
+void stats_io(stats_t * st, int write, uint64_t offset, uint64_t len, uint64_t start) {
+    uint64_t ns = stats_done(st, write ? STAT_DISK_WRITES : STAT_DISK_READS, start);
+    stats_add(st, write ? STAT_BYTES_WRITTEN : STAT_BYTES_READ, len);
+    if (st->trace != NULL) {
+        uint64_t seq = __atomic_fetch_add(&st->trace_next, 1, __ATOMIC_RELAXED);
+        st->trace[seq & (st->trace_cap - 1)] = (stats_trace_record_t) {
+                .seq = seq,
+                .offset = offset,
+                .len = len,
+                .ns = ns,
+                .write = write
+        };
+    }
+}
+
+// Sequence number of the oldest record still in the ring
+uint64_t stats_trace_first(const stats_t * st) {
+    return st->trace_next > st->trace_cap ? st->trace_next - st->trace_cap : 0;
+}
+
+void stats_print(const stats_t * st, FILE * out) {
+    for (uint32_t i = 0; i < STAT_COUNT; ++i) {
+        fprintf(out, "stats: %-16s %lu", stat_names[i], st->count[i]);
+        if (st->timing && st->ns[i] != 0) {
+            fprintf(out, "  %lu ns", st->ns[i]);
+        }
+        fprintf(out, "\n");
+    }
+    for (uint64_t seq = stats_trace_first(st); st->trace != NULL && seq < st->trace_next; ++seq) {
+        const stats_trace_record_t * record = st->trace + (seq & (st->trace_cap - 1));
+        fprintf(out, "trace: %lu %s offset %lu len %lu ns %lu\n", record->seq,
+                record->write ? "write" : "read", record->offset, record->len, record->ns);
+    }
+}
+
+// Members of a JSON object: "counters", "time_ns" and, when tracing, "trace"
+void stats_json(const stats_t * st, FILE * out) {
+    fprintf(out, "  \"counters\": {");
+    for (uint32_t i = 0; i < STAT_COUNT; ++i) {
+        fprintf(out, "%s\"%s\": %lu", i ? ", " : "", stat_names[i], st->count[i]);
+    }
+    fprintf(out, "}");
+    if (st->timing) {
+        fprintf(out, ",\n  \"time_ns\": {");
+        const char * sep = "";
+        for (uint32_t i = 0; i < STAT_COUNT; ++i) {
+            if (st->ns[i] != 0) {
+                fprintf(out, "%s\"%s\": %lu", sep, stat_names[i], st->ns[i]);
+                sep = ", ";
+            }
+        }
+        fprintf(out, "}");
+    }
+    if (st->trace != NULL) {
+        fprintf(out, ",\n  \"trace\": [");
+        uint64_t first = stats_trace_first(st);
+        for (uint64_t seq = first; seq < st->trace_next; ++seq) {
+            const stats_trace_record_t * record = st->trace + (seq & (st->trace_cap - 1));
+            fprintf(out, "%s\n    {\"seq\": %lu, \"op\": \"%s\", \"offset\": %lu, \"len\": %lu, \"ns\": %lu}",
+                    seq == first ? "" : ",", record->seq, record->write ? "write" : "read",
+                    record->offset, record->len, record->ns);
+        }
+        fprintf(out, "\n  ]");
+    }
+}
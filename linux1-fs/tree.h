@@ -0,0 +1,609 @@
+#pragma once
+
+#include <fnmatch.h>
+#include <pthread.h>
+
+#include "fs.h"
+#include "snapshot.h"
+
+/*
+ * Recursive operations on a subtree: du, find, rm -r and cp -r.
+ *
+ * Directories are read by worker threads that balance the load by work stealing.
+ * Every worker has a deque of directories still to read: it pushes the
+ * subdirectories it finds at the back and takes its next directory from the back
+ * too, depth first, while an idle worker steals from the front of another deque,
+ * where the shallowest directories, with the most work under them, wait.
+ * Workers that find nothing to steal sleep until a directory is queued.
+ * A walk ends once no directory is queued or being read.
+ *
+ * rm -r and cp -r first collect the subtree this way into a clone_tree_t (see
+ * snapshot.h), then the workers change it TREE_CHUNK inodes at a time, each chunk
+ * one operation: the directories removed or copied are not edited entry by entry,
+ * and bitmaps are flushed once per chunk rather than once per entry.
+ * The subtree must not change meanwhile.
+ */
+
+#define TREE_MAX_THREADS 64
+#define TREE_CHUNK 64                // inodes changed per operation by rm -r and cp -r
+#define TREE_COMMIT_INODES 4096      // inodes changed per journal transaction, so that one fits a slot
+#define TREE_COPY_CHUNK (256 << 10)  // bytes of file data copied at a time
+
+typedef struct TreeTask {
+    uint32_t dir;
+    char *path;  // NULL unless the walk keeps paths
+} tree_task_t;
+
+typedef struct TreeDeque {
+    pthread_mutex_t lock;
+    tree_task_t *tasks;
+    uint32_t head;  // thieves take tasks[head]
+    uint32_t tail;  // the owner pushes and pops tasks[tail - 1]
+    uint32_t cap;
+} tree_deque_t;
+
+typedef struct TreeWalk tree_walk_t;
+
+/*
+ * Called for every entry but "." and ".." with the entry's inode in the inode table.
+ * Returns 1 to walk into a directory entry.
+ */
+typedef int (*tree_visit_t)(tree_walk_t * walk, uint32_t worker, const tree_task_t * task,
+                            const dir_entry_t * entry, const inode_t * inode);
+
+struct TreeWalk {
+    filesystem_t *fs;
+    uint32_t threads;
+    tree_deque_t deques[TREE_MAX_THREADS];
+    uint32_t pending;  // directories queued or being read
+    int keep_paths;
+    tree_visit_t visit;
+    void *arg;
+    pthread_mutex_t lock;  // visitor output
+
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;  // a directory was queued or the walk ended
+    uint32_t sleepers;    // workers waiting on idle
+};
+
+typedef struct TreeWorker {
+    tree_walk_t *walk;
+    uint32_t id;
+} tree_worker_t;
+
+// Worker threads a filesystem can use: one unless it is open in concurrent mode
+uint32_t tree_threads(filesystem_t * fs, uint32_t threads) {
+    if (!fs->concurrent || threads < 1) {
+        return 1;
+    }
+    return threads < TREE_MAX_THREADS ? threads : TREE_MAX_THREADS;
+}
+
+// dir_path/name, malloc'ed
+char * tree_join(const char * dir_path, const char * name) {
+    size_t len = strlen(dir_path);
+    char * path = malloc(len + strlen(name) + 2);
+    sprintf(path, "%s%s%s", dir_path, len > 0 && dir_path[len - 1] == '/' ? "" : "/", name);
+    return path;
+}
+
+void tree_push(tree_walk_t * walk, uint32_t worker, uint32_t dir, char * path) {
+    // Counted before the reader of the parent is done, so pending never drops to 0 early
+    __atomic_fetch_add(&walk->pending, 1, __ATOMIC_RELAXED);
+    tree_deque_t * dq = walk->deques + worker;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->cap && dq->head > 0) {
+        memmove(dq->tasks, dq->tasks + dq->head, (dq->tail - dq->head) * sizeof(tree_task_t));
+        dq->tail -= dq->head;
+        dq->head = 0;
+    }
+    if (dq->tail == dq->cap) {
+        dq->cap = dq->cap ? dq->cap * 2 : 64;
+        dq->tasks = realloc(dq->tasks, dq->cap * sizeof(tree_task_t));
+    }
+    dq->tasks[dq->tail++] = (tree_task_t) {.dir = dir, .path = path};
+    pthread_mutex_unlock(&dq->lock);
+
+    // Sleepers count themselves before checking the deques, so each sees this task or the signal
+    if (__atomic_load_n(&walk->sleepers, __ATOMIC_SEQ_CST) != 0) {
+        pthread_mutex_lock(&walk->idle_lock);
+        pthread_cond_signal(&walk->idle);
+        pthread_mutex_unlock(&walk->idle_lock);
+    }
+}
+
+// 1 if any deque has a task
+int tree_has_work(tree_walk_t * walk) {
+    int found = 0;
+    for (uint32_t i = 0; i < walk->threads && !found; ++i) {
+        tree_deque_t * dq = walk->deques + i;
+        pthread_mutex_lock(&dq->lock);
+        found = dq->head < dq->tail;
+        pthread_mutex_unlock(&dq->lock);
+    }
+    return found;
+}
+
+// Takes the newest task of the worker's own deque, else steals the oldest of another one
+int tree_take(tree_walk_t * walk, uint32_t worker, tree_task_t * task) {
+    for (uint32_t i = 0; i < walk->threads; ++i) {
+        uint32_t victim = (worker + i) % walk->threads;
+        tree_deque_t * dq = walk->deques + victim;
+        pthread_mutex_lock(&dq->lock);
+        int found = dq->head < dq->tail;
+        if (found) {
+            *task = victim == worker ? dq->tasks[--dq->tail] : dq->tasks[dq->head++];
+        }
+        pthread_mutex_unlock(&dq->lock);
+        if (found) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void tree_read_dir(tree_walk_t * walk, uint32_t worker, const tree_task_t * task) {
+    dir_iter_t it;
+    if (fs_dir_open(walk->fs, task->dir, &it) != 0) {
+        return;
+    }
+    const dir_entry_t * entry;
+    const inode_t * inode;
+    while ((entry = fs_dir_next_with_inode(&it, &inode)) != NULL) {
+        if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0) {
+            continue;
+        }
+        if (walk->visit(walk, worker, task, entry, inode) && inode->type == DIRECTORY) {
+            tree_push(walk, worker, entry->inode, walk->keep_paths ? tree_join(task->path, entry->name) : NULL);
+        }
+    }
+    fs_dir_close(&it);
+}
+
+void * tree_walk_worker(void * arg) {
+    tree_worker_t * self = arg;
+    tree_walk_t * walk = self->walk;
+    tree_task_t task;
+    while (1) {
+        if (!tree_take(walk, self->id, &task)) {
+            pthread_mutex_lock(&walk->idle_lock);
+            __atomic_fetch_add(&walk->sleepers, 1, __ATOMIC_SEQ_CST);
+            int done;
+            while (!(done = __atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) == 0) && !tree_has_work(walk)) {
+                pthread_cond_wait(&walk->idle, &walk->idle_lock);
+            }
+            __atomic_fetch_sub(&walk->sleepers, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&walk->idle_lock);
+            if (done) {
+                break;
+            }
+            continue;
+        }
+        tree_read_dir(walk, self->id, &task);
+        free(task.path);
+        if (__atomic_sub_fetch(&walk->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+            pthread_mutex_lock(&walk->idle_lock);
+            pthread_cond_broadcast(&walk->idle);
+            pthread_mutex_unlock(&walk->idle_lock);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Visits every entry under the directory root, root itself excluded. With
+ * keep_paths the tasks carry the path of their directory, root_path for root.
+ */
+void tree_walk(filesystem_t * fs, uint32_t threads, uint32_t root, const char * root_path, int keep_paths,
+               tree_visit_t visit, void * arg) {
+    tree_walk_t * walk = calloc(1, sizeof(tree_walk_t));
+    walk->fs = fs;
+    walk->threads = tree_threads(fs, threads);
+    walk->keep_paths = keep_paths;
+    walk->visit = visit;
+    walk->arg = arg;
+    pthread_mutex_init(&walk->lock, NULL);
+    pthread_mutex_init(&walk->idle_lock, NULL);
+    pthread_cond_init(&walk->idle, NULL);
+    for (uint32_t i = 0; i < walk->threads; ++i) {
+        pthread_mutex_init(&walk->deques[i].lock, NULL);
+    }
+    tree_push(walk, 0, root, keep_paths ? strdup(root_path) : NULL);
+
+    pthread_t tids[TREE_MAX_THREADS];
+    tree_worker_t workers[TREE_MAX_THREADS];
+    for (uint32_t i = 0; i < walk->threads; ++i) {
+        workers[i] = (tree_worker_t) {.walk = walk, .id = i};
+        pthread_create(tids + i, NULL, tree_walk_worker, workers + i);
+    }
+    for (uint32_t i = 0; i < walk->threads; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+
+    for (uint32_t i = 0; i < walk->threads; ++i) {
+        pthread_mutex_destroy(&walk->deques[i].lock);
+        free(walk->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&walk->lock);
+    pthread_mutex_destroy(&walk->idle_lock);
+    pthread_cond_destroy(&walk->idle);
+    free(walk);
+}
+
+// Sets a bit shared between threads, returns 1 if it was clear
+int tree_mark(uint8_t * bitmap, uint32_t bit) {
+    uint8_t mask = 1 << (bit % 8);
+    return (__atomic_fetch_or(bitmap + bit / 8, mask, __ATOMIC_RELAXED) & mask) == 0;
+}
+
+/*
+ * du: files, directories, bytes of regular files and blocks of the subtree.
+ * A file with several names and a block shared by clones or dedup count once,
+ * blocks include directory tables and extent tree nodes.
+ */
+typedef struct TreeUsage {
+    uint64_t files, dirs, bytes, blocks;
+} tree_usage_t;
+
+typedef struct TreeDu {
+    uint8_t *inodes_seen;  // bit per inode
+    uint8_t *blocks_seen;  // bit per block
+    tree_usage_t usage[TREE_MAX_THREADS];
+} tree_du_t;
+
+uint64_t du_extents(filesystem_t * fs, tree_du_t * du, const extent_t * entries, uint32_t count, uint32_t depth) {
+    uint64_t blocks = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (depth == 0) {
+            for (uint32_t block = entries[i].start; block < entries[i].start + entries[i].len; ++block) {
+                blocks += tree_mark(du->blocks_seen, block);
+            }
+            continue;
+        }
+        blocks += tree_mark(du->blocks_seen, entries[i].start);
+        extent_t child[MAX_NODE_EXTENTS];
+        read_block(fs, entries[i].start, child);
+        blocks += du_extents(fs, du, child, entries[i].len, depth - 1);
+    }
+    return blocks;
+}
+
+void du_add(filesystem_t * fs, tree_du_t * du, uint32_t worker, uint32_t inode_idx, const inode_t * inode) {
+    if (!tree_mark(du->inodes_seen, inode_idx)) {
+        return;
+    }
+    tree_usage_t * usage = du->usage + worker;
+    if (inode->type == DIRECTORY) {
+        ++usage->dirs;
+    } else {
+        ++usage->files;
+        usage->bytes += inode->size;
+    }
+    if (!is_inode_inline(inode)) {
+        usage->blocks += du_extents(fs, du, inode->extents, inode->extent_count, inode->extent_depth);
+    }
+}
+
+int du_visit(tree_walk_t * walk, uint32_t worker, const tree_task_t * task, const dir_entry_t * entry,
+             const inode_t * inode) {
+    (void) task;
+    inode_t copy = *inode;
+    du_add(walk->fs, walk->arg, worker, entry->inode, &copy);
+    return 1;
+}
+
+void fs_du(filesystem_t * fs, uint32_t root, const char * path, uint32_t threads) {
+    tree_du_t * du = calloc(1, sizeof(tree_du_t));
+    du->inodes_seen = calloc(fs_inode_bitmap_size(fs), 1);
+    du->blocks_seen = calloc(fs_block_bitmap_size(fs), 1);
+    inode_t inode;
+    fs_stat(fs, root, &inode);
+    du_add(fs, du, 0, root, &inode);
+    if (inode.type == DIRECTORY) {
+        tree_walk(fs, threads, root, path, 0, du_visit, du);
+    }
+
+    tree_usage_t total = {0};
+    for (uint32_t i = 0; i < TREE_MAX_THREADS; ++i) {
+        total.files += du->usage[i].files;
+        total.dirs += du->usage[i].dirs;
+        total.bytes += du->usage[i].bytes;
+        total.blocks += du->usage[i].blocks;
+    }
+    printf("FILES\tDIRS\tBYTES\tBLOCKS\tPATH\n");
+    printf("%lu\t%lu\t%lu\t%lu\t%s\n", total.files, total.dirs, total.bytes, total.blocks, path);
+    free(du->inodes_seen);
+    free(du->blocks_seen);
+    free(du);
+}
+
+// find: paths of the subtree matching a name pattern and a type, in no particular order
+typedef struct TreeFind {
+    const char *pattern;  // fnmatch pattern, NULL - any name
+    int type;             // enum InodeType, -1 - any
+} tree_find_t;
+
+int find_matches(const tree_find_t * find, const char * name, const inode_t * inode) {
+    return (find->pattern == NULL || fnmatch(find->pattern, name, 0) == 0)
+           && (find->type < 0 || inode->type == (enum InodeType) find->type);
+}
+
+int find_visit(tree_walk_t * walk, uint32_t worker, const tree_task_t * task, const dir_entry_t * entry,
+               const inode_t * inode) {
+    (void) worker;
+    if (find_matches(walk->arg, entry->name, inode)) {
+        size_t len = strlen(task->path);
+        pthread_mutex_lock(&walk->lock);
+        printf("%s%s%s\n", task->path, len > 0 && task->path[len - 1] == '/' ? "" : "/", entry->name);
+        pthread_mutex_unlock(&walk->lock);
+    }
+    return 1;
+}
+
+void fs_find(filesystem_t * fs, uint32_t root, const char * path, const tree_find_t * find, uint32_t threads) {
+    inode_t inode;
+    fs_stat(fs, root, &inode);
+    const char * name = strrchr(path, '/');
+    name = name != NULL && name[1] != 0 ? name + 1 : path;
+    if (find_matches(find, name, &inode)) {
+        printf("%s\n", path);
+    }
+    if (inode.type == DIRECTORY) {
+        tree_walk(fs, threads, root, path, 1, find_visit, (void *) find);
+    }
+}
+
+/*
+ * Subtree collection for rm -r and cp -r: src holds every inode under root once,
+ * root first, parent the directory it was found in, links its names in the subtree.
+ */
+int scan_visit(tree_walk_t * walk, uint32_t worker, const tree_task_t * task, const dir_entry_t * entry,
+               const inode_t * inode) {
+    (void) worker;
+    (void) inode;
+    clone_tree_t * tree = walk->arg;
+    if (__atomic_fetch_add(tree->links + entry->inode, 1, __ATOMIC_RELAXED) != 0) {
+        return 0;  // another name of a file found already
+    }
+    uint32_t slot = __atomic_fetch_add(&tree->count, 1, __ATOMIC_RELAXED);
+    tree->src[slot] = entry->inode;
+    tree->parent[slot] = task->dir;
+    return 1;
+}
+
+void tree_scan(filesystem_t * fs, clone_tree_t * tree, uint32_t root, uint32_t threads) {
+    memset(tree, 0, sizeof(clone_tree_t));
+    tree->cap = fs->sb.inodes_count;
+    tree->src = malloc(tree->cap * sizeof(uint32_t));
+    tree->parent = malloc(tree->cap * sizeof(uint32_t));
+    tree->map = calloc(fs->sb.inodes_count, sizeof(uint32_t));
+    tree->links = calloc(fs->sb.inodes_count, sizeof(uint32_t));
+    tree->src[0] = root;
+    tree->parent[0] = 0;
+    tree->count = 1;
+    inode_t inode;
+    fs_stat(fs, root, &inode);
+    if (inode.type == DIRECTORY) {
+        tree_walk(fs, threads, root, NULL, 0, scan_visit, tree);
+    }
+}
+
+// Work on the inodes of a scanned subtree, shared by the workers TREE_CHUNK at a time
+typedef struct TreeJob {
+    filesystem_t *fs;
+    clone_tree_t *tree;
+    uint32_t next;
+    uint32_t changed;  // inodes changed since the last commit
+    uint32_t dst_dir;  // cp -r: directory the copy goes to
+    int failed;
+    int (*run)(struct TreeJob * job, uint32_t i, char * buf);  // returns 0 on success
+} tree_job_t;
+
+void * tree_job_worker(void * arg) {
+    tree_job_t * job = arg;
+    char * buf = malloc(TREE_COPY_CHUNK);
+    uint32_t from;
+    while ((from = __atomic_fetch_add(&job->next, TREE_CHUNK, __ATOMIC_RELAXED)) < job->tree->count) {
+        uint32_t to = from + TREE_CHUNK < job->tree->count ? from + TREE_CHUNK : job->tree->count;
+        for (uint32_t i = from; i < to;) {
+            // The operation ends early once a group commit is due, large directories fill it fast
+            int full = 0;
+            fs_op_begin(job->fs);
+            while (i < to && !full) {
+                if (job->run(job, i++, buf) != 0) {
+                    __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+                }
+                fs_mutex_lock(job->fs, &job->fs->meta_lock);
+                full = job->fs->journal_active && fs_meta_blocks_full(job->fs);
+                fs_mutex_unlock(job->fs, &job->fs->meta_lock);
+            }
+            fs_op_done(job->fs);
+            fs_op_end(job->fs);
+        }
+        /*
+         * Group commits only count metadata blocks, the dirty inodes of a large tree
+         * would not fit. Every worker that sees the count past the limit syncs, so
+         * none keeps taking op_lock while the commit waits for it.
+         */
+        if (job->fs->journal_active
+                && __atomic_add_fetch(&job->changed, to - from, __ATOMIC_RELAXED) >= TREE_COMMIT_INODES) {
+            fs_sync(job->fs);
+            __atomic_store_n(&job->changed, 0, __ATOMIC_RELAXED);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+// Returns 0 if every inode was done
+int tree_run_job(tree_job_t * job, uint32_t threads) {
+    threads = tree_threads(job->fs, threads);
+    pthread_t tids[TREE_MAX_THREADS];
+    for (uint32_t i = 0; i < threads; ++i) {
+        pthread_create(tids + i, NULL, tree_job_worker, job);
+    }
+    for (uint32_t i = 0; i < threads; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    return job->failed ? -1 : 0;
+}
+
+int remove_inode(tree_job_t * job, uint32_t i, char * buf) {
+    (void) buf;
+    filesystem_t * fs = job->fs;
+    uint32_t inode_idx = job->tree->src[i];
+    uint32_t links = job->tree->links[inode_idx];
+    inode_t inode;
+    fs_lock_inode(fs, inode_idx, 1);
+    read_inode(fs, inode_idx, &inode);
+    if (inode.type == REGULAR && inode.hard_links > links) {
+        // Still linked outside the subtree
+        inode.hard_links -= links;
+        write_inode(fs, inode_idx, &inode);
+    } else {
+        fs_release_inode(fs, inode_idx);
+    }
+    fs_unlock_inode(fs, inode_idx);
+    return 0;
+}
+
+/*
+ * rm -r: removes dir/name with everything under it. The entry is removed first,
+ * so an interrupted removal leaves orphans for fsck rather than dangling entries.
+ * Returns 0 on success.
+ */
+int fs_remove_tree(filesystem_t * fs, uint32_t dir, const char * name, uint32_t threads) {
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        printf("rm: cannot remove %s\n", name);
+        return -1;
+    }
+    uint32_t root = fs_dir_lookup(fs, dir, name);
+    if (root == 0) {
+        printf("rm: in dir %u not found %s\n", dir, name);
+        return -1;
+    }
+    inode_t inode;
+    fs_stat(fs, root, &inode);
+    if (inode.type != DIRECTORY) {
+        return fs_unlink(fs, name, dir);
+    }
+
+    clone_tree_t tree;
+    tree_scan(fs, &tree, root, threads);
+    fs_op_begin(fs);
+    fs_lock_inode_pair(fs, dir, root);
+    int same = dir_lookup(fs, dir, name) == root;
+    if (same) {
+        fs_dir_remove(fs, dir, name);
+        fs_op_done(fs);
+    }
+    fs_unlock_inode_pair(fs, dir, root);
+    fs_op_end(fs);
+    if (!same) {
+        printf("rm: %s changed meanwhile\n", name);
+        clone_free(&tree);
+        return -1;
+    }
+
+    tree_job_t job = {.fs = fs, .tree = &tree, .run = remove_inode};
+    int result = tree_run_job(&job, threads);
+    clone_free(&tree);
+    return result;
+}
+
+int copy_is_zero(const char * buf, uint32_t len) {
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+// Copies the contents of a regular file into a new inode, all-zero chunks but the last stay holes
+int copy_file(filesystem_t * fs, clone_tree_t * tree, uint32_t src_idx, char * buf) {
+    uint32_t dst_idx = tree->map[src_idx];
+    inode_t src;
+    read_inode(fs, src_idx, &src);
+    inode_t dst = {
+            .hard_links = tree->links[src_idx],
+            .type = REGULAR,
+            .flags = fs->compress ? INODE_COMPRESSED : 0
+    };
+    write_inode(fs, dst_idx, &dst);
+    for (uint64_t offset = 0; offset < src.size; offset += TREE_COPY_CHUNK) {
+        uint32_t len = src.size - offset < TREE_COPY_CHUNK ? src.size - offset : TREE_COPY_CHUNK;
+        fs_lock_inode(fs, src_idx, 0);
+        file_read(fs, src_idx, offset, buf, len);
+        fs_unlock_inode(fs, src_idx);
+        if (offset + len < src.size && copy_is_zero(buf, len)) {
+            continue;
+        }
+        if (file_write(fs, dst_idx, offset, buf, len) != len) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int copy_inode(tree_job_t * job, uint32_t i, char * buf) {
+    clone_tree_t * tree = job->tree;
+    uint32_t src_idx = tree->src[i];
+    if (fs_inode_ptr(job->fs, src_idx)->type == DIRECTORY) {
+        uint32_t parent = i == 0 ? job->dst_dir : tree->map[tree->parent[i]];
+        return clone_inode(job->fs, tree, src_idx, parent, 0);
+    }
+    return copy_file(job->fs, tree, src_idx, buf);
+}
+
+// 1 if inode_idx is the directory root or lies under it
+int tree_contains(filesystem_t * fs, uint32_t root, uint32_t inode_idx) {
+    while (inode_idx != root) {
+        if (inode_idx == 1 || inode_idx == 0) {
+            return 0;
+        }
+        inode_idx = fs_dir_lookup(fs, inode_idx, "..");
+    }
+    return 1;
+}
+
+/*
+ * cp -r: copies the subtree at src_idx as dst_dir/name. Unlike a clone the copy
+ * gets data blocks of its own; hard links within the subtree stay hard links.
+ * Returns the new inode, 0 on failure.
+ */
+uint32_t fs_copy_tree(filesystem_t * fs, uint32_t src_idx, uint32_t dst_dir, const char * name, uint32_t threads) {
+    if (strlen(name) >= FILE_NAME_LEN || fs_dir_lookup(fs, dst_dir, name) != 0) {
+        printf("cp: cannot create %s in dir %u\n", name, dst_dir);
+        return 0;
+    }
+    if (tree_contains(fs, src_idx, dst_dir)) {
+        printf("cp: cannot copy a directory into itself\n");
+        return 0;
+    }
+    clone_tree_t tree;
+    tree_scan(fs, &tree, src_idx, threads);
+    if (tree.count > fs->free_inodes_count) {
+        printf("cp: %u inodes needed, %u free\n", tree.count, fs->free_inodes_count);
+        clone_free(&tree);
+        return 0;
+    }
+    for (uint32_t i = 0; i < tree.count; ++i) {
+        tree.map[tree.src[i]] = fs_find_empty_inode(fs);
+    }
+
+    tree_job_t job = {.fs = fs, .tree = &tree, .dst_dir = dst_dir, .run = copy_inode};
+    int result = tree_run_job(&job, threads);
+
+    // Not reachable by other threads before it is linked
+    uint32_t root = tree.map[src_idx];
+    fs_op_begin(fs);
+    fs_lock_inode_pair(fs, dst_dir, root);
+    if (result != 0 || link_inode(fs, root, name, dst_dir) != 0) {
+        printf("cp: out of space\n");
+        for (uint32_t i = 0; i < tree.count; ++i) {
+            fs_release_inode(fs, tree.map[tree.src[i]]);
+        }
+        fs_op_done(fs);
+        root = 0;
+    }
+    fs_unlock_inode_pair(fs, dst_dir, tree.map[src_idx]);
+    fs_op_end(fs);
+    clone_free(&tree);
+    return root;
+}